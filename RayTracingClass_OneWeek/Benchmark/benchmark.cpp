@@ -0,0 +1,591 @@
+// Micro-benchmarks for the renderer's hot kernels.
+//
+//   Benchmark.exe [--filter text] [--min-time seconds]
+//
+// Every benchmark runs its kernel in growing batches until min-time has passed and
+// reports the time per call and the throughput (rays, samples or bytes per second).
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "integrator.h"
+#include "instance.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh.h"
+#include "post.h"
+#include "PPM.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "tile_scheduler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	std::string filter;
+	double min_time = 0.5;
+
+	// Every kernel folds its results into this, so the compiler cannot drop the calls.
+	volatile double sink;
+
+	bool selected(const std::string& name)
+	{
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+
+	// Times fn(n), which must run the kernel n times, and prints ns per call and
+	// items_per_call * calls per second in the given unit.
+	template <typename Fn>
+	void run(const std::string& name, Fn fn, double items_per_call = 1, const char* unit = "Mops/s", double unit_scale = 1e-6)
+	{
+		if (!selected(name))
+			return;
+
+		using clock = std::chrono::steady_clock;
+
+		fn(1);	// warm up caches and lazily initialised state
+
+		size_t n = 1;
+		double seconds = 0;
+		while (true)
+		{
+			const auto sta = clock::now();
+			fn(n);
+			seconds = std::chrono::duration<double>(clock::now() - sta).count();
+
+			if (seconds >= min_time)
+				break;
+
+			// Aim a little past min_time with the next batch.
+			const double scale = seconds > 0 ? 1.5 * min_time / seconds : 100;
+			n = static_cast<size_t>(n * (scale < 100 ? (scale > 2 ? scale : 2) : 100));
+		}
+
+		const double ns_per_call = 1e9 * seconds / n;
+		const double throughput = items_per_call * n / seconds * unit_scale;
+
+		std::cout << std::left << std::setw(40) << name << std::right
+			<< std::setw(14) << std::fixed << std::setprecision(2) << ns_per_call << " ns/op"
+			<< std::setw(14) << std::setprecision(2) << throughput << ' ' << unit << '\n';
+	}
+
+	// Unit-length directions, so kernels that normalise see the same inputs as in a render.
+	std::vector<ray> make_rays(size_t count, const point3& origin, const point3& target, real spread, uint64_t seed)
+	{
+		sampler smp(seed, false);
+		std::vector<ray> rays;
+		rays.reserve(count);
+
+		for (size_t k = 0; k < count; ++k)
+		{
+			const point3 aim = target + spread * random_in_unit_sphere(smp);
+			rays.push_back(ray(origin, unit_vector(aim - origin)));
+		}
+
+		return rays;
+	}
+
+	hittable_list random_spheres(size_t count, uint64_t seed)
+	{
+		sampler smp(seed, false);
+		hittable_list list;
+
+		for (size_t k = 0; k < count; ++k)
+		{
+			const point3 center = vec3::random(-10, 10, smp);
+			list.add(make_shared<sphere>(center, real(smp.get_1d(0.1, 0.5)), 0));
+		}
+
+		return list;
+	}
+
+	// Latitude-longitude sphere of radius 8 as an indexed mesh: 2 * rings * rings triangles.
+	mesh_data sphere_mesh(int rings)
+	{
+		mesh_data mesh;
+		for (int i = 0; i <= rings; ++i)
+		{
+			for (int j = 0; j < rings; ++j)
+			{
+				const double theta = pi * i / rings, phi = 2 * pi * j / rings;
+				mesh.vertices.push_back(vec3_t<float>(static_cast<float>(8 * std::sin(theta) * std::cos(phi)),
+					static_cast<float>(8 * std::cos(theta)), static_cast<float>(8 * std::sin(theta) * std::sin(phi))));
+			}
+		}
+
+		for (int i = 0; i < rings; ++i)
+		{
+			for (int j = 0; j < rings; ++j)
+			{
+				const uint32_t a = i * rings + j, b = i * rings + (j + 1) % rings;
+				for (uint32_t index : { a, b + rings, b, a, a + rings, b + rings })
+					mesh.indices.push_back(index);
+			}
+		}
+		return mesh;
+	}
+
+	// Flat square grid of side 16 in the plane y = 0: 2 * cells * cells triangles.
+	mesh_data grid_mesh(int cells)
+	{
+		mesh_data mesh;
+		for (int i = 0; i <= cells; ++i)
+			for (int j = 0; j <= cells; ++j)
+				mesh.vertices.push_back(vec3_t<float>(16.0f * j / cells - 8, 0, 16.0f * i / cells - 8));
+
+		for (int i = 0; i < cells; ++i)
+		{
+			for (int j = 0; j < cells; ++j)
+			{
+				const uint32_t a = i * (cells + 1) + j, b = a + cells + 1;
+				for (uint32_t index : { a, b, b + 1, a, b + 1, a + 1 })
+					mesh.indices.push_back(index);
+			}
+		}
+		return mesh;
+	}
+
+	void intersection_benchmarks()
+	{
+		const size_t n_rays = 1024;
+
+		// sphere::hit: the same sphere, rays aimed at it and rays aimed away from it.
+		{
+			const sphere s(point3(0, 0, -5), 1, 0);
+			const std::vector<ray> hit_rays = make_rays(n_rays, point3(0, 0, 0), point3(0, 0, -5), real(0.5), 1);
+			const std::vector<ray> miss_rays = make_rays(n_rays, point3(0, 0, 0), point3(0, 0, 5), real(0.5), 2);
+
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				const std::vector<ray>& rays = pass == 0 ? hit_rays : miss_rays;
+				run(pass == 0 ? "sphere::hit (hit)" : "sphere::hit (miss)", [&](size_t n) {
+					hit_record rec;
+					double acc = 0;
+					for (size_t k = 0; k < n; ++k)
+						acc += s.hit(rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+					sink = acc;
+				}, 1, "Mrays/s");
+			}
+		}
+
+		// hittable_list::hit and bvh_node::hit over random spheres, rays from outside into the cloud.
+		const std::vector<ray> rays = make_rays(n_rays, point3(0, 0, 30), point3(0, 0, 0), 10, 3);
+
+		for (size_t count : { 1, 16, 256, 4096 })
+		{
+			const hittable_list list = random_spheres(count, 4);
+			const bvh_node bvh(list);
+
+			const std::string suffix = " (n=" + std::to_string(count) + ")";
+
+			run("hittable_list::hit" + suffix, [&](size_t n) {
+				hit_record rec;
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += list.hit(rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+				sink = acc;
+			}, 1, "Mrays/s");
+
+			run("bvh_node::hit" + suffix, [&](size_t n) {
+				hit_record rec;
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += bvh.hit(rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+				sink = acc;
+			}, 1, "Mrays/s");
+
+			// The same rays as shadow rays: stop at the first blocker, no hit record.
+			run("bvh_node::occluded" + suffix, [&](size_t n) {
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += bvh.occluded(rays[k % n_rays], real(0.001), infinity);
+				sink = acc;
+			}, 1, "Mrays/s");
+		}
+
+		// The same 256-sphere BVH behind an instance transform: the cost of moving the ray into object space.
+		{
+			const shared_ptr<hittable> blas = make_shared<bvh_node>(random_spheres(256, 4));
+			const instance inst(blas, transform::rotate(vec3(0, 1, 0), 30) * transform::scale(real(1.2)));
+
+			run("instance::hit (n=256)", [&](size_t n) {
+				hit_record rec;
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += inst.hit(rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+				sink = acc;
+			}, 1, "Mrays/s");
+		}
+
+		// triangle_mesh::hit: a tessellated sphere, so its cost can be held against sphere::hit.
+		for (int rings : { 16, 64, 256 })
+		{
+			const triangle_mesh mesh(sphere_mesh(rings), 0);
+
+			run("triangle_mesh::hit (n=" + std::to_string(mesh.size()) + ")", [&](size_t n) {
+				hit_record rec;
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += mesh.hit(rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+				sink = acc;
+			}, 1, "Mrays/s");
+
+			run("triangle_mesh::occluded (n=" + std::to_string(mesh.size()) + ")", [&](size_t n) {
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += mesh.occluded(rays[k % n_rays], real(0.001), infinity);
+				sink = acc;
+			}, 1, "Mrays/s");
+		}
+
+		// An axis-aligned mesh has flat BVH boxes; every one of these rays, from straight down
+		// to oblique, lands inside the grid, so a miss means the traversal skipped a flat box.
+		{
+			const triangle_mesh mesh(grid_mesh(64), 0);
+			const std::vector<ray> down_rays = make_rays(n_rays, point3(0, 10, 0), point3(0, 0, 0), 4, 5);
+			const std::string name = "triangle_mesh::hit (flat, n=" + std::to_string(mesh.size()) + ")";
+
+			hit_record rec;
+			size_t misses = 0;
+			for (const ray& r : down_rays)
+				misses += !mesh.hit(r, real(0.001), infinity, rec) || !mesh.occluded(r, real(0.001), infinity);
+			if (selected(name) && misses > 0)
+				std::cerr << name << ": " << misses << " of " << n_rays << " rays missed the grid\n";
+
+			run(name, [&](size_t n) {
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+					acc += mesh.hit(down_rays[k % n_rays], real(0.001), infinity, rec) ? rec.t : 1;
+				sink = acc;
+			}, 1, "Mrays/s");
+		}
+	}
+
+	// A whole frame rendered tile by tile on one thread, with the tiles and their pixels in
+	// each order. The scene is a million-triangle mesh, far larger than the caches, so the
+	// difference is how much of the BVH and the triangles consecutive rays share.
+	void tile_order_benchmarks()
+	{
+		if (!selected("render (tile order"))
+			return;
+
+		const int width = 256, height = 256;
+		material_table materials;
+		const triangle_mesh mesh(sphere_mesh(724), materials.add(make_lambertian(color(0.6, 0.6, 0.6))));
+		const camera cam(point3(0, 0, 20), point3(0, 0, 0), vec3(0, 1, 0), 50, 1, 0, 20);
+		const light_list lights;
+
+		for (int tile_size : { 32, 256 })
+		for (tile_order order : { tile_order::scanline, tile_order::morton, tile_order::hilbert })
+		{
+			const std::vector<tile> tiles = make_tiles(width, height, tile_size, order);
+			tile_pixel_order pixel_order(order);
+
+			run(std::string("render (tile order ") + tile_order_name(order) + ", " + std::to_string(tile_size) + " px)", [&](size_t n) {
+				sampler smp(7, true);
+				path_stats stats(4);
+				double acc = 0;
+				for (size_t frame = 0; frame < n; ++frame)
+				{
+					for (const tile& t : tiles)
+					{
+						for (const tile_pixel& px : pixel_order.get(t))
+						{
+							const int i = t.x0 + px.dx, j = t.y0 + px.dy;
+							smp.start_sample(static_cast<uint64_t>(j) * width + i, static_cast<uint32_t>(frame));
+							const sample2 jitter = smp.get_2d();
+							const ray r = cam.get_ray(real(i + jitter.x) / (width - 1), real(j + jitter.y) / (height - 1), smp);
+							acc += ray_color(r, mesh, materials, lights, 4, 3, smp, stats).x();
+						}
+					}
+				}
+				sink = acc;
+			}, width * height, "Msamples/s");
+		}
+	}
+
+	void material_benchmarks()
+	{
+		material_table materials;
+		const uint32_t ids[] = {
+			materials.add(make_lambertian(color(0.5, 0.5, 0.5))),
+			materials.add(make_metal(color(0.7, 0.6, 0.5), real(0.3))),
+			materials.add(make_dielectric(real(1.5)))
+		};
+		const char* names[] = { "scatter (lambertian)", "scatter (metal)", "scatter (dielectric)" };
+
+		// One hit on the front of a unit sphere, incoming rays from around the camera.
+		const sphere s(point3(0, 0, -5), 1, 0);
+		const std::vector<ray> rays = make_rays(1024, point3(0, 0, 0), point3(0, 0, -5), real(0.5), 5);
+		std::vector<hit_record> hits(rays.size());
+		for (size_t k = 0; k < rays.size(); ++k)
+			s.hit(rays[k], real(0.001), infinity, hits[k]);
+
+		for (int m = 0; m < 3; ++m)
+		{
+			const material& mat = materials[ids[m]];
+			run(names[m], [&](size_t n) {
+				sampler smp(6, false);
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+				{
+					const size_t i = k % rays.size();
+					color attenuation;
+					ray scattered;
+					if (scatter(mat, rays[i], hits[i], attenuation, scattered, smp))
+						acc += scattered.direction().x();
+				}
+				sink = acc;
+			}, 1, "Mrays/s");
+		}
+
+		// Direction towards one of 16 sphere lights, seen from the hit points above.
+		std::vector<sphere_light> spheres;
+		sampler light_rng(14, false);
+		for (uint32_t k = 0; k < 16; ++k)
+			spheres.push_back({ point3(real(light_rng.get_1d(-10, 10)), 8, real(light_rng.get_1d(-15, 5))), real(0.5), k, color(4, 4, 4) });
+		const light_list lights(spheres, false);
+
+		run("light_list::sample", [&](size_t n) {
+			sampler smp(15, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				light_sample ls;
+				if (lights.sample(hits[k % hits.size()].p, smp, ls))
+					acc += ls.pdf;
+			}
+			sink = acc;
+		}, 1, "Msamples/s");
+	}
+
+	void camera_benchmarks()
+	{
+		const camera cam(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20, 3.0 / 2.0, 0.1, 10.0);
+
+		run("camera::get_ray", [&](size_t n) {
+			sampler smp(7, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				const real u = real(k & 1023) / 1023;
+				const real v = real((k >> 10) & 1023) / 1023;
+				acc += cam.get_ray(u, v, smp).direction().x();
+			}
+			sink = acc;
+		}, 1, "Mrays/s");
+	}
+
+	void sampling_benchmarks()
+	{
+		run("sampler::get_1d", [](size_t n) {
+			sampler smp(8, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+				acc += smp.get_1d();
+			sink = acc;
+		}, 1, "Msamples/s");
+
+		run("sampler::start_sample", [](size_t n) {
+			sampler smp(8, true);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+			{
+				smp.start_sample(k, k & 31);
+				acc += smp.get_1d();
+			}
+			sink = acc;
+		}, 1, "Msamples/s");
+
+		for (sample_pattern pattern : { sample_pattern::stratified, sample_pattern::sobol, sample_pattern::halton })
+		{
+			run(std::string("sampler::get_2d (") + sample_pattern_name(pattern) + ")", [pattern](size_t n) {
+				sampler smp(8, true, pattern, 64);
+				double acc = 0;
+				for (size_t k = 0; k < n; ++k)
+				{
+					smp.start_sample(k >> 6, k & 63);
+					const sample2 u = smp.get_2d();
+					acc += u.x + u.y;
+				}
+				sink = acc;
+			}, 1, "Msamples/s");
+		}
+
+		run("random_in_unit_sphere", [](size_t n) {
+			sampler smp(9, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+				acc += random_in_unit_sphere(smp).x();
+			sink = acc;
+		}, 1, "Msamples/s");
+
+		run("random_unit_vector", [](size_t n) {
+			sampler smp(10, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+				acc += random_unit_vector(smp).x();
+			sink = acc;
+		}, 1, "Msamples/s");
+
+		run("random_in_hemisphere", [](size_t n) {
+			sampler smp(11, false);
+			const vec3 normal(0, 1, 0);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+				acc += random_in_hemisphere(normal, smp).x();
+			sink = acc;
+		}, 1, "Msamples/s");
+
+		run("random_in_unit_disk", [](size_t n) {
+			sampler smp(12, false);
+			double acc = 0;
+			for (size_t k = 0; k < n; ++k)
+				acc += random_in_unit_disk(smp).x();
+			sink = acc;
+		}, 1, "Msamples/s");
+	}
+
+	void ppm_benchmarks()
+	{
+		const int width = 1200, height = 800;
+		PPM image(height, width);
+
+		sampler smp(13, false);
+		for (int j = 0; j < height; ++j)
+		{
+			for (int i = 0; i < width; ++i)
+			{
+				PPM::RGB& p = image.image[j][i];
+				p.r = static_cast<unsigned char>(256 * smp.get_1d());
+				p.g = static_cast<unsigned char>(256 * smp.get_1d());
+				p.b = static_cast<unsigned char>(256 * smp.get_1d());
+			}
+		}
+
+		const std::string path = "benchmark_output.ppm";
+		const double bytes = 3.0 * width * height;
+
+		for (const char* version : { "P3", "P6" })
+		{
+			image.set_version(version);
+			run(std::string("PPM::save (") + version + ", 1200x800)", [&](size_t n) {
+				for (size_t k = 0; k < n; ++k)
+					image.save(path);
+			}, bytes, "MB/s (pixel data)");
+		}
+
+		std::remove(path.c_str());
+	}
+
+	// The post-processing kernels on a 4K frame, scalar against the detected instruction set.
+	void post_benchmarks()
+	{
+		// The setup is heavy: skip it unless the filter is empty or names a post benchmark.
+		if (!selected("post: ") && filter.find("post: ") == std::string::npos)
+			return;
+
+		const int width = 3840, height = 2160;
+		const double pixels = double(width) * height;
+
+		// Above ACES's lower fixed point (0.062), so tone mapping the same image over and
+		// over does not sink it into denormals.
+		film f(width, height);
+		sampler smp(17, false);
+		for (film::pixel& p : f.data())
+			for (int c = 0; c < 3; ++c)
+				p.mean[c] = static_cast<float>(0.1 + 2 * smp.get_1d() * smp.get_1d());
+
+		const hdr_image source(f);
+		PPM ppm(height, width);
+		tile_scheduler scheduler(1);
+
+		run("post: film::write (write_color, 4K)", [&](size_t n) {
+			for (size_t k = 0; k < n; ++k)
+				f.write(ppm);
+			sink = ppm.image[0][0].r;
+		}, pixels, "Mpixels/s");
+
+		// The post kernels go up to AVX2.
+		const simd_level fastest = detect_simd_level() >= simd_level::avx2 ? simd_level::avx2 : simd_level::scalar;
+		for (simd_level level : { simd_level::scalar, fastest })
+		{
+			const post_processor post(level);
+			const std::string suffix = std::string(" (") + simd_level_name(level) + ", 4K)";
+			hdr_image image = source;
+
+			run("post: write" + suffix, [&](size_t n) {
+				for (size_t k = 0; k < n; ++k)
+					post.write(image, ppm, scheduler);
+				sink = ppm.image[0][0].r;
+			}, pixels, "Mpixels/s");
+
+			run("post: tonemap aces" + suffix, [&](size_t n) {
+				for (size_t k = 0; k < n; ++k)
+					post.tonemap(image, 0, tonemap_curve::aces, scheduler);
+				sink = image.row(0, 0)[0];
+			}, pixels, "Mpixels/s");
+
+			run("post: gray_scale" + suffix, [&](size_t n) {
+				for (size_t k = 0; k < n; ++k)
+					post.gray_scale(image, scheduler);
+				sink = image.row(0, 0)[0];
+			}, pixels, "Mpixels/s");
+
+			run("post: horizontal_flip" + suffix, [&](size_t n) {
+				for (size_t k = 0; k < n; ++k)
+					post.horizontal_flip(image, scheduler);
+				sink = image.row(0, 0)[0];
+			}, pixels, "Mpixels/s");
+
+			for (resample_filter filter : { resample_filter::bilinear, resample_filter::lanczos })
+			{
+				run(std::string("post: resample ") + resample_filter_name(filter) + " to 1080p" + suffix, [&](size_t n) {
+					for (size_t k = 0; k < n; ++k)
+						sink = post.resample(source, 1920, 1080, filter, scheduler).row(0, 0)[0];
+				}, pixels, "Mpixels/s");
+			}
+
+			if (fastest == simd_level::scalar)
+				break;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	for (int a = 1; a < argc; ++a)
+	{
+		const std::string arg = argv[a];
+		if (arg == "--filter" && a + 1 < argc)
+			filter = argv[++a];
+		else if (arg == "--min-time" && a + 1 < argc)
+			min_time = std::atof(argv[++a]);
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--filter text] [--min-time seconds]\n";
+			return 1;
+		}
+	}
+
+	std::cout << "precision: " << (sizeof(real) == sizeof(float) ? "float" : "double") << '\n';
+
+	intersection_benchmarks();
+	tile_order_benchmarks();
+	material_benchmarks();
+	camera_benchmarks();
+	sampling_benchmarks();
+	ppm_benchmarks();
+	post_benchmarks();
+
+	return 0;
+}
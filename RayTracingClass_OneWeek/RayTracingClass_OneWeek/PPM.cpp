@@ -1,7 +1,58 @@
 #include "PPM.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
 
 using namespace std;
 
+namespace
+{
+	PPM::RGB* allocate_pixels(size_t count)
+	{
+		const size_t bytes = max<size_t>(count * sizeof(PPM::RGB), 1);
+#ifdef _WIN32
+		return static_cast<PPM::RGB*>(_aligned_malloc(bytes, PPM_ALIGNMENT));
+#else
+		void* p = nullptr;
+		return posix_memalign(&p, PPM_ALIGNMENT, bytes) == 0 ? static_cast<PPM::RGB*>(p) : nullptr;
+#endif
+	}
+
+	void free_pixels(PPM::RGB* pixels)
+	{
+#ifdef _WIN32
+		_aligned_free(pixels);
+#else
+		free(pixels);
+#endif
+	}
+
+	// Reads the next header field, skipping whitespace and # comments.
+	bool next_token(const unsigned char* data, size_t size, size_t& pos, string& token)
+	{
+		while (pos < size)
+		{
+			if (data[pos] == '#')
+				while (pos < size && data[pos] != '\n') pos++;
+			else if (isspace(data[pos]))
+				pos++;
+			else
+				break;
+		}
+
+		token.clear();
+		while (pos < size && !isspace(data[pos]))
+			token += static_cast<char>(data[pos++]);
+
+		return !token.empty();
+	}
+}
+
 PPM::~PPM()
 {
 	delete_image();
@@ -15,6 +66,27 @@ PPM::PPM(int height, int width)
 	create_image();
 }
 
+PPM::PPM(const PPM& other)
+	: width(other.width), height(other.height), version(other.version)
+{
+	create_image();
+	memcpy(image.data(), other.image.data(), size_t(width) * height * sizeof(RGB));
+}
+
+PPM& PPM::operator=(const PPM& other)
+{
+	if (this != &other)
+	{
+		PPM copy(other);
+		swap(image, copy.image);
+		swap(width, copy.width);
+		swap(height, copy.height);
+		swap(version, copy.version);
+	}
+
+	return *this;
+}
+
 void PPM::save(string name_file)
 {
 	ofstream output(name_file, ios::binary);
@@ -28,20 +100,37 @@ void PPM::save(string name_file)
 
 		if (version == "P3")
 		{
+			// Format into one buffer and write it at once instead of three stream insertions per pixel.
+			string text;
+			text.reserve(size_t(width) * height * 12);
+
+			char number[4];
+			auto append = [&](unsigned char value, char separator) {
+				int n = 0;
+				if (value >= 100) number[n++] = static_cast<char>('0' + value / 100);
+				if (value >= 10) number[n++] = static_cast<char>('0' + value / 10 % 10);
+				number[n++] = static_cast<char>('0' + value % 10);
+				number[n++] = separator;
+				text.append(number, n);
+			};
+
 			for (int i = height - 1; i >= 0; i--)
 			{
 				for (int j = 0; j < width; j++)
 				{
-					output << (int)image[i][j].r << ' ';
-					output << (int)image[i][j].g << ' ';
-					output << (int)image[i][j].b << '\n';
+					append(image[i][j].r, ' ');
+					append(image[i][j].g, ' ');
+					append(image[i][j].b, '\n');
 				}
 			}
+
+			output.write(text.data(), text.size());
 		}
 		else if (version == "P6")
-			for (int i = 0; i < height; i++)
-				for (int j = 0; j < width; j++)
-					output.write((char*)&image[i][j], sizeof(RGB));
+		{
+			// Rows are contiguous and unpadded, so the whole raster is a single write.
+			output.write(reinterpret_cast<const char*>(image.data()), streamsize(width) * height * sizeof(RGB));
+		}
 
 		output.close();
 	}
@@ -49,134 +138,116 @@ void PPM::save(string name_file)
 
 void PPM::read(string name_file)
 {
-	ifstream input(name_file, ios::binary);
+	mapped_file input(name_file);
 
 	if (input.is_open())
 	{
-		int color;
-		char ver[3];
+		const unsigned char* data = input.data();
+		const size_t size = input.size();
+		size_t pos = 0;
+
+		string ver, w, h, color;
+		if (!next_token(data, size, pos, ver) || !next_token(data, size, pos, w) ||
+			!next_token(data, size, pos, h) || !next_token(data, size, pos, color))
+			return;
 
-		input.read(ver, 2);
 		version = ver;
-		input >> width;
-		input >> height;
-		input >> color;
-		input.read(ver, 1);
+		width = atoi(w.c_str());
+		height = atoi(h.c_str());
+		pos++;	// single whitespace after the maximum value
 
 		create_image();
 
-		int box;
+		const size_t n_bytes = size_t(width) * height * sizeof(RGB);
 		if (version == "P3")
 		{
-			for (int i = 0; i < height; i++)
-			{
-				for (int j = 0; j < width; j++)
-				{
-					input >> box;
-					image[i][j].r = box;
-
-					input >> box;
-					image[i][j].g = box;
-
-					input >> box;
-					image[i][j].b = box;
-				}
-			}
+			unsigned char* out = reinterpret_cast<unsigned char*>(image.data());
+			string token;
+			for (size_t k = 0; k < n_bytes && next_token(data, size, pos, token); k++)
+				out[k] = static_cast<unsigned char>(atoi(token.c_str()));
+		}
+		else if (pos <= size)
+		{
+			memcpy(image.data(), data + pos, min(n_bytes, size - pos));
 		}
-		else
-			for (int i = 0; i < height; i++)
-				for (int j = 0; j < width; j++)
-					input.read((char*)&image[i][j], sizeof(RGB));
-
-		input.close();
 	}
 }
 
 void PPM::create_image()
 {
-	if (image != nullptr)
+	if (image.data() != nullptr)
 		delete_image();
 
-	image = new RGB * [height];
+	const size_t count = size_t(width) * height;
+	image = view(allocate_pixels(count), width);
 
-	for (int i = 0; i < height; i++)
-	{
-		image[i] = new RGB[width];
-
-		for (int j = 0; j < width; j++)
-		{
-			image[i][j].r = 255;
-			image[i][j].g = 255;
-			image[i][j].b = 255;
-		}
-	}
+	memset(image.data(), 255, count * sizeof(RGB));
 }
 
 void PPM::horizontal_flip()
 {
 	for (int i = 0; i < height; i++)
-		for (int j = 0; j < width; j++)
-			std::swap(image[i][j], image[i][width - 1 - j]);
+		reverse(image[i], image[i] + width);
 }
 
 void PPM::vertical_flip()
 {
-	for (int i = 0; i < height; i++)
-		for (int j = 0; j < width; j++)
-			std::swap(image[i][j], image[height - 1 - i][j]);
+	for (int i = 0; i < height / 2; i++)
+		swap_ranges(image[i], image[i] + width, image[height - 1 - i]);
 }
 
 void PPM::gray_scale()
 {
-	const float r = 0.299f;
-	const float g = 0.587f;
-	const float b = 0.114f;
-	float grayscaleValue;
+	// A byte v covers the linear values [v^2, (v+1)^2) / 65536 under gamma 2; take the middle.
+	float linear[256];
+	for (int v = 0; v < 256; v++)
+	{
+		const float x = (v + 0.5f) / 256.0f;
+		linear[v] = x * x;
+	}
 
-	for (int i = 0; i < height; i++)
-		for (int j = 0; j < width; j++)
-		{
-			grayscaleValue = image[i][j].r * r + image[i][j].g * g + image[i][j].b * b;
-			image[i][j].r = grayscaleValue;
-			image[i][j].g = grayscaleValue;
-			image[i][j].b = grayscaleValue;
-		}
+	RGB* pixels = image.data();
+	const size_t count = size_t(width) * height;
+
+	for (size_t k = 0; k < count; k++)
+	{
+		const float l = 0.2126f * linear[pixels[k].r] + 0.7152f * linear[pixels[k].g] + 0.0722f * linear[pixels[k].b];
+
+		// Gamma 2 again, as post_gamma_byte: floor(256 sqrt(l)), at most 255.
+		const float y = min(floor(l * 65536.0f), 65535.0f);
+		const unsigned char grayscaleValue = static_cast<unsigned char>(sqrt(y));
+		pixels[k].r = grayscaleValue;
+		pixels[k].g = grayscaleValue;
+		pixels[k].b = grayscaleValue;
+	}
 }
 
 void PPM::delete_image()
 {
-	if (image != nullptr)
+	if (image.data() != nullptr)
 	{
-		for (int i = 0; i < height; i++)
-			delete image[i];
-
-		delete image;
+		free_pixels(image.data());
+		image = view();
 	}
 }
 
 void PPM::resize(int height, int width)
 {
-	RGB** image_resized = new RGB * [height];
+	// Nearest-neighbour: every output pixel copies the source pixel under its position.
+	view resized(allocate_pixels(size_t(width) * height), width);
 
 	for (int i = 0; i < height; i++)
 	{
-		image_resized[i] = new RGB[width];
+		const RGB* src_row = image[i * this->height / height];
+		RGB* dst_row = resized[i];
 
 		for (int j = 0; j < width; j++)
-		{
-			image_resized[i][j].r = 255;
-			image_resized[i][j].g = 255;
-			image_resized[i][j].b = 255;
-		}
+			dst_row[j] = src_row[j * this->width / width];
 	}
 
-	for (int i = 0; i < height; i++)
-		for (int j = 0; j < height; j++)
-			image_resized[i][j] = image[i * this->height / height][i * this->width / width];
-
 	delete_image();
 
-	image = image_resized;
+	image = resized;
 	this->height = height;
 	this->width = width;
-}
\ No newline at end of file
+}
@@ -2,8 +2,11 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <cstddef>
+#include <string>
 
 #define PPM_VERSION "P6"
+#define PPM_ALIGNMENT 64
 
 class PPM
 {
@@ -13,6 +16,9 @@ public:
 	PPM(int height, int width);
 	PPM() {}
 
+	PPM(const PPM& other);
+	PPM& operator=(const PPM& other);
+
 	struct RGB
 	{
 		unsigned char r;
@@ -20,21 +26,43 @@ public:
 		unsigned char b;
 	};
 
+	// Row view over the pixel buffer: image[row][col], row i starting stride pixels after row i - 1.
+	class view
+	{
+	public:
+		view() {}
+		view(RGB* data, int stride) : pixels(data), row_stride(stride) {}
+
+		RGB* operator[](int row) const { return pixels + static_cast<ptrdiff_t>(row) * row_stride; }
+
+		RGB* data() const { return pixels; }
+		int stride() const { return row_stride; }
+
+	private:
+		RGB* pixels = nullptr;
+		int row_stride = 0;
+	};
+
 	void set_width(int width) { this->width = width; }
 	void set_height(int height) { this->height = height; }
 	void set_version(std::string version) { this->version = version; }
 
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+
 	void save(std::string name_file);
 	void read(std::string name_file);
 
 	void horizontal_flip();
 	void vertical_flip();
+	// Rec. 709 luminance of the linear colour, the same gray as post_processor::gray_scale.
 	void gray_scale();
 	void resize(int height, int width);
 
 	void delete_image();
 
-	RGB** image = nullptr;
+	// All height * width pixels live in one PPM_ALIGNMENT-aligned block, row after row.
+	view image;
 
 private:
 	int width = 0;
@@ -42,4 +70,4 @@ private:
 	std::string version = PPM_VERSION;
 
 	void create_image();
-};
\ No newline at end of file
+};
@@ -1,150 +1,607 @@
 #include "rtweekend.h"
 
 #include "hittable_list.h"
+#include "instance.h"
+#include "mesh.h"
 #include "color.h"
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
+#include "bvh.h"
+#include "sphere_set.h"
+#include "lights.h"
+#include "integrator.h"
+#include "wavefront.h"
+#include "film.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "instrument.h"
+#include "post.h"
+#include "preview.h"
+#include "profile.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "tile_scheduler.h"
 
 #include <iostream>
 #include <vector>
-#include <thread>
-#include <future>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #include <chrono>
+#include <string>
 
 #define IMAGE_WIDTH 1200
 #define SAMPLES_PER_PIXEL 500
-#define N_THREADS 10
-
-color ray_color(const ray& r, const hittable& world, int depth);
-hittable_list random_scene();
-
-int main()
+#define N_THREADS 0			// 0 = one worker per hardware thread
+#define TILE_SIZE 32
+#define TILE_ORDER tile_order::hilbert	// scanline, morton or hilbert: the order of the tiles and of the pixels inside them
+#define USE_BVH 1			// 0 = intersect the flat hittable_list
+#define USE_SPHERE_SET 0	// 1 = SIMD sphere_set instead of the list/BVH
+#define USE_WAVEFRONT 0		// 1 = wavefront integrator instead of depth-first ray_color
+#define NEXT_EVENT_ESTIMATION 1		// 0 = diffuse_light spheres are only found by bounces that happen to hit them
+#define RR_MIN_DEPTH 3		// bounces before Russian roulette may end a path; >= max_depth turns it off
+#define PASS_SPP 32			// samples added to every unfinished pixel per progressive pass
+#define ADAPTIVE_SAMPLING 0	// 1 = stop sampling pixels once their noise is below NOISE_THRESHOLD
+#define MIN_SPP 32
+#define NOISE_THRESHOLD 0.01	// 95% confidence half-width in output units (1/255 ~ 0.004)
+#define SPP_HEATMAP 1		// 1 = also write Result_spp.ppm with the samples spent per pixel
+#define EXPOSURE 0.0f		// stops: post-processing scales the linear image by 2^EXPOSURE
+#define TONEMAP tonemap_curve::none	// none (clip at 1), reinhard or aces
+#define RESAMPLE_FILTER resample_filter::lanczos	// box, bilinear or lanczos, for --resize
+#define DENOISE 0			// 1 = denoise Result.ppm guided by first-hit normal, albedo and depth; Result_noisy.ppm keeps the raw film
+#define RNG_SEED 0
+#define COUNTER_BASED_RNG 1	// 1 = seed every sample from (pixel, sample, bounce); output does not depend on thread count
+#define SAMPLE_PATTERN sample_pattern::sobol	// independent, stratified, sobol or halton; needs COUNTER_BASED_RNG
+#define CHECKPOINT_FILE "Result.ckpt"
+#define CHECKPOINT_SECONDS 60	// minimum time between checkpoints; one is always written after the last pass
+#define PREVIEW_BLOCK 4		// --preview: the coarsest level renders one pixel per 4x4 block, then 2x2, then all
+#define PREVIEW_SECONDS 0.5	// --preview: minimum time between frames inside a level or pass
+#define PROFILE_FILE "Result_profile.json"	// RT_INSTRUMENT=1 builds also write Result_cost.ppm
+
+scene_desc random_scene();
+hittable_list city_scene(int n_instances, material_table& materials, scene_settings& settings);
+
+int main(int argc, char* argv[])
 {
 	const auto sta = std::chrono::steady_clock::now();
 
+	bool resume = false;
+	bool write_checkpoints = true;
+	std::string checkpoint_file = CHECKPOINT_FILE;
+	std::string scene_file;
+	std::string export_file;
+	int city_instances = 0;		// > 0: render an instanced city instead of the random scene
+	unsigned n_threads = N_THREADS;
+	int tile_size = TILE_SIZE;
+	tile_order order = TILE_ORDER;
+	int coordinator_port = -1;		// >= 0: hand tiles to worker processes instead of rendering them here
+	std::string bind_address = DIST_BIND_ADDRESS;
+	int spawn_workers = 0;
+	std::string worker_address;		// non-empty: render tiles for the coordinator at this host:port
+	std::string preview_path;		// non-empty: write progressive preview frames here, "-" for stdout
+	float exposure = EXPOSURE;
+	tonemap_curve curve = TONEMAP;
+	resample_filter filter = RESAMPLE_FILTER;
+	int output_width = 0, output_height = 0;	// > 0: resample the image to this size
+
+	for (int a = 1; a < argc; ++a)
+	{
+		const std::string arg = argv[a];
+		if (arg == "--resume")
+			resume = true;
+		else if (arg == "--checkpoint" && a + 1 < argc)
+			checkpoint_file = argv[++a];
+		else if (arg == "--no-checkpoint")
+			write_checkpoints = false;
+		else if (arg == "--scene" && a + 1 < argc)
+			scene_file = argv[++a];
+		else if (arg == "--export-scene" && a + 1 < argc)
+			export_file = argv[++a];
+		else if (arg == "--city" && a + 1 < argc)
+			city_instances = std::atoi(argv[++a]);
+		else if (arg == "--threads" && a + 1 < argc)
+			n_threads = static_cast<unsigned>(std::atoi(argv[++a]));
+		else if (arg == "--tile-size" && a + 1 < argc && std::atoi(argv[a + 1]) > 0)
+			tile_size = std::atoi(argv[++a]);
+		else if (arg == "--tile-order" && a + 1 < argc && parse_tile_order(argv[a + 1], order))
+			++a;
+		else if (arg == "--coordinator" && a + 1 < argc)
+			coordinator_port = std::atoi(argv[++a]);
+		else if (arg == "--bind" && a + 1 < argc)
+			bind_address = argv[++a];
+		else if (arg == "--spawn" && a + 1 < argc)
+			spawn_workers = std::atoi(argv[++a]);
+		else if (arg == "--worker" && a + 1 < argc)
+			worker_address = argv[++a];
+		else if (arg == "--preview" && a + 1 < argc)
+			preview_path = argv[++a];
+		else if (arg == "--exposure" && a + 1 < argc)
+			exposure = static_cast<float>(std::atof(argv[++a]));
+		else if (arg == "--tonemap" && a + 1 < argc && parse_tonemap_curve(argv[a + 1], curve))
+			++a;
+		else if (arg == "--resize" && a + 2 < argc && std::atoi(argv[a + 1]) > 0 && std::atoi(argv[a + 2]) > 0)
+		{
+			output_width = std::atoi(argv[++a]);
+			output_height = std::atoi(argv[++a]);
+		}
+		else if (arg == "--resample" && a + 1 < argc && parse_resample_filter(argv[a + 1], filter))
+			++a;
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--resume] [--checkpoint file | --no-checkpoint] [--scene file | --city n] [--export-scene file] [--threads n]\n"
+				<< "       [--tile-size n] [--tile-order scanline|morton|hilbert] [--preview file|-]\n"
+				<< "       [--exposure stops] [--tonemap none|reinhard|aces] [--resize width height] [--resample box|bilinear|lanczos]\n"
+				<< "       [--coordinator port [--bind address] [--spawn n]] [--worker host:port]\n";
+			return 1;
+		}
+	}
+
+	// World: a scene file goes through its compiled cache (its meshes are loaded alongside), otherwise the built-in random scene.
+	scene_settings settings;
+	hittable_list world;
+	material_table materials;
+	light_list lights;
+	size_t n_objects;
+	aabb world_box;
+	hasher geometry;	// every sphere and triangle where it is placed, for the scene hash
+
+	if (!scene_file.empty())
+	{
+		shared_ptr<scene_cache> cache = make_shared<scene_cache>();
+		if (!load_scene(scene_file, *cache))
+			return 1;
+
+		settings = cache->settings();
+		materials = cache->materials();
+		lights = NEXT_EVENT_ESTIMATION ? build_lights(settings, cache->sphere_data(), cache->size(), materials, 0) : light_list(settings.sky != 0);
+		if (cache->size() > 0)
+			world = hittable_list(cache);
+
+		// Meshes are loaded from their own files on every run, next to the cached spheres.
+		size_t n_triangles;
+		hash_spheres(geometry, cache->sphere_data(), cache->size());
+		if (!build_meshes(scene_file, cache->mesh_list(), cache->mesh_count(), 0, world, n_triangles, &geometry))
+			return 1;
+
+		n_objects = cache->size() + n_triangles;
+		world.bounding_box(world_box);
+	}
+	else if (city_instances > 0)
+	{
+		// The city is built as instances in its own two-level BVH; it has no scene_desc to export.
+		settings.image_width = IMAGE_WIDTH;
+		settings.samples_per_pixel = SAMPLES_PER_PIXEL;
+		world = city_scene(city_instances, materials, settings);
+		lights = light_list(settings.sky != 0);
+		n_objects = static_cast<size_t>(city_instances);
+		geometry.add(city_instances);	// the city is generated from a fixed seed, so its size decides its geometry
+		world.bounding_box(world_box);
+	}
+	else
+	{
+		scene_desc desc = random_scene();
+		desc.settings.image_width = IMAGE_WIDTH;
+		desc.settings.samples_per_pixel = SAMPLES_PER_PIXEL;
+
+		if (!export_file.empty())
+			return save_scene_text(export_file, desc) ? 0 : 1;
+
+		settings = desc.settings;
+		world = build_world(desc, materials);
+		lights = NEXT_EVENT_ESTIMATION ? build_lights(settings, desc.spheres.data(), desc.spheres.size(), materials, 0) : light_list(settings.sky != 0);
+		hash_spheres(geometry, desc.spheres.data(), desc.spheres.size());
+		n_objects = world.objects.size();
+		world.bounding_box(world_box);
+
+#if USE_SPHERE_SET
+		world = hittable_list(make_shared<sphere_set>(world));
+		std::cerr << "sphere_set kernel: " << simd_level_name(detect_simd_level()) << '\n';
+#elif USE_BVH
+		const auto bvh_sta = std::chrono::steady_clock::now();
+		world = hittable_list(make_shared<bvh_node>(world));
+		const std::chrono::duration<double> bvh_dur = std::chrono::steady_clock::now() - bvh_sta;
+		std::cerr << "BVH build time: " << bvh_dur.count() << '\n';
+#endif
+	}
+
 	// image
-	const double aspect_ratio = 3.0 / 2.0;
-	const int image_width = IMAGE_WIDTH;
+	const double aspect_ratio = settings.aspect_ratio;
+	const int image_width = settings.image_width;
 	const int image_height = static_cast<int>(image_width / aspect_ratio);
-	const int samples_per_pixel = SAMPLES_PER_PIXEL;
-	const int max_depth = 50;
+	const int samples_per_pixel = settings.samples_per_pixel;
+	const int max_depth = settings.max_depth;
+	const int rr_min_depth = RR_MIN_DEPTH;
 
 	PPM ppm1(image_height, image_width);
 
-	// World
-	hittable_list world = random_scene();
-
 	// camera
-	point3 lookfrom(13, 2, 3);
-	point3 lookat(0, 0, 0);
-	vec3 vup(0, 1, 0);
-	double vfov = 20;
-	double dist_to_focus = 10.0;
-	double aperture = 0.1;
+	point3 lookfrom(settings.lookfrom);
+	point3 lookat(settings.lookat);
+	vec3 vup(settings.vup);
+	double vfov = settings.vfov;
+	double dist_to_focus = settings.focus_dist;
+	double aperture = settings.aperture;
 	camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
 
+	// Everything that changes what a sample computes; the sample count may grow between runs.
+	hasher scene_hasher;
+	scene_hasher.add(n_objects);
+	scene_hasher.add(geometry.value());
+	scene_hasher.add(world_box.min());
+	scene_hasher.add(world_box.max());
+	for (double x : { vfov, aspect_ratio, aperture, dist_to_focus })
+		scene_hasher.add(x);
+	scene_hasher.add(lookfrom);
+	scene_hasher.add(lookat);
+	scene_hasher.add(vup);
+	for (int x : { image_width, image_height, max_depth, rr_min_depth, RNG_SEED, COUNTER_BASED_RNG, static_cast<int>(SAMPLE_PATTERN) })
+		scene_hasher.add(x);
+	scene_hasher.add(lights.size());
+	scene_hasher.add(lights.has_sky());
+	const std::vector<uint64_t> material_hash = material_hashes(materials);
+
 	// threads
-	const unsigned n_threads = N_THREADS;
-	std::vector<std::future<color>> futures;
-	futures.resize(n_threads);
-	const unsigned n_per_thread = samples_per_pixel / n_threads;
+	tile_scheduler scheduler(n_threads);
+	std::cerr << "threads: " << scheduler.size() << ", tiles: " << tile_size << " px, " << tile_order_name(order) << " order\n";
+
+	std::atomic<int> tiles_done{ 0 };
+	std::mutex progress_mtx;
+
+	std::vector<sampler> samplers(scheduler.size(), sampler(RNG_SEED, COUNTER_BASED_RNG, SAMPLE_PATTERN, samples_per_pixel));
+	for (unsigned w = 0; w < scheduler.size(); ++w)
+		samplers[w].set_stream(w);
+
+	std::vector<path_stats> stats(scheduler.size(), path_stats(max_depth));
+	std::vector<tile_pixel_order> pixel_orders(scheduler.size(), tile_pixel_order(order));
+
+#if USE_WAVEFRONT
+	std::vector<wavefront_integrator> wavefronts(scheduler.size(),
+		wavefront_integrator(world, materials, lights, cam, image_width, image_height, max_depth, rr_min_depth));
+#endif
+
+	// Sampling plan: every pass adds pass_spp samples to each unfinished pixel. A pixel is
+	// finished at max_spp or, with adaptive sampling, once it is past min_spp and quiet enough.
+	const uint32_t max_spp = samples_per_pixel;
+	const uint32_t min_spp = ADAPTIVE_SAMPLING ? std::min<uint32_t>(MIN_SPP, max_spp) : max_spp;
+	const uint32_t pass_spp = PASS_SPP;
+
+	film film1(image_width, image_height);
+	// Material sets only serve checkpoints; workers start tracking them when the coordinator asks.
+	if (write_checkpoints && worker_address.empty())
+		film1.track_materials();
+	std::vector<uint32_t> pass_end(size_t(image_width) * image_height, 0);	// sample count each pixel reaches this pass
+
+	// A resumed render keeps every pixel whose paths never touched an edited material:
+	// its samples are exactly what the edited scene would give. The rest start over.
+	std::vector<uint64_t> checkpoint_materials;
+	if (resume && load_checkpoint(checkpoint_file, scene_hasher.value(), film1, samplers, checkpoint_materials))
+	{
+		std::cerr << "resumed from " << checkpoint_file << '\n';
+		const std::vector<uint32_t> edited = edited_materials(checkpoint_materials, material_hash, lights);
+		if (!edited.empty())
+			std::cerr << "material edits: " << film1.reset_pixels(edited) << " of " << size_t(image_width) * image_height << " pixels to render again\n";
+	}
+
+	auto write_checkpoint = [&]() {
+		if (write_checkpoints)
+			save_checkpoint(checkpoint_file, scene_hasher.value(), material_hash, film1, samplers);
+	};
 
-	// Lambda function for multi-threading
-	auto make_scene = [&](const int& i, const int& j, const int& t) {
+#if RT_INSTRUMENT
+	using profile_clock = std::chrono::steady_clock;
+	render_profile profile(image_width, image_height, scheduler.size());
+	int current_pass = 0;
+	const auto render_sta = profile_clock::now();
+#endif
+
+	// Samples the next pass takes for pixel (i, j): none once it is finished.
+	auto sample_range = [&](int i, int j, uint32_t& begin, uint32_t& end) {
+		begin = film1.samples(i, j);
+		end = std::max(begin, pass_end[size_t(j) * image_width + i]);
+	};
 
-		color pixel_color(0, 0, 0);
-		int s_start = t * n_per_thread;
-		int s_end = (t + 1) * n_per_thread;
+	std::unique_ptr<preview> live_preview;
+	int preview_block = 1;		// block size of the preview level being rendered; 1 for the regular passes
 
-		for (unsigned s = s_start; s < s_end; ++s)
+	// Retires finished pixels, plans the next pass and returns the tiles that still have work.
+	auto unfinished_tiles = [&](const std::vector<tile>& tiles) {
+		std::vector<tile> result;
+		for (const tile& t : tiles)
 		{
-			double u = double(i) / (image_width - 1);
-			double v = double(j) / (image_height - 1);
-			ray r = cam.get_ray(u, v);
-			pixel_color += ray_color(r, world, max_depth);
-		}
+			bool any_active = false;
+			for (int j = t.y0; j < t.y1; ++j)
+			{
+				for (int i = t.x0; i < t.x1; ++i)
+				{
+					const uint32_t n = film1.samples(i, j);
+					const bool active = n < max_spp && (n < min_spp || film1.error(i, j) > NOISE_THRESHOLD);
+					// A preview doubles the samples each pass up to pass_spp, so the first passes come back fast.
+					const uint32_t step = live_preview ? std::min(pass_spp, std::max(n, 1u)) : pass_spp;
+					pass_end[size_t(j) * image_width + i] = active ? std::min(max_spp, n + step) : n;
+					any_active |= active;
+				}
+			}
 
-		return pixel_color;
+			if (any_active)
+				result.push_back(t);
+		}
+		return result;
 	};
 
-	// render
-	for (int j = image_height - 1; j >= 0; --j)
-	{
-		std::cerr << "\rscanlines remaining: " << j << ' ' << std::flush;
-		for (int i = 0; i < image_width; ++i)
-		{
-			// Code for multi-threads
-			color pixel_color(0, 0, 0);
+	// Each tile of a pass is rendered start to finish by one worker.
+	auto render_tile = [&](const tile& t, unsigned worker) {
 
-			for (unsigned t = 0; t < n_threads; ++t)
-				futures[t] = std::async(make_scene, i, j, t);
+		sampler& smp = samplers[worker];
+		const std::vector<tile_pixel>& pixels = pixel_orders[worker].get(t);
 
-			for (unsigned t = 0; t < n_threads; ++t)
-				pixel_color += futures[t].get();
+#if RT_INSTRUMENT
+		const auto tile_sta = profile_clock::now();
+#endif
 
+#if USE_WAVEFRONT
+		wavefronts[worker].render(t, pixels, smp, stats[worker], sample_range,
+			[&](int i, int j, const color& c, const first_hit& hit) { film1.add_sample(i, j, c, hit); });
+#else
+		for (const tile_pixel& px : pixels)
+		{
+			const int i = t.x0 + px.dx, j = t.y0 + px.dy;
 
-			// Code for one thread
-			/*color pixel_color(0, 0, 0);
+			uint32_t begin, end;
+			sample_range(i, j, begin, end);
 
-			for (unsigned s = 0; s < samples_per_pixel; ++s)
+#if RT_INSTRUMENT
+			const auto pixel_sta = profile_clock::now();
+#endif
+			for (uint32_t s = begin; s < end; ++s)
 			{
-				auto u = double(i) / (image_width - 1);
-				auto v = double(j) / (image_height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel_color += ray_color(r, world, max_depth);
-			}*/
-
-			write_color(ppm1, j, i, pixel_color, samples_per_pixel);
+				smp.start_sample(static_cast<uint64_t>(j) * image_width + i, s);
+
+				// Anti-aliasing: jitter the sample inside the pixel (the first two sampler dimensions).
+				const sample2 jitter = smp.get_2d();
+				real u = real(i + jitter.x) / (image_width - 1);
+				real v = real(j + jitter.y) / (image_height - 1);
+				ray r = cam.get_ray(u, v, smp);
+				first_hit hit;
+				const color c = ray_color(r, world, materials, lights, max_depth, rr_min_depth, smp, stats[worker], &hit);
+				film1.add_sample(i, j, c, hit);
+			}
+#if RT_INSTRUMENT
+			profile.add_pixel(i, j, std::chrono::duration<double>(profile_clock::now() - pixel_sta).count());
+#endif
 		}
+#endif
+
+#if RT_INSTRUMENT
+		const double tile_seconds = std::chrono::duration<double>(profile_clock::now() - tile_sta).count();
+		profile.add_tile(t, current_pass, worker, tile_seconds);
+#if USE_WAVEFRONT
+		profile.spread_tile(t, tile_seconds);
+#endif
+#endif
+
+		if (live_preview)
+			live_preview->tile_done(film1, t, preview_block);
+
+		const int done = ++tiles_done;
+		if (!worker_address.empty())
+			return;
+		std::lock_guard<std::mutex> lock(progress_mtx);
+		std::cerr << "\rtiles done: " << done << ' ' << std::flush;
+	};
+
+	// Worker process: render the coordinator's tiles, split over this process's threads.
+	if (!worker_address.empty())
+	{
+		auto render_job = [&](const tile& t, path_stats& job_stats) {
+			for (path_stats& s : stats)
+				s = path_stats(max_depth);
+			scheduler.run(split_tile(t, DIST_SUB_TILE, order), render_tile);
+			for (const path_stats& s : stats)
+				job_stats.merge(s);
+		};
+
+		return run_worker(worker_address, scene_hasher.value(), scheduler.size(), film1, pass_end, max_depth, render_job) ? 0 : 1;
 	}
 
-	ppm1.set_version("P3");
-	ppm1.save("Result.ppm");
+	std::unique_ptr<dist_coordinator> coordinator;
+	if (coordinator_port >= 0)
+	{
+		coordinator.reset(new dist_coordinator(scene_hasher.value(), max_depth));
+		if (!coordinator->listen(bind_address, coordinator_port))
+			return 1;
 
-	ppm1.gray_scale();
-	ppm1.save("Result_gray.ppm");
+		// Local workers share this machine's cores.
+		std::vector<std::string> worker_args;
+		if (spawn_workers > 0)
+		{
+			const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+			worker_args = { "--threads", std::to_string(std::max(1u, cores / spawn_workers)) };
+		}
+		// Workers must build the same world, or their scene hash will not match: pass on
+		// every option that picks the scene.
+		if (!scene_file.empty())
+			worker_args.insert(worker_args.end(), { "--scene", scene_file });
+		else if (city_instances > 0)
+			worker_args.insert(worker_args.end(), { "--city", std::to_string(city_instances) });
+		worker_args.insert(worker_args.end(), { "--tile-order", tile_order_name(order) });
+
+		if (spawn_workers > 0 && !coordinator->spawn(spawn_workers, worker_args))
+			return 1;
+	}
 
-	const std::chrono::duration<double> dur = std::chrono::steady_clock::now() - sta;
+	// Preview levels: one sample for the corner pixel of every PREVIEW_BLOCK-sized block, then
+	// for the corners of the blocks half that size, down to every pixel. Each level fills in
+	// the image coarsely in a fraction of a pass; the regular passes then continue each pixel's
+	// own sample sequence, so the finished image is the same as without a preview.
+	if (!preview_path.empty())
+	{
+		live_preview.reset(new preview(preview_path, image_width, image_height, PREVIEW_SECONDS));
+		const std::vector<tile> all_tiles = make_tiles(image_width, image_height, tile_size, order);
 
-	std::cerr << "\nDone.\n";
-	std::cout << "Run time: " << dur.count() << std::endl;
+		for (int block = PREVIEW_BLOCK; block >= 1; block /= 2)
+		{
+			std::vector<tile> level_tiles;
+			for (const tile& t : all_tiles)
+			{
+				bool any_active = false;
+				for (int j = t.y0; j < t.y1; ++j)
+				{
+					for (int i = t.x0; i < t.x1; ++i)
+					{
+						const uint32_t n = film1.samples(i, j);
+						const bool active = n == 0 && max_spp > 0 && (i - t.x0) % block == 0 && (j - t.y0) % block == 0;
+						pass_end[size_t(j) * image_width + i] = active ? 1 : n;
+						any_active |= active;
+					}
+				}
 
-	return 0;
-}
+				if (any_active)
+					level_tiles.push_back(t);
+			}
+			if (level_tiles.empty())
+				continue;
 
-color ray_color(const ray& r, const hittable& world, int depth)
-{
-	hit_record rec;
+			std::cerr << "\npreview " << block << 'x' << block << ", " << level_tiles.size() << " tiles\n";
+			tiles_done = 0;
+			preview_block = block;
+			if (coordinator)
+			{
+				if (!coordinator->run(level_tiles, film1, pass_end, stats[0]))
+				{
+					write_checkpoint();
+					return 1;
+				}
+				for (const tile& t : level_tiles)
+					live_preview->update(film1, t, block);
+			}
+			else
+			{
+				scheduler.run(level_tiles, render_tile);
+			}
+			live_preview->flush();
+		}
+		preview_block = 1;
+	}
 
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
+	// render
+	std::vector<tile> tiles = unfinished_tiles(make_tiles(image_width, image_height, tile_size, order));
+	auto last_checkpoint = std::chrono::steady_clock::now();
 
-	if (world.hit(r, 0.001, infinity, rec))
+	for (int pass = 1; !tiles.empty(); ++pass)
 	{
-		ray scattered;
-		color attenuation;
-		if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+		std::cerr << "\npass " << pass << ", " << tiles.size() << " tiles\n";
+		tiles_done = 0;
+#if RT_INSTRUMENT
+		current_pass = pass;
+#endif
+		if (coordinator)
+		{
+			// Keep what the workers finished, so --resume can pick up from there.
+			if (!coordinator->run(tiles, film1, pass_end, stats[0]))
+			{
+				write_checkpoint();
+				return 1;
+			}
+		}
+		else
+		{
+			scheduler.run(tiles, render_tile);
+		}
+
+		if (live_preview)
 		{
-			return attenuation * ray_color(scattered, world, depth - 1);
+			if (coordinator)
+				for (const tile& t : tiles)
+					live_preview->update(film1, t, 1);
+			live_preview->flush();
 		}
 
-		return color(0, 0, 0);
+		tiles = unfinished_tiles(tiles);
+
+		const auto now = std::chrono::steady_clock::now();
+		if (tiles.empty() || now - last_checkpoint >= std::chrono::seconds(CHECKPOINT_SECONDS))
+		{
+			write_checkpoint();
+			last_checkpoint = now;
+		}
 	}
 
-	vec3 unit_direction = unit_vector(r.direction());
-	double t = 0.5 * (unit_direction.y() + 1.0);
+	// Post-processing works on the float image; ppm1 only receives the final bytes.
+	const post_processor post;
+	hdr_image frame(film1);
 
-	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+#if DENOISE
+	post.write(frame, ppm1, scheduler);
+	ppm1.set_version("P3");
+	ppm1.save("Result_noisy.ppm");
+
+	const auto denoise_sta = std::chrono::steady_clock::now();
+	denoiser().denoise(film1, frame, scheduler);
+	const std::chrono::duration<double> denoise_dur = std::chrono::steady_clock::now() - denoise_sta;
+	std::cerr << "\ndenoise time: " << denoise_dur.count() << '\n';
+#endif
+
+	const auto post_sta = std::chrono::steady_clock::now();
+	post.tonemap(frame, exposure, curve, scheduler);
+	if (output_width > 0)
+	{
+		frame = post.resample(frame, output_width, output_height, filter, scheduler);
+		ppm1 = PPM(output_height, output_width);
+	}
+	post.write(frame, ppm1, scheduler);
+	const std::chrono::duration<double> post_dur = std::chrono::steady_clock::now() - post_sta;
+	std::cerr << "\npost time: " << post_dur.count() << '\n';
+
+	path_stats total_stats(max_depth);
+	for (const path_stats& s : stats)
+		total_stats.merge(s);
+	std::cerr << '\n';
+	total_stats.print(std::cerr);
+
+#if RT_INSTRUMENT
+	const std::chrono::duration<double> render_dur = profile_clock::now() - render_sta;
+	if (profile.write_json(PROFILE_FILE, total_stats, instrument::total(), materials, render_dur.count()))
+		std::cerr << "profile: " << PROFILE_FILE << '\n';
+
+	PPM cost(image_height, image_width);
+	profile.write_heatmap(cost);
+	cost.set_version("P3");
+	cost.save("Result_cost.ppm");
+#endif
+
+	ppm1.set_version("P3");
+	ppm1.save("Result.ppm");
+
+	post.gray_scale(frame, scheduler);
+	post.write(frame, ppm1, scheduler);
+	ppm1.save("Result_gray.ppm");
+
+#if ADAPTIVE_SAMPLING && SPP_HEATMAP
+	PPM heatmap(image_height, image_width);
+	film1.write_heatmap(heatmap, max_spp);
+	heatmap.set_version("P3");
+	heatmap.save("Result_spp.ppm");
+#endif
+
+	const std::chrono::duration<double> dur = std::chrono::steady_clock::now() - sta;
+
+	std::cerr << "\nDone.\n";
+	if (live_preview)
+		std::cerr << "preview frames: " << live_preview->frames() << '\n';
+	// stdout may be carrying the preview stream.
+	(preview_path == "-" ? std::cerr : std::cout) << "Run time: " << dur.count() << std::endl;
+
+	return 0;
 }
 
-hittable_list random_scene()
+scene_desc random_scene()
 {
-	hittable_list world;
+	scene_desc world;
 
-	auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+	const uint32_t ground_material = world.add_material(material_type::lambertian, color(0.5, 0.5, 0.5), 0);
+	world.add_sphere(point3(0, -1000, 0), 1000, ground_material);
 
 	for (int a = -11; a < 11; a++)
 	{
@@ -155,41 +612,102 @@ hittable_list random_scene()
 
 			if ((center - point3(4, 0.2, 0)).length() > 0.9)
 			{
-				shared_ptr<material> sphere_material;
+				uint32_t sphere_material;
 
 				if (choose_mat < 0.8)
 				{
 					// diffuse
 					color albedo = color::random() * color::random();
-					sphere_material = make_shared<lambertian>(albedo);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = world.add_material(material_type::lambertian, albedo, 0);
+					world.add_sphere(center, 0.2, sphere_material);
 				}
 				else if (choose_mat < 0.95)
 				{
 					// matal
 					color albedo = color::random(0.5, 1);
 					double fuzz = random_double(0, 0.5);
-					sphere_material = make_shared<metal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = world.add_material(material_type::metal, albedo, fuzz);
+					world.add_sphere(center, 0.2, sphere_material);
 				}
 				else
 				{
 					// glass
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = world.add_material(material_type::dielectric, color(1, 1, 1), 1.5);
+					world.add_sphere(center, 0.2, sphere_material);
 				}
 			}
 		}
 	}
 
-	auto material1 = make_shared<dielectric>(1.5);
-	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+	const uint32_t material1 = world.add_material(material_type::dielectric, color(1, 1, 1), 1.5);
+	world.add_sphere(point3(0, 1, 0), 1.0, material1);
 
-	auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+	const uint32_t material2 = world.add_material(material_type::lambertian, color(0.4, 0.2, 0.1), 0);
+	world.add_sphere(point3(-4, 1, 0), 1.0, material2);
 
-	auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+	const uint32_t material3 = world.add_material(material_type::metal, color(0.7, 0.6, 0.5), 0.0);
+	world.add_sphere(point3(4, 1, 0), 1.0, material3);
 
 	return world;
-}
\ No newline at end of file
+}
+
+// n_instances copies of a few sphere clusters on a grid, each one rotated and scaled.
+// Every cluster has its own BVH, shared by all its instances, and the instances and the
+// ground sit in a top-level BVH, so memory grows with the instance count, not the spheres.
+hittable_list city_scene(int n_instances, material_table& materials, scene_settings& settings)
+{
+	const int n_clusters = 4;
+	const int spheres_per_cluster = 40;
+
+	std::vector<shared_ptr<hittable>> clusters;
+	for (int c = 0; c < n_clusters; ++c)
+	{
+		// A tower of stacked spheres with a ring of smaller ones around its base, in a unit footprint.
+		hittable_list cluster;
+		const int storeys = 3 + c * 2;
+		const uint32_t tower_material = materials.add(c % 2 == 0
+			? make_lambertian(color::random(0.3, 0.9))
+			: make_metal(color::random(0.6, 1), real(random_double(0, 0.2))));
+		for (int k = 0; k < storeys; ++k)
+			cluster.add(make_shared<sphere>(point3(0, 0.25 + 0.45 * k, 0), real(0.25), tower_material));
+
+		for (int k = storeys; k < spheres_per_cluster; ++k)
+		{
+			const double angle = 2 * pi * k / (spheres_per_cluster - storeys);
+			const double radius = random_double(0.05, 0.12);
+			const point3 center(0.8 * std::cos(angle), radius, 0.8 * std::sin(angle));
+			const uint32_t m = random_double() < 0.9
+				? materials.add(make_lambertian(color::random() * color::random()))
+				: materials.add(make_dielectric(real(1.5)));
+			cluster.add(make_shared<sphere>(center, real(radius), m));
+		}
+
+		clusters.push_back(make_shared<bvh_node>(cluster));
+	}
+
+	hittable_list instances;
+	const int side = static_cast<int>(std::ceil(std::sqrt(double(n_instances))));
+	const double spacing = 2.2;
+	const double half = 0.5 * spacing * (side - 1);
+	for (int k = 0; k < n_instances; ++k)
+	{
+		const vec3 offset(spacing * (k % side) - half, 0, spacing * (k / side) - half);
+		const transform placement = transform::translate(offset)
+			* transform::rotate(vec3(0, 1, 0), random_double(0, 360))
+			* transform::scale(real(random_double(0.7, 1.3)));
+		instances.add(make_shared<instance>(clusters[static_cast<size_t>(random_double(0, n_clusters))], placement));
+	}
+
+	const uint32_t ground_material = materials.add(make_lambertian(color(0.5, 0.5, 0.5)));
+	instances.add(make_shared<sphere>(point3(0, -10000, 0), real(10000), ground_material));
+
+	// Looking down a diagonal of the city from just above one corner.
+	const double extent = half + spacing;
+	settings.lookfrom = vec3_t<double>(-extent, 6, extent);
+	settings.lookat = vec3_t<double>(0, 0, 0);
+	settings.vfov = 30;
+	settings.aperture = 0;
+	settings.focus_dist = 10;
+
+	return hittable_list(make_shared<bvh_node>(instances));
+}
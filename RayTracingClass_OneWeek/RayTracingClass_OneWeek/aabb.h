@@ -0,0 +1,72 @@
+#pragma once
+
+#define AABB_H
+#ifdef AABB_H
+
+#include "rtweekend.h"
+
+#include <utility>
+
+class aabb
+{
+public:
+	aabb() {}
+	aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+	point3 min() const { return minimum; }
+	point3 max() const { return maximum; }
+
+	bool hit(const ray& r, real t_min, real t_max) const
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			real inv_d = 1 / r.direction()[a];
+			real t0 = (minimum[a] - r.origin()[a]) * inv_d;
+			real t1 = (maximum[a] - r.origin()[a]) * inv_d;
+
+			if (inv_d < 0.0)
+				std::swap(t0, t1);
+
+			t_min = t0 > t_min ? t0 : t_min;
+			t_max = t1 < t_max ? t1 : t_max;
+
+			if (t_max <= t_min)
+				return false;
+		}
+
+		return true;
+	}
+
+	double surface_area() const
+	{
+		vec3 d = maximum - minimum;
+		return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
+	// Index of the axis with the largest extent (0 = x, 1 = y, 2 = z).
+	int longest_axis() const
+	{
+		vec3 d = maximum - minimum;
+		if (d.x() > d.y() && d.x() > d.z()) return 0;
+		return d.y() > d.z() ? 1 : 2;
+	}
+
+private:
+	point3 minimum;
+	point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1)
+{
+	point3 small(std::fmin(box0.min().x(), box1.min().x()),
+		std::fmin(box0.min().y(), box1.min().y()),
+		std::fmin(box0.min().z(), box1.min().z()));
+
+	point3 big(std::fmax(box0.max().x(), box1.max().x()),
+		std::fmax(box0.max().y(), box1.max().y()),
+		std::fmax(box0.max().z(), box1.max().z()));
+
+	return aabb(small, big);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#pragma once
+
+#define BVH_H
+#ifdef BVH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instrument.h"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#define BVH_BINS 16
+#define BVH_PARALLEL_THRESHOLD 1024		// subtrees smaller than this are built on the calling thread
+
+// Levels of a BVH build that hand one half to another thread: enough for a subtree per
+// hardware thread, so a build never runs more threads than the machine has.
+inline int bvh_parallel_depth()
+{
+	static const int depth = [] {
+		const unsigned n = std::max(1u, std::thread::hardware_concurrency());
+		int d = 0;
+		while ((1u << d) < n)
+			++d;
+		return d;
+	}();
+	return depth;
+}
+
+struct bvh_primitive
+{
+	shared_ptr<hittable> object;
+	aabb box;
+	point3 centroid;
+};
+
+class bvh_node : public hittable
+{
+public:
+	bvh_node() {}
+	bvh_node(const hittable_list& list);
+	bvh_node(std::vector<bvh_primitive>& prims, size_t start, size_t end, int depth = 0);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+private:
+	shared_ptr<hittable> left;
+	shared_ptr<hittable> right;		// null in a leaf with a single object
+	aabb box;
+};
+
+// Reorders prims[start, end) around a binned SAH split and returns the split point.
+// Prim needs an aabb box and a point3 centroid; the scene cache builds its flat BVH with it too.
+template <typename Prim>
+size_t bvh_split(std::vector<Prim>& prims, size_t start, size_t end);
+
+bvh_node::bvh_node(const hittable_list& list)
+{
+	std::vector<bvh_primitive> prims;
+	prims.reserve(list.objects.size());
+
+	for (const shared_ptr<hittable>& object : list.objects)
+	{
+		bvh_primitive prim;
+		if (!object->bounding_box(prim.box))
+		{
+			std::cerr << "No bounding box in bvh_node constructor.\n";
+			continue;
+		}
+
+		prim.object = object;
+		prim.centroid = 0.5 * (prim.box.min() + prim.box.max());
+		prims.push_back(prim);
+	}
+
+	if (prims.empty())
+		return;
+
+	*this = bvh_node(prims, 0, prims.size());
+}
+
+bvh_node::bvh_node(std::vector<bvh_primitive>& prims, size_t start, size_t end, int depth)
+{
+	const size_t object_span = end - start;
+
+	if (object_span == 1)
+	{
+		left = prims[start].object;
+		box = prims[start].box;
+		return;
+	}
+
+	if (object_span == 2)
+	{
+		left = prims[start].object;
+		right = prims[start + 1].object;
+		box = surrounding_box(prims[start].box, prims[start + 1].box);
+		return;
+	}
+
+	const size_t mid = bvh_split(prims, start, end);
+
+	// The two halves touch disjoint ranges of prims, so big subtrees can be built concurrently.
+	if (object_span >= BVH_PARALLEL_THRESHOLD && depth < bvh_parallel_depth())
+	{
+		std::future<shared_ptr<hittable>> left_future = std::async(std::launch::async, [&prims, start, mid, depth] {
+			return shared_ptr<hittable>(make_shared<bvh_node>(prims, start, mid, depth + 1));
+		});
+		right = make_shared<bvh_node>(prims, mid, end, depth + 1);
+		left = left_future.get();
+	}
+	else
+	{
+		left = make_shared<bvh_node>(prims, start, mid, depth + 1);
+		right = make_shared<bvh_node>(prims, mid, end, depth + 1);
+	}
+
+	aabb box_left, box_right;
+	left->bounding_box(box_left);
+	right->bounding_box(box_right);
+	box = surrounding_box(box_left, box_right);
+}
+
+template <typename Prim>
+size_t bvh_split(std::vector<Prim>& prims, size_t start, size_t end)
+{
+	struct bin
+	{
+		int count = 0;
+		aabb box;
+	};
+
+	aabb centroid_bounds(prims[start].centroid, prims[start].centroid);
+	for (size_t i = start + 1; i < end; ++i)
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+
+	const point3 lo = centroid_bounds.min();
+	const vec3 extent = centroid_bounds.max() - lo;
+
+	auto bin_index = [&](const Prim& prim, int axis) {
+		int b = static_cast<int>(BVH_BINS * (prim.centroid[axis] - lo[axis]) / extent[axis]);
+		return std::min(b, BVH_BINS - 1);
+	};
+
+	// Binned SAH: for every axis, drop the centroids into BVH_BINS buckets and
+	// cost each of the BVH_BINS - 1 bucket boundaries as count * area on either side.
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_split = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (extent[axis] <= 0.0)
+			continue;
+
+		bin bins[BVH_BINS];
+		for (size_t i = start; i < end; ++i)
+		{
+			bin& b = bins[bin_index(prims[i], axis)];
+			b.box = b.count == 0 ? prims[i].box : surrounding_box(b.box, prims[i].box);
+			b.count++;
+		}
+
+		// Sweep from the right to get the area and count of every suffix.
+		double right_area[BVH_BINS];
+		int right_count[BVH_BINS];
+		aabb acc;
+		int count = 0;
+		for (int b = BVH_BINS - 1; b > 0; --b)
+		{
+			if (bins[b].count > 0)
+			{
+				acc = count == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+				count += bins[b].count;
+			}
+			right_area[b] = count > 0 ? acc.surface_area() : 0.0;
+			right_count[b] = count;
+		}
+
+		count = 0;
+		for (int b = 0; b < BVH_BINS - 1; ++b)
+		{
+			if (bins[b].count > 0)
+			{
+				acc = count == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+				count += bins[b].count;
+			}
+
+			if (count == 0 || right_count[b + 1] == 0)
+				continue;
+
+			double cost = count * acc.surface_area() + right_count[b + 1] * right_area[b + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b + 1;
+			}
+		}
+	}
+
+	size_t mid = start + (end - start) / 2;
+
+	if (best_axis >= 0)
+	{
+		auto it = std::partition(prims.begin() + start, prims.begin() + end,
+			[&](const Prim& prim) { return bin_index(prim, best_axis) < best_split; });
+		mid = static_cast<size_t>(it - prims.begin());
+	}
+
+	// All centroids coincide: any split is as good as another.
+	if (mid == start || mid == end)
+		mid = start + (end - start) / 2;
+
+	return mid;
+}
+
+bool bvh_node::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	count_test(counted_prim::bvh_node);
+	if (!left || !box.hit(r, t_min, t_max))
+		return false;
+	count_hit(counted_prim::bvh_node);
+
+	bool hit_left = left->hit(r, t_min, t_max, rec);
+	bool hit_right = right && right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+
+	return hit_left || hit_right;
+}
+
+bool bvh_node::occluded(const ray& r, real t_min, real t_max) const
+{
+	count_test(counted_prim::bvh_node);
+	if (!left || !box.hit(r, t_min, t_max))
+		return false;
+	count_hit(counted_prim::bvh_node);
+
+	return left->occluded(r, t_min, t_max) || (right && right->occluded(r, t_min, t_max));
+}
+
+bool bvh_node::bounding_box(aabb& output_box) const
+{
+	output_box = box;
+	return static_cast<bool>(left);
+}
+
+#endif
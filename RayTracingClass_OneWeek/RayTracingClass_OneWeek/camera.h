@@ -5,12 +5,13 @@
 
 #include "rtweekend.h"
 
-class camera
+template <typename T>
+class camera_t
 {
 public:
-	camera(point3 lookfrom,
-		point3 lookat,
-		vec3 vup,
+	camera_t(vec3_t<T> lookfrom,
+		vec3_t<T> lookat,
+		vec3_t<T> vup,
 		double vfov,
 		double aspect_ratio,
 		double aperture,
@@ -27,28 +28,30 @@ public:
 		v = cross(w, u);
 
 		origin = lookfrom;
-		horizontal = focus_disk * viewport_width * u;
-		vertical = focus_disk * viewport_height * v;
-		lower_left_corner = origin - horizontal / 2 - vertical / 2 - focus_disk * w;
+		horizontal = T(focus_disk * viewport_width) * u;
+		vertical = T(focus_disk * viewport_height) * v;
+		lower_left_corner = origin - horizontal / 2 - vertical / 2 - T(focus_disk) * w;
 
-		lens_radius = aperture / 2;
+		lens_radius = T(aperture / 2);
 	}
 
-	ray get_ray(double s, double t) const
+	ray_t<T> get_ray(T s, T t, sampler& smp) const
 	{
-		vec3 rd = lens_radius * random_in_unit_disk();
-		vec3 offset = u * rd.x() + v * rd.y();
+		vec3_t<T> rd = lens_radius * random_in_unit_disk<T>(smp);
+		vec3_t<T> offset = u * rd.x() + v * rd.y();
 
-		return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset);
+		return ray_t<T>(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset);
 	}
 
 private:
-	point3 origin;
-	point3 lower_left_corner;
-	vec3 horizontal;
-	vec3 vertical;
-	vec3 u, v, w;
-	double lens_radius;
+	vec3_t<T> origin;
+	vec3_t<T> lower_left_corner;
+	vec3_t<T> horizontal;
+	vec3_t<T> vertical;
+	vec3_t<T> u, v, w;
+	T lens_radius;
 };
 
+using camera = camera_t<real>;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+#pragma once
+
+#define CHECKPOINT_H
+#ifdef CHECKPOINT_H
+
+#include "rtweekend.h"
+
+#include "film.h"
+#include "hash.h"
+#include "lights.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define CHECKPOINT_VERSION 5
+
+// One hash per material. The scene hash leaves materials out, so a checkpoint survives a
+// material edit and the hashes tell which materials changed since it was written.
+std::vector<uint64_t> material_hashes(const material_table& materials)
+{
+	std::vector<uint64_t> hashes(materials.size());
+	for (size_t k = 0; k < materials.size(); ++k)
+	{
+		const material& m = materials[static_cast<uint32_t>(k)];
+		hasher h;
+		h.add(static_cast<int>(m.type));
+		h.add(m.albedo);
+		h.add(m.fuzz);
+		h.add(m.ir);
+		hashes[k] = h.value();
+	}
+	return hashes;
+}
+
+// Sorted indices of the materials whose hash differs, for film::reset_pixels. A material only
+// one side has counts as edited, and an edited light adds material_lights.
+std::vector<uint32_t> edited_materials(const std::vector<uint64_t>& before, const std::vector<uint64_t>& after, const light_list& lights)
+{
+	std::vector<uint32_t> edited;
+	bool light_edited = false;
+	for (size_t k = 0; k < std::max(before.size(), after.size()); ++k)
+	{
+		if (k >= before.size() || k >= after.size() || before[k] != after[k])
+		{
+			edited.push_back(static_cast<uint32_t>(k));
+			light_edited |= lights.has_material(static_cast<uint32_t>(k));
+		}
+	}
+
+	if (light_edited)
+		edited.push_back(material_lights);
+	return edited;
+}
+
+struct checkpoint_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t n_generators;
+	uint32_t n_materials;
+	uint32_t reserved;
+	uint64_t scene_hash;
+	uint64_t n_material_words;	// length of the pixels' packed material sets
+};
+
+// Every pixel's material_set as its count and then its ids, usually under half the fixed size.
+// A film that does not track them writes material_any for every pixel, which any edit resets.
+std::vector<uint32_t> pack_material_sets(const film& f)
+{
+	std::vector<uint32_t> words;
+	for (size_t k = 0; k < f.data().size(); ++k)
+	{
+		if (!f.tracks_materials())
+		{
+			words.insert(words.end(), { 1, material_any });
+			continue;
+		}
+		const material_set& m = f.materials()[k];
+		words.push_back(m.n);
+		words.insert(words.end(), m.ids, m.ids + m.n);
+	}
+	return words;
+}
+
+// Reverses pack_material_sets into one set per pixel. False unless words holds exactly that many valid sets.
+bool unpack_material_sets(const std::vector<uint32_t>& words, std::vector<material_set>& sets)
+{
+	size_t pos = 0;
+	for (material_set& m : sets)
+	{
+		if (pos >= words.size() || words[pos] > PIXEL_MATERIALS || words[pos] > words.size() - pos - 1)
+			return false;
+		m.n = words[pos++];
+		std::copy(words.begin() + pos, words.begin() + pos + m.n, m.ids);
+		pos += m.n;
+	}
+	return pos == words.size();
+}
+
+// Writes the film with its material sets, the sampler states and the material hashes to path. The file is written next to path first
+// and renamed over it, so a crash mid-write never destroys the previous checkpoint.
+bool save_checkpoint(const std::string& path, uint64_t scene_hash, const std::vector<uint64_t>& materials, const film& f, const std::vector<sampler>& samplers)
+{
+	const std::string temp_path = path + ".tmp";
+
+	{
+		std::ofstream output(temp_path, std::ios::binary);
+		if (!output.is_open())
+		{
+			std::cerr << "Cannot write checkpoint " << temp_path << '\n';
+			return false;
+		}
+
+		checkpoint_header header = {};
+		std::memcpy(header.magic, "RTCKPT\0", 8);
+		header.version = CHECKPOINT_VERSION;
+		header.width = f.width();
+		header.height = f.height();
+		header.n_generators = static_cast<uint32_t>(samplers.size());
+		header.n_materials = static_cast<uint32_t>(materials.size());
+		header.scene_hash = scene_hash;
+		const std::vector<uint32_t> material_words = pack_material_sets(f);
+		header.n_material_words = material_words.size();
+
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (const sampler& s : samplers)
+			output.write(reinterpret_cast<const char*>(&s.generator()), sizeof(pcg32));
+		output.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(uint64_t));
+		output.write(reinterpret_cast<const char*>(f.data().data()), f.data().size() * sizeof(film::pixel));
+		output.write(reinterpret_cast<const char*>(material_words.data()), material_words.size() * sizeof(uint32_t));
+
+		if (!output)
+		{
+			std::cerr << "Cannot write checkpoint " << temp_path << '\n';
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());
+	if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+	{
+		std::cerr << "Cannot rename " << temp_path << " to " << path << '\n';
+		return false;
+	}
+
+	return true;
+}
+
+// Restores a checkpoint written by save_checkpoint, and the material hashes it was rendered
+// with into materials. Fails, leaving f untouched, if the file is missing or was written for
+// another image size, scene or camera.
+bool load_checkpoint(const std::string& path, uint64_t scene_hash, film& f, std::vector<sampler>& samplers, std::vector<uint64_t>& materials)
+{
+	std::ifstream input(path, std::ios::binary);
+	if (!input.is_open())
+	{
+		std::cerr << "No checkpoint " << path << '\n';
+		return false;
+	}
+
+	checkpoint_header header;
+	input.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+	if (!input || std::memcmp(header.magic, "RTCKPT\0", 8) != 0 || header.version != CHECKPOINT_VERSION)
+	{
+		std::cerr << path << " is not a version " << CHECKPOINT_VERSION << " checkpoint\n";
+		return false;
+	}
+
+	if (header.width != uint32_t(f.width()) || header.height != uint32_t(f.height()) || header.scene_hash != scene_hash)
+	{
+		std::cerr << path << " was written for a different image, scene or camera\n";
+		return false;
+	}
+
+	// The header's counts must add up to the file's size before anything is allocated from them.
+	input.seekg(0, std::ios::end);
+	const uint64_t file_size = static_cast<uint64_t>(input.tellg());
+	input.seekg(sizeof(header));
+	const uint64_t expected_size = header.n_material_words > file_size ? 0 : sizeof(header)
+		+ uint64_t(header.n_generators) * sizeof(pcg32) + uint64_t(header.n_materials) * sizeof(uint64_t)
+		+ uint64_t(f.data().size()) * sizeof(film::pixel) + header.n_material_words * sizeof(uint32_t);
+	if (!input || file_size != expected_size)
+	{
+		std::cerr << path << " is truncated or does not match its header\n";
+		return false;
+	}
+
+	std::vector<pcg32> generators(header.n_generators);
+	input.read(reinterpret_cast<char*>(generators.data()), generators.size() * sizeof(pcg32));
+
+	std::vector<uint64_t> hashes(header.n_materials);
+	input.read(reinterpret_cast<char*>(hashes.data()), hashes.size() * sizeof(uint64_t));
+
+	std::vector<film::pixel> pixels(f.data().size());
+	input.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(film::pixel));
+
+	std::vector<uint32_t> material_words(static_cast<size_t>(header.n_material_words));
+	input.read(reinterpret_cast<char*>(material_words.data()), material_words.size() * sizeof(uint32_t));
+	std::vector<material_set> sets(pixels.size());
+	const bool sets_ok = unpack_material_sets(material_words, sets);
+
+	if (!input || !sets_ok)
+	{
+		std::cerr << path << " is truncated or corrupt\n";
+		return false;
+	}
+
+	// A run that writes no checkpoints does not track material sets; its film drops them.
+	film restored(f.width(), f.height());
+	if (f.tracks_materials())
+		restored.materials().swap(sets);
+
+	// A run with more threads than the checkpoint keeps fresh streams for the extra workers.
+	for (size_t w = 0; w < samplers.size() && w < generators.size(); ++w)
+		samplers[w].set_generator(generators[w]);
+	restored.data().swap(pixels);
+	std::swap(f, restored);
+	materials.swap(hashes);
+
+	return true;
+}
+
+#endif
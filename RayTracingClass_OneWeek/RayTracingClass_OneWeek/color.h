@@ -29,5 +29,14 @@ void write_color(const PPM& ppm, const int& j, const int& i, color pixel_color,
 	ppm.image[j][i].b = static_cast<int>(256 * clamp(b, 0.0, 0.999));
 }
 
+// Heatmap ramp for x in [0, 1]: black through red and yellow to white.
+// write_color gamma-corrects, so the ramp is squared to stay linear on screen.
+inline color heat_color(double x)
+{
+	x = clamp(x, 0.0, 1.0);
+	const color heat(clamp(3 * x, 0.0, 1.0), clamp(3 * x - 1, 0.0, 1.0), clamp(3 * x - 2, 0.0, 1.0));
+	return heat * heat;
+}
+
 
 #endif
\ No newline at end of file
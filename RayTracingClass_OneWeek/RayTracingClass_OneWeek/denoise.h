@@ -0,0 +1,404 @@
+#pragma once
+
+#define DENOISE_H
+#ifdef DENOISE_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "film.h"
+#include "post.h"
+#include "simd.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010, with the variance-guided
+// luminance weight of SVGF). Every level runs a 5x5 B3-spline kernel whose taps are spread
+// 2^level pixels apart, so five levels cover a 125 pixel wide footprint with 25 taps each.
+// A tap's weight falls off with the difference in first-hit normal, depth and albedo and
+// with the luminance difference measured against the pixel's own noise level. Lighting is
+// filtered with the albedo divided out and multiplied back afterwards, so texture-like
+// albedo edges between objects stay sharp.
+
+#define DENOISE_ITERATIONS 5
+#define DENOISE_SIGMA_COLOR 4.0f		// luminance edge stop, in standard deviations of the pixel's noise
+#define DENOISE_NORMAL_SQUARINGS 7		// normal edge stop is max(0, dot(n_p, n_q))^(2^7)
+#define DENOISE_SIGMA_DEPTH 1.0f		// depth edge stop, in multiples of the local depth gradient
+#define DENOISE_SIGMA_ALBEDO 0.1f		// albedo edge stop, per channel
+#define DENOISE_BAND 16					// rows per scheduler job
+
+// One tap of the kernel over a run of pixels [begin, end) of a row. The p pointers index
+// the pixels being filtered, the q pointers the tap's pixels, already offset to line up.
+struct denoise_tap
+{
+	const float* cp[3];
+	const float* np[3];
+	const float* ap[3];
+	const float* zp;
+	const float* inv_sl;		// 1 / luminance edge stop of p
+	const float* inv_sz;		// 1 / depth edge stop of p per pixel of distance
+
+	const float* cq[3];
+	const float* varq;
+	const float* nq[3];
+	const float* aq[3];
+	const float* zq;
+
+	float h;					// B3-spline weight of the tap
+	float inv_dist;				// 1 / distance of the tap in pixels
+
+	float* sum_w;
+	float* sum_c[3];
+	float* sum_var;
+};
+
+using denoise_tap_kernel = void (*)(const denoise_tap& t, int begin, int end);
+
+// exp(x) for x <= 0 as 2^i * 2^f with a degree-5 polynomial for 2^f, f in [0, 1).
+// The SIMD kernels use the same steps, so every instruction set gives the same image.
+inline float denoise_exp(float x)
+{
+	const float t = std::max(x, -80.0f) * 1.44269504f;
+	const float i = std::floor(t);
+	const float f = t - i;
+
+	float p = 1.3333558e-3f;
+	p = p * f + 9.6181291e-3f;
+	p = p * f + 5.5504109e-2f;
+	p = p * f + 0.24022650f;
+	p = p * f + 0.69314718f;
+	p = p * f + 1.0f;
+
+	const int32_t bits = (static_cast<int32_t>(i) + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+inline void denoise_tap_scalar(const denoise_tap& t, int begin, int end)
+{
+	const float inv_sa2 = 1.0f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+
+	for (int k = begin; k < end; ++k)
+	{
+		const float lp = 0.2126f * t.cp[0][k] + 0.7152f * t.cp[1][k] + 0.0722f * t.cp[2][k];
+		const float lq = 0.2126f * t.cq[0][k] + 0.7152f * t.cq[1][k] + 0.0722f * t.cq[2][k];
+
+		float da = 0;
+		for (int c = 0; c < 3; ++c)
+			da += (t.ap[c][k] - t.aq[c][k]) * (t.ap[c][k] - t.aq[c][k]);
+
+		const float e = std::fabs(lp - lq) * t.inv_sl[k] + std::fabs(t.zp[k] - t.zq[k]) * (t.inv_sz[k] * t.inv_dist) + da * inv_sa2;
+
+		float wn = std::max(0.0f, t.np[0][k] * t.nq[0][k] + t.np[1][k] * t.nq[1][k] + t.np[2][k] * t.nq[2][k]);
+		for (int s = 0; s < DENOISE_NORMAL_SQUARINGS; ++s)
+			wn = wn * wn;
+
+		const float w = t.h * wn * denoise_exp(-e);
+
+		t.sum_w[k] += w;
+		for (int c = 0; c < 3; ++c)
+			t.sum_c[c][k] += w * t.cq[c][k];
+		t.sum_var[k] += w * w * t.varq[k];
+	}
+}
+
+#if RT_X86
+
+RT_TARGET_AVX2 inline __m256 denoise_exp_avx2(__m256 x)
+{
+	const __m256 t = _mm256_mul_ps(_mm256_max_ps(x, _mm256_set1_ps(-80.0f)), _mm256_set1_ps(1.44269504f));
+	const __m256 i = _mm256_floor_ps(t);
+	const __m256 f = _mm256_sub_ps(t, i);
+
+	__m256 p = _mm256_set1_ps(1.3333558e-3f);
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(9.6181291e-3f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(5.5504109e-2f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.24022650f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.69314718f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+
+	const __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+RT_TARGET_AVX2 inline __m256 denoise_luminance_avx2(const float* const c[3], int k)
+{
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), _mm256_loadu_ps(c[0] + k)),
+		_mm256_mul_ps(_mm256_set1_ps(0.7152f), _mm256_loadu_ps(c[1] + k))), _mm256_mul_ps(_mm256_set1_ps(0.0722f), _mm256_loadu_ps(c[2] + k)));
+}
+
+// Eight pixels at a time, same arithmetic as denoise_tap_scalar.
+RT_TARGET_AVX2 inline void denoise_tap_avx2(const denoise_tap& t, int begin, int end)
+{
+	const __m256 inv_sa2 = _mm256_set1_ps(1.0f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO));
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 h = _mm256_set1_ps(t.h);
+	const __m256 inv_dist = _mm256_set1_ps(t.inv_dist);
+	const __m256 zero = _mm256_setzero_ps();
+
+	int k = begin;
+	for (; k + 8 <= end; k += 8)
+	{
+		const __m256 dl = _mm256_and_ps(_mm256_sub_ps(denoise_luminance_avx2(t.cp, k), denoise_luminance_avx2(t.cq, k)), abs_mask);
+		const __m256 dz = _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(t.zp + k), _mm256_loadu_ps(t.zq + k)), abs_mask);
+
+		__m256 da = zero;
+		for (int c = 0; c < 3; ++c)
+		{
+			const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(t.ap[c] + k), _mm256_loadu_ps(t.aq[c] + k));
+			da = _mm256_add_ps(da, _mm256_mul_ps(d, d));
+		}
+
+		const __m256 e = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dl, _mm256_loadu_ps(t.inv_sl + k)),
+			_mm256_mul_ps(dz, _mm256_mul_ps(_mm256_loadu_ps(t.inv_sz + k), inv_dist))), _mm256_mul_ps(da, inv_sa2));
+
+		__m256 wn = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(t.np[0] + k), _mm256_loadu_ps(t.nq[0] + k)),
+			_mm256_mul_ps(_mm256_loadu_ps(t.np[1] + k), _mm256_loadu_ps(t.nq[1] + k))),
+			_mm256_mul_ps(_mm256_loadu_ps(t.np[2] + k), _mm256_loadu_ps(t.nq[2] + k)));
+		wn = _mm256_max_ps(zero, wn);
+		for (int s = 0; s < DENOISE_NORMAL_SQUARINGS; ++s)
+			wn = _mm256_mul_ps(wn, wn);
+
+		const __m256 w = _mm256_mul_ps(_mm256_mul_ps(h, wn), denoise_exp_avx2(_mm256_sub_ps(zero, e)));
+
+		_mm256_storeu_ps(t.sum_w + k, _mm256_add_ps(_mm256_loadu_ps(t.sum_w + k), w));
+		for (int c = 0; c < 3; ++c)
+			_mm256_storeu_ps(t.sum_c[c] + k, _mm256_add_ps(_mm256_loadu_ps(t.sum_c[c] + k), _mm256_mul_ps(w, _mm256_loadu_ps(t.cq[c] + k))));
+		_mm256_storeu_ps(t.sum_var + k, _mm256_add_ps(_mm256_loadu_ps(t.sum_var + k),
+			_mm256_mul_ps(_mm256_mul_ps(w, w), _mm256_loadu_ps(t.varq + k))));
+	}
+
+	denoise_tap_scalar(t, k, end);
+}
+
+#endif
+
+inline denoise_tap_kernel select_denoise_kernel(simd_level level)
+{
+#if RT_X86
+	if (level >= simd_level::avx2)
+		return denoise_tap_avx2;
+#else
+	(void)level;
+#endif
+	return denoise_tap_scalar;
+}
+
+class denoiser
+{
+public:
+	explicit denoiser(simd_level level = detect_simd_level()) : kernel(select_denoise_kernel(level)) {}
+
+	// Filters the film's pixels into out, a linear image of the film's size.
+	void denoise(const film& f, hdr_image& out, tile_scheduler& scheduler);
+
+private:
+	// One float per pixel and plane, row by row from the bottom like the film.
+	struct planes
+	{
+		std::vector<float> c[3];
+		std::vector<float> var;
+
+		void resize(size_t n)
+		{
+			for (std::vector<float>& p : c)
+				p.assign(n, 0);
+			var.assign(n, 0);
+		}
+	};
+
+	denoise_tap_kernel kernel;
+
+	int w = 0;
+	int h = 0;
+	planes level[2];				// filtered lighting and its variance, ping-ponged between levels
+	std::vector<float> normal[3];
+	std::vector<float> albedo[3];
+	std::vector<float> depth;
+	std::vector<float> inv_sz;		// 1 / depth edge stop per pixel of distance
+	std::vector<std::vector<float>> scratch;	// per worker: 6 rows of accumulators and edge stops
+
+	void setup(const film& f);
+	void filter_row(const planes& in, planes& out, int y, int step, float* rows) const;
+};
+
+void denoiser::setup(const film& f)
+{
+	w = f.width();
+	h = f.height();
+	const size_t n = size_t(w) * h;
+
+	level[0].resize(n);
+	level[1].resize(n);
+	for (int c = 0; c < 3; ++c)
+	{
+		normal[c].assign(n, 0);
+		albedo[c].assign(n, 0);
+	}
+	depth.assign(n, 0);
+	inv_sz.assign(n, 0);
+
+	const std::vector<film::pixel>& pixels = f.data();
+	for (int j = 0; j < h; ++j)
+	{
+		for (int i = 0; i < w; ++i)
+		{
+			const size_t k = size_t(j) * w + i;
+			const film::pixel& p = pixels[k];
+
+			// Averaged normals of edge pixels are shorter than one; only the direction matters.
+			const float len = std::sqrt(p.normal[0] * p.normal[0] + p.normal[1] * p.normal[1] + p.normal[2] * p.normal[2]);
+			for (int c = 0; c < 3; ++c)
+			{
+				normal[c][k] = len > 0 ? p.normal[c] / len : 0;
+				albedo[c][k] = p.albedo[c];
+			}
+			depth[k] = p.depth;
+
+			// Demodulate: filter lighting, not albedo. The variance scales with the albedo squared.
+			for (int c = 0; c < 3; ++c)
+				level[0].c[c][k] = p.mean[c] / std::max(p.albedo[c], 1e-3f);
+			const float a = std::max(film::luminance(p.albedo), 1e-3f);
+			level[0].var[k] = static_cast<float>(std::min(f.variance(i, j), 1e4)) / (a * a);
+		}
+	}
+
+	// Depth edge stop from the local depth gradient, so slanted surfaces like the ground are
+	// not cut apart; the relative term covers the depth noise of the lens samples.
+	for (int j = 0; j < h; ++j)
+	{
+		for (int i = 0; i < w; ++i)
+		{
+			const size_t k = size_t(j) * w + i;
+			const float dx = std::fabs(depth[size_t(j) * w + std::min(i + 1, w - 1)] - depth[size_t(j) * w + std::max(i - 1, 0)]);
+			const float dy = std::fabs(depth[size_t(std::min(j + 1, h - 1)) * w + i] - depth[size_t(std::max(j - 1, 0)) * w + i]);
+			inv_sz[k] = 1.0f / (DENOISE_SIGMA_DEPTH * 0.5f * std::max(dx, dy) + 1e-3f * depth[k] + 1e-4f);
+		}
+	}
+}
+
+void denoiser::filter_row(const planes& in, planes& out, int y, int step, float* rows) const
+{
+	static const float b3[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+	float* sum_w = rows;
+	float* sum_c[3] = { rows + w, rows + 2 * w, rows + 3 * w };
+	float* sum_var = rows + 4 * w;
+	float* inv_sl = rows + 5 * w;
+
+	const size_t row = size_t(y) * w;
+
+	// The centre tap always has full weight, so no pixel ends up without any.
+	for (int x = 0; x < w; ++x)
+	{
+		const float center = b3[2] * b3[2];
+		sum_w[x] = center;
+		for (int c = 0; c < 3; ++c)
+			sum_c[c][x] = center * in.c[c][row + x];
+		sum_var[x] = center * center * in.var[row + x];
+		inv_sl[x] = 1.0f / (DENOISE_SIGMA_COLOR * std::sqrt(in.var[row + x]) + 1e-4f);
+	}
+
+	denoise_tap t;
+	for (int c = 0; c < 3; ++c)
+	{
+		t.cp[c] = in.c[c].data() + row;
+		t.np[c] = normal[c].data() + row;
+		t.ap[c] = albedo[c].data() + row;
+		t.sum_c[c] = sum_c[c];
+	}
+	t.zp = depth.data() + row;
+	t.inv_sl = inv_sl;
+	t.inv_sz = inv_sz.data() + row;
+	t.sum_w = sum_w;
+	t.sum_var = sum_var;
+
+	for (int dy = -2; dy <= 2; ++dy)
+	{
+		const int yq = y + dy * step;
+		if (yq < 0 || yq >= h)
+			continue;
+
+		for (int dx = -2; dx <= 2; ++dx)
+		{
+			if (dx == 0 && dy == 0)
+				continue;
+
+			// Pixels whose tap falls outside the image skip it.
+			const int offset = dx * step;
+			const int begin = std::max(0, -offset);
+			const int end = std::min(w, w - offset);
+			if (begin >= end)
+				continue;
+
+			const ptrdiff_t q = ptrdiff_t(yq) * w + offset;
+			for (int c = 0; c < 3; ++c)
+			{
+				t.cq[c] = in.c[c].data() + q;
+				t.nq[c] = normal[c].data() + q;
+				t.aq[c] = albedo[c].data() + q;
+			}
+			t.varq = in.var.data() + q;
+			t.zq = depth.data() + q;
+			t.h = b3[dx + 2] * b3[dy + 2];
+			t.inv_dist = 1.0f / (step * std::sqrt(float(dx * dx + dy * dy)));
+
+			kernel(t, begin, end);
+		}
+	}
+
+	for (int x = 0; x < w; ++x)
+	{
+		const float inv_w = 1.0f / sum_w[x];
+		for (int c = 0; c < 3; ++c)
+			out.c[c][row + x] = sum_c[c][x] * inv_w;
+		out.var[row + x] = sum_var[x] * inv_w * inv_w;
+	}
+}
+
+void denoiser::denoise(const film& f, hdr_image& out, tile_scheduler& scheduler)
+{
+	setup(f);
+
+	scratch.resize(scheduler.size());
+	for (std::vector<float>& s : scratch)
+		s.assign(6 * size_t(w), 0);
+
+	std::vector<tile> bands;
+	for (int y = 0; y < h; y += DENOISE_BAND)
+		bands.push_back({ 0, y, w, std::min(y + DENOISE_BAND, h) });
+
+	for (int iteration = 0; iteration < DENOISE_ITERATIONS; ++iteration)
+	{
+		const planes& in = level[iteration & 1];
+		planes& out = level[(iteration + 1) & 1];
+		const int step = 1 << iteration;
+
+		scheduler.run(bands, [&](const tile& band, unsigned worker) {
+			for (int y = band.y0; y < band.y1; ++y)
+				filter_row(in, out, y, step, scratch[worker].data());
+		});
+	}
+
+	// Multiply the albedo back in.
+	const planes& result = level[DENOISE_ITERATIONS & 1];
+	for (int j = 0; j < h; ++j)
+	{
+		for (int i = 0; i < w; ++i)
+		{
+			const size_t k = size_t(j) * w + i;
+			const float a[3] = { std::max(albedo[0][k], 1e-3f), std::max(albedo[1][k], 1e-3f), std::max(albedo[2][k], 1e-3f) };
+			const float rgb[3] = { result.c[0][k] * a[0], result.c[1][k] * a[1], result.c[2][k] * a[2] };
+			out.set(i, j, rgb);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,663 @@
+#pragma once
+
+#define DISTRIBUTED_H
+#ifdef DISTRIBUTED_H
+
+#include "rtweekend.h"
+
+#include "film.h"
+#include "integrator.h"
+#include "tile_scheduler.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Coordinator/worker rendering over TCP.
+//
+// The coordinator owns the film and the pass loop. For every tile of a pass it sends a worker
+// the tile's current pixel accumulators and the sample count each pixel should reach; the worker
+// rebuilds the same scene from the same arguments, continues the accumulation and sends the
+// pixels back, with the materials their new samples touched if the coordinator tracks them. With the counter-based RNG a sample does not depend on who takes it, so the
+// image is the same as a single-process render. A worker that disconnects or stalls is dropped
+// and its tile goes back to the queue.
+//
+// Messages are raw structs in host byte order, so all machines must share one architecture.
+
+#define DIST_VERSION 6
+#define DIST_JOB_TIMEOUT 600	// seconds a worker may spend on one tile before it counts as lost
+#define DIST_JOIN_TIMEOUT 60	// seconds to wait for a worker to (re)connect while none is left
+#define DIST_IO_TIMEOUT 30		// seconds the rest of a message may take once it has started
+#define DIST_HELLO_TIMEOUT 5	// seconds a new connection has to send its hello before it is dropped
+#define DIST_BIND_ADDRESS "127.0.0.1"	// the coordinator takes workers from this machine only unless --bind says otherwise
+#define DIST_SUB_TILE 8			// workers split each tile into sub-tiles for their threads
+
+struct dist_hello
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t threads;
+	uint64_t scene_hash;
+};
+
+// Followed by the tile's film::pixel accumulators and one uint32_t target sample count per pixel.
+struct dist_job
+{
+	uint32_t id;
+	int32_t x0, y0;
+	int32_t x1, y1;
+	uint32_t materials;		// 1: send the tile's material sets back
+};
+
+// Followed by the tile's updated film::pixel accumulators, n_depths uint64_t path_stats::depth_rays
+// and, if the job asked for them, the material_set this job added to every pixel of the tile, row by row.
+struct dist_result
+{
+	uint32_t id;
+	uint32_t n_depths;
+	uint64_t roulette_kills;
+	uint64_t shadow_rays;
+	uint64_t n_material_sets;
+};
+
+// Renders a tile into the worker's film, counting into stats.
+using dist_render_func = std::function<void(const tile& t, path_stats& stats)>;
+
+inline size_t tile_pixels(const tile& t)
+{
+	return size_t(t.x1 - t.x0) * (t.y1 - t.y0);
+}
+
+// Copies the tile's pixels out of a row-major image buffer, or back into it.
+template <typename T>
+void gather_tile(const std::vector<T>& image, int width, const tile& t, std::vector<T>& out)
+{
+	out.clear();
+	for (int j = t.y0; j < t.y1; ++j)
+		out.insert(out.end(), image.begin() + (size_t(j) * width + t.x0), image.begin() + (size_t(j) * width + t.x1));
+}
+
+template <typename T>
+void scatter_tile(std::vector<T>& image, int width, const tile& t, const std::vector<T>& in)
+{
+	const size_t row = size_t(t.x1 - t.x0);
+	for (int j = t.y0; j < t.y1; ++j)
+		std::copy(in.begin() + row * (j - t.y0), in.begin() + row * (j - t.y0 + 1), image.begin() + (size_t(j) * width + t.x0));
+}
+
+#ifndef _WIN32
+
+namespace dist_net
+{
+	inline bool send_all(int fd, const void* data, size_t size)
+	{
+		const char* p = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			size -= size_t(n);
+		}
+		return true;
+	}
+
+	inline bool recv_all(int fd, void* data, size_t size)
+	{
+		char* p = static_cast<char*>(data);
+		while (size > 0)
+		{
+			const ssize_t n = recv(fd, p, size, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			size -= size_t(n);
+		}
+		return true;
+	}
+
+	template <typename T>
+	bool send_vector(int fd, const std::vector<T>& v) { return send_all(fd, v.data(), v.size() * sizeof(T)); }
+
+	template <typename T>
+	bool recv_vector(int fd, std::vector<T>& v, size_t count)
+	{
+		v.resize(count);
+		return recv_all(fd, v.data(), count * sizeof(T));
+	}
+
+	inline void set_timeout(int fd, int seconds)
+	{
+		timeval tv = {};
+		tv.tv_sec = seconds;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	inline void set_options(int fd)
+	{
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	// "host:port" -> connected socket, or -1.
+	inline int connect_to(const std::string& address)
+	{
+		const size_t colon = address.rfind(':');
+		if (colon == std::string::npos)
+			return -1;
+
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* found = nullptr;
+		if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &found) != 0)
+			return -1;
+
+		int fd = -1;
+		for (addrinfo* a = found; a != nullptr && fd < 0; a = a->ai_next)
+		{
+			fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(found);
+
+		if (fd >= 0)
+			set_options(fd);
+		return fd;
+	}
+
+	// Listening socket on the IPv4 address bind_address ("0.0.0.0" for every interface);
+	// port 0 picks a free port, returned in bound_port.
+	inline int listen_on(const std::string& bind_address, int port, int& bound_port)
+	{
+		in_addr host = {};
+		if (inet_pton(AF_INET, bind_address.c_str(), &host) != 1)
+			return -1;
+
+		const int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		const int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr = host;
+		addr.sin_port = htons(static_cast<uint16_t>(port));
+
+		socklen_t len = sizeof(addr);
+		if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 64) != 0
+			|| getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+
+		bound_port = ntohs(addr.sin_port);
+		return fd;
+	}
+}
+
+class dist_coordinator
+{
+public:
+	dist_coordinator(uint64_t scene_hash, int max_depth) : scene_hash(scene_hash), max_depth(max_depth) {}
+	~dist_coordinator();
+
+	dist_coordinator(const dist_coordinator&) = delete;
+	dist_coordinator& operator=(const dist_coordinator&) = delete;
+
+	// Workers are not authenticated beyond the scene hash, so only bind to an address
+	// reachable from machines you trust.
+	bool listen(const std::string& bind_address, int port);
+	int port() const { return bound_port; }
+
+	// Starts count local workers: this executable with --worker 127.0.0.1:<port> and args.
+	bool spawn(int count, const std::vector<std::string>& args);
+
+	// Blocks until every tile has been rendered by some worker, merging the results into f.
+	// pass_end holds the sample count every pixel should reach. Fails if the workers are all
+	// gone and none joins within DIST_JOIN_TIMEOUT; f then holds the tiles finished so far.
+	bool run(const std::vector<tile>& tiles, film& f, const std::vector<uint32_t>& pass_end, path_stats& stats);
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct worker
+	{
+		int fd;
+		uint32_t threads;
+		long job;				// index into the tiles of the current run, -1 when idle
+		clock::time_point started;
+	};
+
+	// A connection whose hello is still arriving. It is read as it comes in, so a client that
+	// connects and stays silent never holds up the workers.
+	struct greeting
+	{
+		int fd;
+		clock::time_point since;
+		dist_hello hello;
+		size_t received;
+	};
+
+	uint64_t scene_hash;
+	int max_depth;
+	int listen_fd = -1;
+	int bound_port = 0;
+	std::vector<worker> workers;
+	std::vector<greeting> greetings;
+	std::vector<pid_t> children;
+
+	void accept_worker();
+	bool read_hello(greeting& g);
+	void drop_worker(size_t k, const char* reason, std::deque<long>& pending);
+	bool receive(worker& w, const tile& t, film& f, path_stats& stats);
+};
+
+dist_coordinator::~dist_coordinator()
+{
+	// Workers exit when their connection closes.
+	for (worker& w : workers)
+		close(w.fd);
+	for (greeting& g : greetings)
+		close(g.fd);
+	if (listen_fd >= 0)
+		close(listen_fd);
+
+	for (pid_t pid : children)
+		waitpid(pid, nullptr, 0);
+}
+
+bool dist_coordinator::listen(const std::string& bind_address, int port)
+{
+	listen_fd = dist_net::listen_on(bind_address, port, bound_port);
+	if (listen_fd < 0)
+	{
+		std::cerr << "Cannot listen on " << bind_address << " port " << port << '\n';
+		return false;
+	}
+
+	std::cerr << "coordinator listening on " << bind_address << " port " << bound_port << '\n';
+	return true;
+}
+
+bool dist_coordinator::spawn(int count, const std::vector<std::string>& args)
+{
+	std::vector<std::string> argv_strings = { "RayTracingClass_OneWeek", "--worker", "127.0.0.1:" + std::to_string(bound_port) };
+	argv_strings.insert(argv_strings.end(), args.begin(), args.end());
+
+	std::vector<char*> argv;
+	for (std::string& s : argv_strings)
+		argv.push_back(&s[0]);
+	argv.push_back(nullptr);
+
+	for (int k = 0; k < count; ++k)
+	{
+		const pid_t pid = fork();
+		if (pid < 0)
+		{
+			std::cerr << "Cannot start worker process\n";
+			return false;
+		}
+
+		if (pid == 0)
+		{
+			execv("/proc/self/exe", argv.data());
+			_exit(127);
+		}
+
+		children.push_back(pid);
+	}
+
+	return true;
+}
+
+void dist_coordinator::accept_worker()
+{
+	const int fd = accept(listen_fd, nullptr, nullptr);
+	if (fd < 0)
+		return;
+
+	dist_net::set_options(fd);
+	dist_net::set_timeout(fd, DIST_IO_TIMEOUT);
+	greetings.push_back({ fd, clock::now(), dist_hello(), 0 });
+}
+
+// Reads what has arrived of g's hello without waiting for more. Once it is complete the
+// connection becomes a worker or is rejected; either way the greeting is over and this
+// returns true. Also true, with the connection closed, if it fails before that.
+bool dist_coordinator::read_hello(greeting& g)
+{
+	const ssize_t n = recv(g.fd, reinterpret_cast<char*>(&g.hello) + g.received, sizeof(g.hello) - g.received, MSG_DONTWAIT);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return false;
+	if (n <= 0)
+	{
+		std::cerr << "\nworker rejected: bad handshake\n";
+		close(g.fd);
+		return true;
+	}
+
+	g.received += size_t(n);
+	if (g.received < sizeof(g.hello))
+		return false;
+
+	const dist_hello& hello = g.hello;
+	const bool valid = std::memcmp(hello.magic, "RTDIST\0", 8) == 0 && hello.version == DIST_VERSION;
+	const uint32_t accepted = valid && hello.scene_hash == scene_hash;
+
+	if (!dist_net::send_all(g.fd, &accepted, sizeof(accepted)) || !accepted)
+	{
+		std::cerr << (valid ? "\nworker rejected: different scene or camera\n" : "\nworker rejected: bad handshake\n");
+		close(g.fd);
+		return true;
+	}
+
+	workers.push_back({ g.fd, hello.threads, -1, clock::now() });
+	std::cerr << "\nworker joined (" << hello.threads << " threads), " << workers.size() << " connected\n";
+	return true;
+}
+
+void dist_coordinator::drop_worker(size_t k, const char* reason, std::deque<long>& pending)
+{
+	// Its tile goes to the front of the queue, so the pass does not end waiting on it.
+	if (workers[k].job >= 0)
+		pending.push_front(workers[k].job);
+
+	close(workers[k].fd);
+	workers.erase(workers.begin() + k);
+	std::cerr << "\nworker lost (" << reason << "), " << workers.size() << " left\n";
+}
+
+bool dist_coordinator::receive(worker& w, const tile& t, film& f, path_stats& stats)
+{
+	dist_result result;
+	std::vector<film::pixel> pixels;
+	std::vector<uint64_t> depth_rays;
+	std::vector<material_set> sets;
+
+	// The sizes in the result header size allocations, so they must be exactly what the job asked for.
+	const size_t n = tile_pixels(t);
+	if (!dist_net::recv_all(w.fd, &result, sizeof(result)) || result.id != uint32_t(w.job) || result.n_depths > uint32_t(max_depth)
+		|| result.n_material_sets != (f.tracks_materials() ? n : 0)
+		|| !dist_net::recv_vector(w.fd, pixels, n) || !dist_net::recv_vector(w.fd, depth_rays, result.n_depths)
+		|| !dist_net::recv_vector(w.fd, sets, static_cast<size_t>(result.n_material_sets)))
+		return false;
+
+	// Check every set before merging any of them.
+	for (const material_set& m : sets)
+		if (m.n > PIXEL_MATERIALS)
+			return false;
+
+	scatter_tile(f.data(), f.width(), t, pixels);
+	size_t k = 0;
+	for (int j = t.y0; j < t.y1 && !sets.empty(); ++j)
+		for (int i = t.x0; i < t.x1; ++i)
+			f.materials()[size_t(j) * f.width() + i].merge(sets[k++]);
+
+	path_stats job_stats(0);
+	job_stats.depth_rays.swap(depth_rays);
+	job_stats.roulette_kills = result.roulette_kills;
+	job_stats.shadow_rays = result.shadow_rays;
+	stats.merge(job_stats);
+
+	return true;
+}
+
+bool dist_coordinator::run(const std::vector<tile>& tiles, film& f, const std::vector<uint32_t>& pass_end, path_stats& stats)
+{
+	std::deque<long> pending;
+	for (size_t k = 0; k < tiles.size(); ++k)
+		pending.push_back(static_cast<long>(k));
+
+	size_t done = 0;
+	auto alone_since = clock::now();
+	std::vector<film::pixel> pixels;
+	std::vector<uint32_t> ends;
+
+	while (done < tiles.size())
+	{
+		// Hand every idle worker the next tile.
+		for (size_t k = 0; k < workers.size() && !pending.empty();)
+		{
+			worker& w = workers[k];
+			if (w.job >= 0)
+			{
+				++k;
+				continue;
+			}
+
+			const long index = pending.front();
+			const tile& t = tiles[index];
+			const dist_job job = { static_cast<uint32_t>(index), t.x0, t.y0, t.x1, t.y1, f.tracks_materials() ? 1u : 0u };
+			gather_tile(f.data(), f.width(), t, pixels);
+			gather_tile(pass_end, f.width(), t, ends);
+
+			pending.pop_front();
+			w.job = index;
+			w.started = clock::now();
+
+			if (!dist_net::send_all(w.fd, &job, sizeof(job)) || !dist_net::send_vector(w.fd, pixels) || !dist_net::send_vector(w.fd, ends))
+				drop_worker(k, "send failed", pending);
+			else
+				++k;
+		}
+
+		if (workers.empty())
+		{
+			if (clock::now() - alone_since > std::chrono::seconds(DIST_JOIN_TIMEOUT))
+			{
+				std::cerr << "\nno workers left\n";
+				return false;
+			}
+		}
+		else
+		{
+			alone_since = clock::now();
+		}
+
+		// Wait for results, hellos and new workers.
+		std::vector<pollfd> fds;
+		fds.push_back({ listen_fd, POLLIN, 0 });
+		for (const worker& w : workers)
+			fds.push_back({ w.fd, POLLIN, 0 });
+		const size_t first_greeting = fds.size();
+		for (const greeting& g : greetings)
+			fds.push_back({ g.fd, POLLIN, 0 });
+
+		if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR)
+		{
+			std::cerr << "poll failed\n";
+			return false;
+		}
+
+		// Workers first, back to front, so dropping one does not shift the ones still to visit.
+		for (size_t k = workers.size(); k-- > 0;)
+		{
+			worker& w = workers[k];
+			const short events = fds[k + 1].revents;
+
+			if (events & POLLIN)
+			{
+				if (w.job < 0 || !receive(w, tiles[w.job], f, stats))
+				{
+					drop_worker(k, "disconnected", pending);
+					continue;
+				}
+
+				w.job = -1;
+				std::cerr << "\rtiles done: " << ++done << ' ' << std::flush;
+			}
+			else if (events & (POLLERR | POLLHUP | POLLNVAL))
+			{
+				drop_worker(k, "disconnected", pending);
+			}
+			else if (w.job >= 0 && clock::now() - w.started > std::chrono::seconds(DIST_JOB_TIMEOUT))
+			{
+				drop_worker(k, "timed out", pending);
+			}
+		}
+
+		// Greetings after the workers, so one that joins is not looked at as a worker this round.
+		for (size_t k = greetings.size(); k-- > 0;)
+		{
+			greeting& g = greetings[k];
+			bool over = (fds[first_greeting + k].revents & (POLLIN | POLLERR | POLLHUP)) && read_hello(g);
+			if (!over && clock::now() - g.since > std::chrono::seconds(DIST_HELLO_TIMEOUT))
+			{
+				std::cerr << "\nworker rejected: no hello within " << DIST_HELLO_TIMEOUT << " s\n";
+				close(g.fd);
+				over = true;
+			}
+
+			if (over)
+				greetings.erase(greetings.begin() + k);
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_worker();
+	}
+
+	return true;
+}
+
+// Connects to the coordinator at address ("host:port") and renders the tiles it sends into f
+// until it closes the connection. Returns false if the coordinator cannot be reached or rejects us.
+bool run_worker(const std::string& address, uint64_t scene_hash, unsigned threads, film& f,
+	std::vector<uint32_t>& pass_end, int max_depth, const dist_render_func& render)
+{
+	// The coordinator may still be starting up.
+	int fd = -1;
+	const auto sta = std::chrono::steady_clock::now();
+	while ((fd = dist_net::connect_to(address)) < 0)
+	{
+		if (std::chrono::steady_clock::now() - sta > std::chrono::seconds(DIST_JOIN_TIMEOUT))
+		{
+			std::cerr << "Cannot connect to coordinator " << address << '\n';
+			return false;
+		}
+		usleep(200 * 1000);
+	}
+
+	dist_hello hello = {};
+	std::memcpy(hello.magic, "RTDIST\0", 8);
+	hello.version = DIST_VERSION;
+	hello.threads = threads;
+	hello.scene_hash = scene_hash;
+
+	uint32_t accepted = 0;
+	if (!dist_net::send_all(fd, &hello, sizeof(hello)) || !dist_net::recv_all(fd, &accepted, sizeof(accepted)) || !accepted)
+	{
+		std::cerr << "Coordinator " << address << " rejected this worker: different scene, camera or version\n";
+		close(fd);
+		return false;
+	}
+
+	std::vector<film::pixel> pixels;
+	std::vector<uint32_t> ends;
+	std::vector<material_set> sets;
+	size_t jobs = 0;
+
+	dist_job job;
+	while (dist_net::recv_all(fd, &job, sizeof(job)))
+	{
+		const tile t = { job.x0, job.y0, job.x1, job.y1 };
+		if (t.x0 < 0 || t.y0 < 0 || t.x1 > f.width() || t.y1 > f.height() || t.x0 >= t.x1 || t.y0 >= t.y1
+			|| !dist_net::recv_vector(fd, pixels, tile_pixels(t)) || !dist_net::recv_vector(fd, ends, tile_pixels(t)))
+		{
+			std::cerr << "Bad job from coordinator\n";
+			break;
+		}
+
+		// The coordinator keeps the material sets and merges in what this job adds.
+		scatter_tile(f.data(), f.width(), t, pixels);
+		scatter_tile(pass_end, f.width(), t, ends);
+		if (job.materials && !f.tracks_materials())
+			f.track_materials();
+		if (f.tracks_materials())
+		{
+			sets.assign(tile_pixels(t), material_set());
+			scatter_tile(f.materials(), f.width(), t, sets);
+		}
+
+		path_stats stats(max_depth);
+		render(t, stats);
+		gather_tile(f.data(), f.width(), t, pixels);
+		sets.clear();
+		if (job.materials)
+			gather_tile(f.materials(), f.width(), t, sets);
+
+		const dist_result result = { job.id, static_cast<uint32_t>(stats.depth_rays.size()), stats.roulette_kills, stats.shadow_rays, sets.size() };
+		if (!dist_net::send_all(fd, &result, sizeof(result)) || !dist_net::send_vector(fd, pixels) || !dist_net::send_vector(fd, stats.depth_rays)
+			|| !dist_net::send_vector(fd, sets))
+			break;
+
+		++jobs;
+	}
+
+	close(fd);
+	std::cerr << "worker done, " << jobs << " tiles\n";
+	return true;
+}
+
+#else
+
+// Windows builds have no socket transport yet; every entry point reports that and fails.
+class dist_coordinator
+{
+public:
+	dist_coordinator(uint64_t, int) {}
+
+	bool listen(const std::string&, int)
+	{
+		std::cerr << "Distributed rendering needs a POSIX system\n";
+		return false;
+	}
+	int port() const { return 0; }
+	bool spawn(int, const std::vector<std::string>&) { return false; }
+	bool run(const std::vector<tile>&, film&, const std::vector<uint32_t>&, path_stats&) { return false; }
+};
+
+inline bool run_worker(const std::string&, uint64_t, unsigned, film&, std::vector<uint32_t>&, int, const dist_render_func&)
+{
+	std::cerr << "Distributed rendering needs a POSIX system\n";
+	return false;
+}
+
+#endif
+
+#endif
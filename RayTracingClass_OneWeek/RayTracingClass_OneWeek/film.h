@@ -0,0 +1,211 @@
+#pragma once
+
+#define FILM_H
+#ifdef FILM_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "material.h"
+#include "PPM.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#define PIXEL_MATERIALS 15	// distinct materials a path or pixel records before it counts as material_any
+
+// The material indices a path, or every path of a pixel, depended on, in no particular order.
+// A fixed array keeps the film's sets in one flat buffer; past PIXEL_MATERIALS the last slot
+// becomes material_any, which matches every edit.
+struct material_set
+{
+	uint32_t n = 0;
+	uint32_t ids[PIXEL_MATERIALS] = {};
+
+	void add(uint32_t mat)
+	{
+		for (uint32_t k = 0; k < n; ++k)
+			if (ids[k] == mat || ids[k] == material_any)
+				return;
+
+		if (n < PIXEL_MATERIALS)
+			ids[n++] = mat;
+		else
+			ids[PIXEL_MATERIALS - 1] = material_any;
+	}
+
+	void merge(const material_set& other)
+	{
+		for (uint32_t k = 0; k < other.n; ++k)
+			add(other.ids[k]);
+	}
+
+	// True if the set holds a material of edited (sorted), or overflowed.
+	bool touches(const std::vector<uint32_t>& edited) const
+	{
+		for (uint32_t k = 0; k < n; ++k)
+			if (ids[k] == material_any || std::binary_search(edited.begin(), edited.end(), ids[k]))
+				return true;
+		return false;
+	}
+};
+
+// What a camera ray saw first: the guide features of the denoiser.
+// A ray that leaves the scene has no normal, a white albedo and zero depth.
+// It also collects every material the whole path depended on.
+struct first_hit
+{
+	vec3 normal;
+	color albedo{ 1, 1, 1 };
+	real depth = 0;			// distance from the camera
+	material_set materials;
+};
+
+// Float accumulation buffer. Every pixel keeps a running mean of its samples and,
+// with Welford's algorithm, the sum of squared deviations of their luminance, so
+// the renderer can tell how noisy a pixel still is without storing the samples.
+// The first-hit features of the samples are averaged alongside.
+class film
+{
+public:
+	struct pixel
+	{
+		float mean[3] = { 0, 0, 0 };
+		float m2 = 0;
+		uint32_t n = 0;
+		float normal[3] = { 0, 0, 0 };
+		float albedo[3] = { 0, 0, 0 };
+		float depth = 0;
+	};
+
+	film(int width, int height) : w(width), h(height), pixels(size_t(width) * height) {}
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	void add_sample(int i, int j, const color& c, const first_hit& hit)
+	{
+		pixel& p = at(i, j);
+		const float before = luminance(p.mean);
+
+		p.n++;
+		const float inv_n = 1.0f / p.n;
+		for (int k = 0; k < 3; ++k)
+			p.mean[k] += (static_cast<float>(c[k]) - p.mean[k]) * inv_n;
+
+		// Luminance is linear in rgb, so the luminance of the mean is the mean luminance.
+		const float x = static_cast<float>(0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z());
+		p.m2 += (x - before) * (x - luminance(p.mean));
+
+		for (int k = 0; k < 3; ++k)
+		{
+			p.normal[k] += (static_cast<float>(hit.normal[k]) - p.normal[k]) * inv_n;
+			p.albedo[k] += (static_cast<float>(hit.albedo[k]) - p.albedo[k]) * inv_n;
+		}
+		p.depth += (static_cast<float>(hit.depth) - p.depth) * inv_n;
+		if (!material_sets.empty())
+			material_sets[size_t(j) * w + i].merge(hit.materials);
+	}
+
+	// Starts collecting every pixel's material_set, the union of its samples' first_hit::materials.
+	// Only worth it when a checkpoint will be written: it is what lets a resume after a material
+	// edit keep the pixels that never saw the edited materials.
+	void track_materials() { material_sets.assign(pixels.size(), material_set()); }
+	bool tracks_materials() const { return !material_sets.empty(); }
+
+	// Drops the samples of every pixel whose paths touched a material in edited (sorted), so
+	// the next passes render those pixels again from their first sample. Without material
+	// sets every pixel counts as touched. Returns how many.
+	size_t reset_pixels(const std::vector<uint32_t>& edited)
+	{
+		if (edited.empty())
+			return 0;
+
+		size_t n_reset = 0;
+		for (size_t k = 0; k < pixels.size(); ++k)
+		{
+			if (pixels[k].n > 0 && (material_sets.empty() || material_sets[k].touches(edited)))
+			{
+				pixels[k] = pixel();
+				if (!material_sets.empty())
+					material_sets[k] = material_set();
+				n_reset++;
+			}
+		}
+		return n_reset;
+	}
+
+	// Material sets, row by row from the bottom like data(); empty unless tracked.
+	std::vector<material_set>& materials() { return material_sets; }
+	const std::vector<material_set>& materials() const { return material_sets; }
+
+	uint32_t samples(int i, int j) const { return at(i, j).n; }
+
+	// Raw pixel storage, row by row from the bottom, for checkpoints.
+	std::vector<pixel>& data() { return pixels; }
+	const std::vector<pixel>& data() const { return pixels; }
+
+	color mean(int i, int j) const
+	{
+		const pixel& p = at(i, j);
+		return color(p.mean[0], p.mean[1], p.mean[2]);
+	}
+
+	// Estimated variance of the pixel's mean luminance, infinite below two samples.
+	double variance(int i, int j) const
+	{
+		const pixel& p = at(i, j);
+		if (p.n < 2)
+			return infinity;
+
+		return p.m2 / (double(p.n - 1) * p.n);
+	}
+
+	// Half-width of the 95% confidence interval of the pixel, measured after the gamma-2
+	// transform of write_color, i.e. in the [0, 1] units the pixel is finally stored in.
+	double error(int i, int j) const
+	{
+		const pixel& p = at(i, j);
+		if (p.n < 2)
+			return infinity;
+
+		const double brightness = std::fmax(luminance(p.mean), 1e-4);
+		return 1.96 * std::sqrt(variance(i, j)) / (2.0 * std::sqrt(brightness));
+	}
+
+	void write(PPM& ppm) const
+	{
+		for (int j = 0; j < h; ++j)
+			for (int i = 0; i < w; ++i)
+				write_color(ppm, j, i, mean(i, j), 1);
+	}
+
+	// Black (no samples) through red and yellow to white (max_spp samples).
+	void write_heatmap(PPM& ppm, uint32_t max_spp) const
+	{
+		for (int j = 0; j < h; ++j)
+		{
+			for (int i = 0; i < w; ++i)
+			{
+				write_color(ppm, j, i, heat_color(double(samples(i, j)) / max_spp), 1);
+			}
+		}
+	}
+
+	static float luminance(const float rgb[3])
+	{
+		return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+	}
+
+private:
+	int w;
+	int h;
+	std::vector<pixel> pixels;
+	std::vector<material_set> material_sets;
+
+	pixel& at(int i, int j) { return pixels[size_t(j) * w + i]; }
+	const pixel& at(int i, int j) const { return pixels[size_t(j) * w + i]; }
+};
+
+#endif
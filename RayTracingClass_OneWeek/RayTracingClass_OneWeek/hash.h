@@ -0,0 +1,48 @@
+#pragma once
+
+#define HASH_H
+#ifdef HASH_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstring>
+
+// FNV-1a style hash over the raw bytes of whatever is added, eight bytes a step so that
+// hashing every sphere of a large scene stays cheap. The fold after each multiply carries
+// the high bits down, which a word-wide FNV step alone never does.
+class hasher
+{
+public:
+	void add(const void* data, size_t size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		size_t k = 0;
+		for (; k + 8 <= size; k += 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, bytes + k, 8);
+			step(word);
+		}
+		for (; k < size; ++k)
+			step(bytes[k]);
+	}
+
+	template <typename T>
+	void add(const T& value) { add(&value, sizeof(T)); }
+
+	void add(const vec3& v) { add(v.x()); add(v.y()); add(v.z()); }
+
+	uint64_t value() const { return h; }
+
+private:
+	void step(uint64_t word)
+	{
+		h = (h ^ word) * 1099511628211ULL;
+		h ^= h >> 32;
+	}
+
+	uint64_t h = 14695981039346656037ULL;
+};
+
+#endif
@@ -4,28 +4,44 @@
 #ifdef HITTABLE_H
 
 #include "rtweekend.h"
+#include "aabb.h"
 
-class material;
+#include <cstdint>
 
-struct hit_record
+template <typename T>
+struct hit_record_t
 {
-	point3 p;
-	vec3 normal;
-	shared_ptr<material> mat_ptr;
-	double t = -1.0;
+	vec3_t<T> p;
+	vec3_t<T> normal;
+	uint32_t mat = 0;		// index into the scene's material_table
+	T t = -1;
 	bool front_face;
 
-	inline void set_face_normal(const ray& r, const vec3& outward_normal)
+	inline void set_face_normal(const ray_t<T>& r, const vec3_t<T>& outward_normal)
 	{
 		front_face = dot(r.direction(), outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
 };
 
-class hittable
+template <typename T>
+class hittable_t
 {
 public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+	virtual bool hit(const ray_t<T>& r, T t_min, T t_max, hit_record_t<T>& rec) const = 0;
+	virtual bool bounding_box(aabb& output_box) const = 0;
+
+	// Any-hit query for shadow and visibility rays: whether anything lies in [t_min, t_max].
+	// Overrides stop at the first intersection and fill in no hit record; this fallback
+	// only keeps hittables without one working.
+	virtual bool occluded(const ray_t<T>& r, T t_min, T t_max) const
+	{
+		hit_record_t<T> rec;
+		return hit(r, t_min, t_max, rec);
+	}
 };
 
+using hit_record = hit_record_t<real>;
+using hittable = hittable_t<real>;
+
 #endif
\ No newline at end of file
@@ -20,18 +20,20 @@ public:
 	void clear() { objects.clear(); }
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
-private:
+public:
 	std::vector<shared_ptr<hittable>> objects;
 
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
 	hit_record temp_rec;
 	bool hit_anything = false;
-	double closest_so_far = t_max;
+	real closest_so_far = t_max;
 
 	for (const std::shared_ptr<hittable>& object : objects)
 	{
@@ -46,4 +48,35 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const
+{
+	for (const std::shared_ptr<hittable>& object : objects)
+	{
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	}
+
+	return false;
+}
+
+bool hittable_list::bounding_box(aabb& output_box) const
+{
+	if (objects.empty())
+		return false;
+
+	aabb temp_box;
+	bool first_box = true;
+
+	for (const std::shared_ptr<hittable>& object : objects)
+	{
+		if (!object->bounding_box(temp_box))
+			return false;
+
+		output_box = first_box ? temp_box : surrounding_box(output_box, temp_box);
+		first_box = false;
+	}
+
+	return true;
+}
+
 #endif 
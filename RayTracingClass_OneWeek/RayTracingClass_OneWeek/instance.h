@@ -0,0 +1,215 @@
+#pragma once
+
+#define INSTANCE_H
+#ifdef INSTANCE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instrument.h"
+
+#include <cmath>
+#include <iostream>
+
+// Affine transform p -> A p + b, stored as the 3x4 matrix [A | b].
+class transform
+{
+public:
+	transform() : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+	static transform translate(const vec3& offset)
+	{
+		transform t;
+		for (int r = 0; r < 3; ++r)
+			t.m[r][3] = offset[r];
+		return t;
+	}
+
+	static transform scale(const vec3& s)
+	{
+		transform t;
+		for (int r = 0; r < 3; ++r)
+			t.m[r][r] = s[r];
+		return t;
+	}
+
+	static transform scale(real s) { return scale(vec3(s, s, s)); }
+
+	// Rotation by degrees around axis, counter-clockwise when the axis points at the viewer (Rodrigues).
+	static transform rotate(const vec3& axis, double degrees)
+	{
+		const vec3 a = unit_vector(axis);
+		const real c = static_cast<real>(std::cos(degrees_to_radians(degrees)));
+		const real s = static_cast<real>(std::sin(degrees_to_radians(degrees)));
+
+		transform t;
+		for (int r = 0; r < 3; ++r)
+			for (int k = 0; k < 3; ++k)
+				t.m[r][k] = (1 - c) * a[r] * a[k] + (r == k ? c : 0);
+
+		t.m[0][1] -= s * a[2]; t.m[1][0] += s * a[2];
+		t.m[0][2] += s * a[1]; t.m[2][0] -= s * a[1];
+		t.m[1][2] -= s * a[0]; t.m[2][1] += s * a[0];
+		return t;
+	}
+
+	// Applies o first, then this.
+	transform operator*(const transform& o) const
+	{
+		transform t;
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int k = 0; k < 4; ++k)
+			{
+				real sum = k == 3 ? m[r][3] : 0;
+				for (int j = 0; j < 3; ++j)
+					sum += m[r][j] * o.m[j][k];
+				t.m[r][k] = sum;
+			}
+		}
+		return t;
+	}
+
+	// Fails (returns false) for a singular transform.
+	bool inverse(transform& out) const
+	{
+		const real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		if (std::fabs(det) < real(1e-12))
+			return false;
+
+		const real inv_det = 1 / det;
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				// Adjugate: cofactor of element (k, r).
+				const int r0 = (k + 1) % 3, r1 = (k + 2) % 3;
+				const int c0 = (r + 1) % 3, c1 = (r + 2) % 3;
+				out.m[r][k] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * inv_det;
+			}
+		}
+		for (int r = 0; r < 3; ++r)
+			out.m[r][3] = -(out.m[r][0] * m[0][3] + out.m[r][1] * m[1][3] + out.m[r][2] * m[2][3]);
+		return true;
+	}
+
+	point3 point(const point3& p) const
+	{
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	// Multiplies by the transpose of A. Normals go through the transpose of the inverse,
+	// so an instance maps object-space normals with its world_to_object.transposed_vector().
+	vec3 transposed_vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+			m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+			m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+private:
+	real m[3][4];
+};
+
+// One placement of a shared object (a sphere, a bvh_node over a cluster, any hittable)
+// through an affine transform. Rays are moved into object space instead of the object
+// into world space, so a thousand copies of a cluster share one copy of its spheres and
+// its BVH, and cost a transform and a box each. Put the instances in a bvh_node of their
+// own for two-level traversal: the top level finds instances, the object's BVH the rest.
+class instance : public hittable
+{
+public:
+	instance(shared_ptr<hittable> object, const transform& object_to_world);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+private:
+	shared_ptr<hittable> object;
+	transform world_to_object;
+	aabb box;
+	bool has_box = false;
+};
+
+instance::instance(shared_ptr<hittable> object, const transform& object_to_world)
+	: object(object)
+{
+	if (!object_to_world.inverse(world_to_object))
+	{
+		std::cerr << "Singular instance transform; the instance is ignored.\n";
+		this->object = nullptr;
+		return;
+	}
+
+	// World box: the box around the eight transformed corners of the object's box.
+	aabb object_box;
+	if (!object->bounding_box(object_box))
+		return;
+
+	for (int k = 0; k < 8; ++k)
+	{
+		const point3 corner((k & 1) ? object_box.max().x() : object_box.min().x(),
+			(k & 2) ? object_box.max().y() : object_box.min().y(),
+			(k & 4) ? object_box.max().z() : object_box.min().z());
+		const point3 p = object_to_world.point(corner);
+		box = k == 0 ? aabb(p, p) : surrounding_box(box, aabb(p, p));
+	}
+	has_box = true;
+}
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	if (object == nullptr)
+		return false;
+
+	count_test(counted_prim::instance);
+
+	// The direction is not renormalized, so t is the same ray parameter in both spaces.
+	const ray object_ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+	if (!object->hit(object_ray, t_min, t_max, rec))
+		return false;
+
+	// The object picked the normal facing the ray; the inverse transpose keeps that side.
+	rec.p = r.at(rec.t);
+	rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+
+	count_hit(counted_prim::instance);
+	return true;
+}
+
+bool instance::occluded(const ray& r, real t_min, real t_max) const
+{
+	if (object == nullptr)
+		return false;
+
+	count_test(counted_prim::instance);
+	if (!object->occluded(ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction())), t_min, t_max))
+		return false;
+
+	count_hit(counted_prim::instance);
+	return true;
+}
+
+bool instance::bounding_box(aabb& output_box) const
+{
+	output_box = box;
+	return has_box;
+}
+
+#endif
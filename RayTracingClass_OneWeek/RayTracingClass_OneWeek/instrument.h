@@ -0,0 +1,153 @@
+#pragma once
+
+#define INSTRUMENT_H
+#ifdef INSTRUMENT_H
+
+// Hot-path counters. Build with RT_INSTRUMENT=1 to enable them; otherwise every
+// count_* call below is an empty inline function and compiles away.
+
+#ifndef RT_INSTRUMENT
+#define RT_INSTRUMENT 0
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define INSTRUMENT_MAX_PATH 64		// longer paths share the last path-length bucket
+
+enum class counted_prim
+{
+	sphere,
+	bvh_node,
+	sphere_set,
+	cache_node,
+	cache_sphere,
+	instance,
+	mesh_node,
+	triangle
+};
+
+static const int n_counted_prims = 8;
+static const int n_counted_materials = 4;	// one per material_type
+
+inline const char* counted_prim_name(int prim)
+{
+	static const char* names[n_counted_prims] = { "sphere", "bvh_node", "sphere_set", "cache_node", "cache_sphere", "instance", "mesh_node", "triangle" };
+	return names[prim];
+}
+
+struct instrument_counters
+{
+	uint64_t tests[n_counted_prims] = {};
+	uint64_t hits[n_counted_prims] = {};
+	uint64_t scattered[n_counted_materials] = {};		// by material type
+	uint64_t absorbed[n_counted_materials] = {};
+	std::vector<uint64_t> material_scatters;			// by material index, scattered or not
+	uint64_t path_length[INSTRUMENT_MAX_PATH + 1] = {};	// rays traced per finished path
+
+	void merge(const instrument_counters& other)
+	{
+		for (int k = 0; k < n_counted_prims; ++k)
+		{
+			tests[k] += other.tests[k];
+			hits[k] += other.hits[k];
+		}
+		for (int k = 0; k < n_counted_materials; ++k)
+		{
+			scattered[k] += other.scattered[k];
+			absorbed[k] += other.absorbed[k];
+		}
+		if (material_scatters.size() < other.material_scatters.size())
+			material_scatters.resize(other.material_scatters.size(), 0);
+		for (size_t k = 0; k < other.material_scatters.size(); ++k)
+			material_scatters[k] += other.material_scatters[k];
+		for (int k = 0; k <= INSTRUMENT_MAX_PATH; ++k)
+			path_length[k] += other.path_length[k];
+	}
+};
+
+// Every thread counts into its own instrument_counters, so counting needs no atomics.
+// The counters outlive their threads and are summed by instrument::total().
+class instrument
+{
+public:
+	static instrument_counters& local()
+	{
+		thread_local instrument_counters* counters = nullptr;
+		if (counters == nullptr)
+		{
+			std::shared_ptr<instrument_counters> c = std::make_shared<instrument_counters>();
+			std::lock_guard<std::mutex> lock(registry_mutex());
+			registry().push_back(c);
+			counters = c.get();
+		}
+		return *counters;
+	}
+
+	// Only meaningful while no thread is counting, e.g. after the render.
+	static instrument_counters total()
+	{
+		instrument_counters sum;
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		for (const std::shared_ptr<instrument_counters>& c : registry())
+			sum.merge(*c);
+		return sum;
+	}
+
+private:
+	static std::mutex& registry_mutex()
+	{
+		static std::mutex m;
+		return m;
+	}
+
+	static std::vector<std::shared_ptr<instrument_counters>>& registry()
+	{
+		static std::vector<std::shared_ptr<instrument_counters>> r;
+		return r;
+	}
+};
+
+inline void count_test(counted_prim prim, uint64_t n = 1)
+{
+#if RT_INSTRUMENT
+	instrument::local().tests[static_cast<int>(prim)] += n;
+#else
+	(void)prim; (void)n;
+#endif
+}
+
+inline void count_hit(counted_prim prim)
+{
+#if RT_INSTRUMENT
+	instrument::local().hits[static_cast<int>(prim)]++;
+#else
+	(void)prim;
+#endif
+}
+
+inline void count_scatter(int type, uint32_t material_index, bool scattered)
+{
+#if RT_INSTRUMENT
+	instrument_counters& c = instrument::local();
+	(scattered ? c.scattered : c.absorbed)[type]++;
+	if (c.material_scatters.size() <= material_index)
+		c.material_scatters.resize(size_t(material_index) + 1, 0);
+	c.material_scatters[material_index]++;
+#else
+	(void)type; (void)material_index; (void)scattered;
+#endif
+}
+
+inline void count_path(int rays)
+{
+#if RT_INSTRUMENT
+	instrument::local().path_length[rays < INSTRUMENT_MAX_PATH ? rays : INSTRUMENT_MAX_PATH]++;
+#else
+	(void)rays;
+#endif
+}
+
+#endif
@@ -0,0 +1,216 @@
+#pragma once
+
+#define INTEGRATOR_H
+#ifdef INTEGRATOR_H
+
+#include "rtweekend.h"
+
+#include "film.h"
+#include "hittable.h"
+#include "instrument.h"
+#include "lights.h"
+#include "material.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Per-worker path counters. depth_rays[d] is the number of rays traced after d bounces.
+struct path_stats
+{
+	std::vector<uint64_t> depth_rays;
+	uint64_t roulette_kills = 0;
+	uint64_t shadow_rays = 0;
+
+	path_stats(int max_depth = 0) : depth_rays(max_depth, 0) {}
+
+	void merge(const path_stats& other)
+	{
+		if (depth_rays.size() < other.depth_rays.size())
+			depth_rays.resize(other.depth_rays.size(), 0);
+
+		for (size_t d = 0; d < other.depth_rays.size(); ++d)
+			depth_rays[d] += other.depth_rays[d];
+
+		roulette_kills += other.roulette_kills;
+		shadow_rays += other.shadow_rays;
+	}
+
+	void print(std::ostream& out) const
+	{
+		uint64_t total = 0;
+		for (uint64_t n : depth_rays)
+			total += n;
+
+		const uint64_t primary = depth_rays.empty() ? 0 : depth_rays[0];
+		out << "rays: " << total << " (" << primary << " primary, "
+			<< (primary ? double(total) / primary : 0.0) << " per path), roulette kills: " << roulette_kills
+			<< ", shadow rays: " << shadow_rays << '\n';
+
+		out << "rays per depth:";
+		for (size_t d = 0; d < depth_rays.size() && depth_rays[d] > 0; ++d)
+			out << ' ' << depth_rays[d];
+		out << '\n';
+	}
+};
+
+// Russian roulette: keep the path with probability p = max(throughput) and divide the
+// survivors by p, so the estimate stays unbiased while dim paths end early.
+inline bool russian_roulette(color& throughput, sampler& smp, path_stats& stats)
+{
+	real p = std::fmin(real(1), std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())));
+
+	smp.skip_to(SAMPLER_ROULETTE_DIM);
+	if (smp.get_1d() >= p)
+	{
+		stats.roulette_kills++;
+		return false;
+	}
+
+	throughput /= p;
+	return true;
+}
+
+#define SPECULAR_FUZZ 0.1	// metal smoother than this counts as a mirror for first_hit
+
+// Fills in hit for a path that reached rec along r with the given throughput. Mirrors and
+// glass have no surface detail of their own, so the path is followed through them to the
+// next surface, whose albedo is tinted by the mirror's. Returns true once hit is final.
+inline bool record_first_hit(const ray& r, const hit_record& rec, const material_table& materials, const color& throughput, first_hit& hit)
+{
+	const material& m = materials[rec.mat];
+	hit.depth += rec.t * r.direction().length();
+
+	if (m.type == material_type::dielectric || (m.type == material_type::metal && m.fuzz < SPECULAR_FUZZ))
+		return false;
+
+	hit.normal = rec.normal;
+	hit.albedo = throughput * m.albedo;
+	return true;
+}
+
+// The path left the scene before reaching a surface the denoiser can use.
+inline void record_miss(const color& throughput, first_hit& hit)
+{
+	hit.normal = vec3(0, 0, 0);
+	hit.albedo = throughput;
+	hit.depth = 0;
+}
+
+// Next-event estimation at a lambertian hit: one light sample, weighted against the
+// chance that the bounce direction reaches the same light (power heuristic).
+inline color sample_direct(const hittable& world, const light_list& lights, const material& m, const hit_record& rec,
+	sampler& smp, path_stats& stats)
+{
+	light_sample ls;
+	smp.skip_to(SAMPLER_LIGHT_DIM);
+	if (!lights.sample(rec.p, smp, ls))
+		return color(0, 0, 0);
+
+	const real cosine = dot(rec.normal, ls.direction);
+	if (cosine <= 0)
+		return color(0, 0, 0);
+
+	stats.shadow_rays++;
+	if (world.occluded(ray(rec.p, ls.direction), real(0.001), ls.distance * real(1 - SHADOW_EPSILON)))
+		return color(0, 0, 0);
+
+	const real bsdf_pdf = cosine / real(pi);
+	return m.albedo * ls.radiance * (bsdf_pdf * power_heuristic(ls.pdf, bsdf_pdf) / ls.pdf);
+}
+
+// Density of the bounce that left a surface in direction scattered: the cosine lobe for
+// lambertian, 0 for the specular materials, which light sampling cannot reach.
+inline real scatter_pdf(const material& m, const hit_record& rec, const ray& scattered)
+{
+	if (m.type != material_type::lambertian)
+		return 0;
+	return std::fmax(real(0), dot(rec.normal, unit_vector(scattered.direction()))) / real(pi);
+}
+
+// Weight of the emission a bounce with density bsdf_pdf found at rec, against the chance
+// that light sampling at the bounce's origin picked the same direction.
+inline real emission_weight(const light_list& lights, real bsdf_pdf, const ray& r, const hit_record& rec)
+{
+	if (bsdf_pdf <= 0)
+		return 1;
+	return power_heuristic(bsdf_pdf, lights.pdf(r.origin(), rec));
+}
+
+// Depth-first path tracer: follows one path to the end, carrying the throughput forward.
+// Lambertian hits also sample a light directly (next-event estimation), and emission
+// found by a bounce is weighted against that sample with multiple importance sampling.
+// Russian roulette may end the path once it has bounced rr_min_depth times.
+// If hit is given, it receives the features of the first non-specular surface on the path
+// and every material the path depended on.
+color ray_color(const ray& r, const hittable& world, const material_table& materials, const light_list& lights,
+	int max_depth, int rr_min_depth, sampler& smp, path_stats& stats, first_hit* hit = nullptr)
+{
+	ray current = r;
+	color throughput(1, 1, 1);
+	color radiance(0, 0, 0);
+	real bsdf_pdf = 0;		// density of the bounce that produced current, 0 for camera rays and specular bounces
+	bool recording = hit != nullptr;
+
+	for (int depth = 0; depth < max_depth; ++depth)
+	{
+		stats.depth_rays[depth]++;
+
+		hit_record rec;
+		if (!world.hit(current, 0.001, infinity, rec))
+		{
+			if (recording)
+				record_miss(throughput, *hit);
+			count_path(depth + 1);
+			return radiance + throughput * lights.background(current);
+		}
+
+		if (recording)
+			recording = !record_first_hit(current, rec, materials, throughput, *hit);
+		if (hit != nullptr)
+			hit->materials.add(rec.mat);
+
+		const material& mat = materials[rec.mat];
+		if (mat.type == material_type::diffuse_light)
+		{
+			count_scatter(static_cast<int>(mat.type), rec.mat, false);
+			count_path(depth + 1);
+			return radiance + throughput * emitted(mat, rec) * emission_weight(lights, bsdf_pdf, current, rec);
+		}
+
+		ray scattered;
+		color attenuation;
+		smp.next_bounce();
+		const bool scattered_ok = scatter(mat, current, rec, attenuation, scattered, smp);
+		count_scatter(static_cast<int>(mat.type), rec.mat, scattered_ok);
+
+		if (mat.type == material_type::lambertian && !lights.empty())
+		{
+			radiance += throughput * sample_direct(world, lights, mat, rec, smp, stats);
+			if (hit != nullptr)
+				hit->materials.add(material_lights);
+		}
+
+		if (!scattered_ok)
+		{
+			count_path(depth + 1);
+			return radiance;
+		}
+
+		throughput = throughput * attenuation;
+		bsdf_pdf = lights.empty() ? 0 : scatter_pdf(mat, rec, scattered);
+		current = scattered;
+
+		if (depth + 1 >= rr_min_depth && !russian_roulette(throughput, smp, stats))
+		{
+			count_path(depth + 1);
+			return radiance;
+		}
+	}
+
+	// If we've exceeded the ray bounce limit, no more light is gathered.
+	count_path(max_depth);
+	return radiance;
+}
+
+#endif
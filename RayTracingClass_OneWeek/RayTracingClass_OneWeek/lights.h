@@ -0,0 +1,199 @@
+#pragma once
+
+#define LIGHTS_H
+#ifdef LIGHTS_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#define SHADOW_EPSILON 1e-4	// shadow rays stop this fraction short of the light, so they do not hit the light itself
+
+color sky_color(const ray& r)
+{
+	vec3 unit_direction = unit_vector(r.direction());
+	real t = real(0.5) * (unit_direction.y() + 1);
+
+	return (1 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+// Power heuristic (beta = 2): weight of a sample drawn with density a when another
+// strategy could have drawn the same direction with density b.
+inline real power_heuristic(real a, real b)
+{
+	const real a2 = a * a;
+	return a2 / (a2 + b * b);
+}
+
+// A sphere whose material is a diffuse_light.
+struct sphere_light
+{
+	point3 center;
+	real radius;
+	uint32_t mat;		// index into the scene's material_table
+	color emit;
+};
+
+struct light_sample
+{
+	vec3 direction;		// unit vector from the shaded point towards the light
+	real distance;		// along direction to the light's surface
+	color radiance;		// emitted towards the shaded point
+	real pdf;			// solid angle density, including the choice of light
+};
+
+// Everything in a scene that emits light: the sky and the sphere lights.
+// A light is picked in proportion to its power and then a direction inside the cone
+// the sphere covers as seen from the shaded point, so every sample lands on the light.
+class light_list
+{
+public:
+	explicit light_list(bool sky = true) : sky(sky) {}
+	light_list(std::vector<sphere_light> spheres, bool sky);
+
+	bool empty() const { return lights.empty(); }
+	size_t size() const { return lights.size(); }
+	bool has_sky() const { return sky; }
+
+	// Whether mat is the material of a light. Picking a light depends on all their powers,
+	// so a path that samples the lights depends on every such material.
+	bool has_material(uint32_t mat) const
+	{
+		return std::binary_search(lights.begin(), lights.end(), mat, by_material());
+	}
+
+	// Radiance of a ray that leaves the scene.
+	color background(const ray& r) const
+	{
+		return sky ? sky_color(r) : color(0, 0, 0);
+	}
+
+	// Picks a light and a direction towards it from p. Fails if p is inside the chosen light.
+	bool sample(const point3& p, sampler& smp, light_sample& out) const;
+
+	// Density with which sample(origin) would have produced the direction to rec, a hit on a light.
+	real pdf(const point3& origin, const hit_record& rec) const;
+
+private:
+	std::vector<sphere_light> lights;	// sorted by material, so a hit's light is found by binary search
+	std::vector<real> cdf;				// cdf[k]: chance of picking one of lights 0..k
+	bool sky;
+
+	struct by_material
+	{
+		bool operator()(const sphere_light& l, uint32_t m) const { return l.mat < m; }
+		bool operator()(uint32_t m, const sphere_light& l) const { return m < l.mat; }
+	};
+
+	real pick_pdf(size_t k) const { return cdf[k] - (k > 0 ? cdf[k - 1] : 0); }
+
+	// 1 - cos of the half angle of the cone light subtends from p, or 0 if p is inside it.
+	// Written as sin^2 / (1 + cos) so tiny, far lights do not cancel out to zero.
+	static real cone_size(const sphere_light& light, const point3& p)
+	{
+		const real d2 = (light.center - p).length_squared();
+		const real r2 = light.radius * light.radius;
+		if (d2 <= r2)
+			return 0;
+
+		const real sin2 = r2 / d2;
+		return sin2 / (1 + std::sqrt(1 - sin2));
+	}
+};
+
+light_list::light_list(std::vector<sphere_light> spheres, bool sky)
+	: lights(std::move(spheres)), sky(sky)
+{
+	std::stable_sort(lights.begin(), lights.end(), [](const sphere_light& a, const sphere_light& b) { return a.mat < b.mat; });
+
+	// Power ~ luminance of the emission times the surface area.
+	double total = 0;
+	std::vector<double> power(lights.size());
+	for (size_t k = 0; k < lights.size(); ++k)
+	{
+		const sphere_light& l = lights[k];
+		power[k] = (0.2126 * l.emit.x() + 0.7152 * l.emit.y() + 0.0722 * l.emit.z()) * l.radius * l.radius;
+		total += power[k];
+	}
+
+	cdf.resize(lights.size());
+	double sum = 0;
+	for (size_t k = 0; k < lights.size(); ++k)
+	{
+		sum += total > 0 ? power[k] : 1;
+		cdf[k] = static_cast<real>(sum / (total > 0 ? total : double(lights.size())));
+	}
+	if (!cdf.empty())
+		cdf.back() = 1;
+}
+
+bool light_list::sample(const point3& p, sampler& smp, light_sample& out) const
+{
+	if (lights.empty())
+		return false;
+
+	const real u = static_cast<real>(smp.get_1d());
+	const size_t k = std::min<size_t>(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), lights.size() - 1);
+	const sphere_light& light = lights[k];
+
+	const real one_minus_cos_max = cone_size(light, p);
+	if (one_minus_cos_max <= 0)
+		return false;
+
+	// Uniform direction inside the cone around the axis w towards the centre.
+	const vec3 d = light.center - p;
+	const real d2 = d.length_squared();
+	const vec3 w = d / std::sqrt(d2);
+	const vec3 a = std::fabs(w.x()) > real(0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	const vec3 v = unit_vector(cross(w, a));
+	const vec3 uu = cross(w, v);
+
+	const sample2 s = smp.get_2d();
+	const real cos_theta = 1 - real(s.x) * one_minus_cos_max;
+	const real sin_theta = std::sqrt(std::fmax(real(0), 1 - cos_theta * cos_theta));
+	const real phi = real(2 * pi * s.y);
+	out.direction = (std::cos(phi) * sin_theta) * uu + (std::sin(phi) * sin_theta) * v + cos_theta * w;
+
+	// Nearest intersection with the sphere; a grazing direction may miss by rounding, take the tangent point then.
+	const real b = dot(out.direction, d);
+	const real discriminant = light.radius * light.radius - (d2 - b * b);
+	out.distance = b - std::sqrt(std::fmax(real(0), discriminant));
+
+	out.radiance = light.emit;
+	out.pdf = pick_pdf(k) / real(2 * pi * one_minus_cos_max);
+	return true;
+}
+
+real light_list::pdf(const point3& origin, const hit_record& rec) const
+{
+	auto range = std::equal_range(lights.begin(), lights.end(), rec.mat, by_material());
+	if (range.first == range.second)
+		return 0;
+
+	// Several spheres may share the light's material: take the one whose surface rec lies on.
+	auto best = range.first;
+	real best_error = infinity;
+	for (auto it = range.first; range.second - range.first > 1 && it != range.second; ++it)
+	{
+		const real error = std::fabs((rec.p - it->center).length() - it->radius);
+		if (error < best_error)
+		{
+			best_error = error;
+			best = it;
+		}
+	}
+
+	const real one_minus_cos_max = cone_size(*best, origin);
+	if (one_minus_cos_max <= 0)
+		return 0;
+
+	return pick_pdf(static_cast<size_t>(best - lights.begin())) / real(2 * pi * one_minus_cos_max);
+}
+
+#endif
@@ -6,111 +6,168 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
-struct hit_record;
+#include <cstdint>
+#include <vector>
 
-class material
+enum class material_type
 {
-public:
-	virtual bool scatter(const ray& r, const hit_record& rec, color& attenuation, ray& scattered)
-		const = 0;
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light
 };
 
-class lambertian : public material
+// Every material the renderer knows, as plain data. Hit records refer to one by its
+// index in a material_table, and scatter() switches on the type, so shading neither
+// touches reference counts nor makes virtual calls.
+struct material
 {
-public:
-	lambertian(const color& a) : albedo(a) {}
-
-	virtual bool scatter(
-		const ray& r_in,
-		const hit_record& rec,
-		color& attenuation,
-		ray& scattered
-	) const override
-	{
-		vec3 scatter_direction = rec.normal + random_unit_vector();
+	material_type type;
+	color albedo;			// lambertian, metal; emitted radiance for diffuse_light
+	real fuzz;				// metal
+	real ir;				// dielectric: index of refraction
+};
 
-		// Catch degenerate scatter direction
-		if (scatter_direction.near_zero())
-			scatter_direction = rec.normal;
+inline material make_lambertian(const color& a)
+{
+	return { material_type::lambertian, a, 0, 1 };
+}
 
-		scattered = ray(rec.p, scatter_direction);
-		attenuation = albedo;
-		return true;
-	}
+inline material make_metal(const color& a, real f)
+{
+	return { material_type::metal, a, f < 1 ? f : 1, 1 };
+}
 
-private:
-	color albedo;
-};
+inline material make_dielectric(real index_of_refraction)
+{
+	return { material_type::dielectric, color(1.0, 1.0, 1.0), 0, index_of_refraction };
+}
 
-class metal : public material
+inline material make_diffuse_light(const color& emit)
+{
+	return { material_type::diffuse_light, emit, 0, 1 };
+}
+
+// Radiance leaving a light's surface towards the ray that hit it. Lights emit from the front face only.
+inline color emitted(const material& m, const hit_record& rec)
+{
+	if (m.type != material_type::diffuse_light || !rec.front_face)
+		return color(0, 0, 0);
+	return m.albedo;
+}
+
+// Pseudo material indices, kept with the real ones in the material_set of a path or pixel.
+// material_lights: the path sampled the lights, which depends on every light's material.
+// material_any: the path or pixel touched more materials than a material_set holds; it matches every edit.
+const uint32_t material_lights = UINT32_MAX - 1;
+const uint32_t material_any = UINT32_MAX;
+
+// All materials of a scene in one contiguous array.
+class material_table
 {
 public:
-	metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
-
-	virtual bool scatter(
-		const ray& r_in,
-		const hit_record& rec,
-		color& attenuation,
-		ray& scattered
-	) const override
+	uint32_t add(const material& m)
 	{
-		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-		attenuation = albedo;
-		return (dot(scattered.direction(), rec.normal) > 0);
+		materials.push_back(m);
+		return static_cast<uint32_t>(materials.size() - 1);
 	}
 
+	const material& operator[](uint32_t index) const { return materials[index]; }
+	size_t size() const { return materials.size(); }
+
 private:
-	color albedo;
-	double fuzz;
+	std::vector<material> materials;
 };
 
-class dielectric : public material
+inline bool scatter_lambertian(
+	const material& m,
+	const ray& /*r_in*/,
+	const hit_record& rec,
+	color& attenuation,
+	ray& scattered,
+	sampler& smp
+)
 {
-public:
-	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
-
-	virtual bool scatter(
-		const ray& r_in,
-		const hit_record& rec,
-		color& attenuation,
-		ray& scattered
-	) const override
+	vec3 scatter_direction = rec.normal + random_unit_vector(smp);
+
+	// Catch degenerate scatter direction
+	if (scatter_direction.near_zero())
+		scatter_direction = rec.normal;
+
+	scattered = ray(rec.p, scatter_direction);
+	attenuation = m.albedo;
+	return true;
+}
+
+inline bool scatter_metal(
+	const material& m,
+	const ray& r_in,
+	const hit_record& rec,
+	color& attenuation,
+	ray& scattered,
+	sampler& smp
+)
+{
+	vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+	scattered = ray(rec.p, reflected + m.fuzz * random_in_unit_sphere(smp));
+	attenuation = m.albedo;
+	return (dot(scattered.direction(), rec.normal) > 0);
+}
+
+inline real reflectance(real cosine, real ref_idx)
+{
+	// Use Schlick's approximation for reflection.
+	real r0 = (1 - ref_idx) / (1 + ref_idx);
+	r0 = r0 * r0;
+	return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+}
+
+inline bool scatter_dielectric(
+	const material& m,
+	const ray& r_in,
+	const hit_record& rec,
+	color& attenuation,
+	ray& scattered,
+	sampler& smp
+)
+{
+	attenuation = color(1.0, 1.0, 1.0);
+	real refraction_ratio = rec.front_face ? (1 / m.ir) : m.ir;
+
+	vec3 unit_direction = unit_vector(r_in.direction());
+	real cos_theta = std::fmin(dot(-unit_direction, rec.normal), real(1));
+	real sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+
+	vec3 direction;
+
+	if (refraction_ratio * sin_theta > 1.0 || reflectance(cos_theta, refraction_ratio) > smp.get_1d()) // (because sin_theta_dot cannot over 1)
+	{
+		// Must Reflect
+		direction = reflect(unit_direction, rec.normal);
+	}
+	else
 	{
-		attenuation = color(1.0, 1.0, 1.0);
-		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
-
-		vec3 unit_direction = unit_vector(r_in.direction());
-		double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-		double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
-
-		vec3 direction;
-
-		if (refraction_ratio * sin_theta > 1.0 || reflectance(cos_theta, refraction_ratio) > random_double()) // (because sin_theta_dot cannot over 1)
-		{
-			// Must Reflect
-			direction = reflect(unit_direction, rec.normal);
-		}
-		else
-		{
-			// Can Refract
-			direction = refract(unit_direction, rec.normal, refraction_ratio);
-		}
-
-		scattered = ray(rec.p, direction);
-		return true;
+		// Can Refract
+		direction = refract(unit_direction, rec.normal, refraction_ratio);
 	}
 
-private:
-	double ir; // Index of Refraction
+	scattered = ray(rec.p, direction);
+	return true;
+}
 
-	static double reflectance(double cosine, double ref_idx)
+inline bool scatter(const material& m, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp)
+{
+	switch (m.type)
 	{
-		// Use Schlick's approximation for reflection.
-		double r0 = (1 - ref_idx) / (1 + ref_idx);
-		r0 = r0 * r0;
-		return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+	case material_type::metal:
+		return scatter_metal(m, r_in, rec, attenuation, scattered, smp);
+	case material_type::dielectric:
+		return scatter_dielectric(m, r_in, rec, attenuation, scattered, smp);
+	case material_type::diffuse_light:
+		return false;	// lights absorb; their emission is added by the integrator
+	default:
+		return scatter_lambertian(m, r_in, rec, attenuation, scattered, smp);
 	}
-};
+}
 
 #endif
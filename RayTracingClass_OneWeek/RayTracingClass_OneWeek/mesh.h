@@ -0,0 +1,1046 @@
+#pragma once
+
+#define MESH_H
+#ifdef MESH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hash.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instrument.h"
+#include "mapped_file.h"
+#include "scene.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MESH_LEAF_SIZE 4
+#define MESH_SAH_DEPTH 32			// deeper subtrees are split at the median, as in the scene cache
+#define MESH_MAX_DEPTH 64
+#define MESH_FLAT_PAD 1e-4f		// half-thickness given to flat leaf boxes, relative to the coordinate (at least 1)
+#define MESH_PARALLEL_THRESHOLD 65536	// subtrees with fewer triangles are built on the calling thread
+#define MESH_CHUNK_BYTES (1 << 20)		// a mesh file is parsed by up to one thread per this many bytes
+
+// Vertices and triangles of a mesh file: every three indices are one triangle.
+struct mesh_data
+{
+	std::vector<vec3_t<float>> vertices;
+	std::vector<uint32_t> indices;
+};
+
+struct mesh_node
+{
+	vec3_t<float> min;
+	vec3_t<float> max;
+	uint32_t offset;		// first triangle of a leaf, or the second child of an interior node (the first child is the next node)
+	uint16_t count;			// triangles in a leaf, 0 for an interior node
+	uint16_t axis;			// split axis, to visit the nearer child first
+};
+
+// An indexed triangle mesh with one material. Vertices are shared through the index
+// buffer and kept in float; the triangles are reordered into the leaves of a flat BVH
+// of their own, so a mesh is one hittable however many triangles it has.
+class triangle_mesh : public hittable
+{
+public:
+	triangle_mesh(mesh_data data, uint32_t mat);
+
+	size_t size() const { return indices.size() / 3; }
+	size_t vertex_count() const { return vertices.size(); }
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+private:
+	std::vector<vec3_t<float>> vertices;
+	std::vector<uint32_t> indices;		// in leaf order
+	std::vector<mesh_node> nodes;
+	uint32_t mat;
+
+	struct primitive
+	{
+		uint32_t index;
+		aabb box;
+		point3 centroid;
+	};
+
+	static void build(std::vector<primitive>& prims, std::vector<mesh_node>& out, size_t start, size_t end, int depth);
+
+	// The closest triangle hit in [t_min, t_max], with t_max lowered to its t, or with any_hit
+	// the first one found. SIZE_MAX if there is none.
+	template <bool any_hit>
+	size_t find_hit(const ray& r, real t_min, real& t_max) const;
+};
+
+triangle_mesh::triangle_mesh(mesh_data data, uint32_t mat)
+	: vertices(std::move(data.vertices)), mat(mat)
+{
+	const size_t n = data.indices.size() / 3;
+	if (n == 0)
+		return;
+
+	std::vector<primitive> prims(n);
+	for (size_t k = 0; k < n; ++k)
+	{
+		const point3 p0(vertices[data.indices[3 * k]]);
+		const point3 p1(vertices[data.indices[3 * k + 1]]);
+		const point3 p2(vertices[data.indices[3 * k + 2]]);
+
+		prims[k].index = static_cast<uint32_t>(k);
+		prims[k].box = surrounding_box(aabb(p0, p0), surrounding_box(aabb(p1, p1), aabb(p2, p2)));
+		prims[k].centroid = (p0 + p1 + p2) / 3;
+	}
+
+	nodes.reserve(2 * n / MESH_LEAF_SIZE + 1);
+	build(prims, nodes, 0, n, 0);
+
+	// Leaves refer to ranges of prims, so the triangles go in prims order.
+	indices.resize(3 * n);
+	for (size_t k = 0; k < n; ++k)
+		std::memcpy(&indices[3 * k], &data.indices[3 * size_t(prims[k].index)], 3 * sizeof(uint32_t));
+}
+
+void triangle_mesh::build(std::vector<primitive>& prims, std::vector<mesh_node>& out, size_t start, size_t end, int depth)
+{
+	const size_t index = out.size();
+	out.push_back(mesh_node());
+
+	if (end - start <= MESH_LEAF_SIZE)
+	{
+		// The boxes hold float vertices, so converting them back is exact.
+		mesh_node& leaf = out[index];
+		aabb box = prims[start].box;
+		for (size_t k = start + 1; k < end; ++k)
+			box = surrounding_box(box, prims[k].box);
+
+		leaf.min = vec3_t<float>(box.min());
+		leaf.max = vec3_t<float>(box.max());
+
+		// Triangles in an axis-aligned plane give the box zero thickness on that axis, and the
+		// slab tests here and in aabb::hit (t1 > t0) never enter it. Widen such an axis a little;
+		// interior nodes and the mesh's bounding_box are unions of leaves, so they follow.
+		for (int a = 0; a < 3; ++a)
+		{
+			if (leaf.min[a] == leaf.max[a])
+			{
+				const float pad = MESH_FLAT_PAD * std::max(1.0f, std::fabs(leaf.min[a]));
+				leaf.min[a] -= pad;
+				leaf.max[a] += pad;
+			}
+		}
+
+		leaf.offset = static_cast<uint32_t>(start);
+		leaf.count = static_cast<uint16_t>(end - start);
+		return;
+	}
+
+	size_t mid;
+	if (depth < MESH_SAH_DEPTH)
+	{
+		mid = bvh_split(prims, start, end);
+	}
+	else
+	{
+		aabb centroids(prims[start].centroid, prims[start].centroid);
+		for (size_t k = start + 1; k < end; ++k)
+			centroids = surrounding_box(centroids, aabb(prims[k].centroid, prims[k].centroid));
+
+		const int axis = centroids.longest_axis();
+		mid = start + (end - start) / 2;
+		std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+			[axis](const primitive& a, const primitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	size_t second;
+	if (end - start >= MESH_PARALLEL_THRESHOLD && depth < bvh_parallel_depth())
+	{
+		// The halves touch disjoint ranges of prims: the second one is built into a node
+		// array of its own on another thread and appended with its child offsets moved.
+		std::vector<mesh_node> right_nodes;
+		std::future<void> right_future = std::async(std::launch::async, [&prims, &right_nodes, mid, end, depth] {
+			build(prims, right_nodes, mid, end, depth + 1);
+		});
+		build(prims, out, start, mid, depth + 1);
+		right_future.get();
+
+		second = out.size();
+		for (mesh_node node : right_nodes)
+		{
+			if (node.count == 0)
+				node.offset += static_cast<uint32_t>(second);
+			out.push_back(node);
+		}
+	}
+	else
+	{
+		build(prims, out, start, mid, depth + 1);
+		second = out.size();
+		build(prims, out, mid, end, depth + 1);
+	}
+
+	mesh_node& node = out[index];
+	const mesh_node& left = out[index + 1];
+	const mesh_node& right = out[second];
+	for (int a = 0; a < 3; ++a)
+	{
+		node.min[a] = std::fmin(left.min[a], right.min[a]);
+		node.max[a] = std::fmax(left.max[a], right.max[a]);
+	}
+
+	const vec3_t<float> d = node.max - node.min;
+	node.axis = static_cast<uint16_t>(d.x() > d.y() && d.x() > d.z() ? 0 : (d.y() > d.z() ? 1 : 2));
+	node.offset = static_cast<uint32_t>(second);
+	node.count = 0;
+}
+
+template <bool any_hit>
+size_t triangle_mesh::find_hit(const ray& r, real t_min, real& t_max) const
+{
+	if (nodes.empty())
+		return SIZE_MAX;
+
+	const point3 origin = r.origin();
+	const vec3 direction = r.direction();
+	const vec3 inv_d(1 / direction.x(), 1 / direction.y(), 1 / direction.z());
+
+	uint32_t stack[MESH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+
+	size_t closest = SIZE_MAX;
+
+	while (top > 0)
+	{
+		const uint32_t index = stack[--top];
+		const mesh_node& node = nodes[index];
+		count_test(counted_prim::mesh_node);
+
+		// Slab test, as in aabb::hit.
+		real t0 = t_min, t1 = t_max;
+		bool inside = true;
+		for (int k = 0; k < 3 && inside; ++k)
+		{
+			real near_t = (static_cast<real>(node.min[k]) - origin[k]) * inv_d[k];
+			real far_t = (static_cast<real>(node.max[k]) - origin[k]) * inv_d[k];
+			if (inv_d[k] < 0)
+				std::swap(near_t, far_t);
+
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+			inside = t1 > t0;
+		}
+		if (!inside)
+			continue;
+		count_hit(counted_prim::mesh_node);
+
+		if (node.count > 0)
+		{
+			// Moller-Trumbore: solve origin + t d = p0 + u e1 + v e2 by Cramer's rule.
+			count_test(counted_prim::triangle, node.count);
+			for (uint32_t k = node.offset; k < node.offset + node.count; ++k)
+			{
+				const uint32_t* tri = &indices[3 * size_t(k)];
+				const point3 p0(vertices[tri[0]]);
+				const vec3 e1 = point3(vertices[tri[1]]) - p0;
+				const vec3 e2 = point3(vertices[tri[2]]) - p0;
+
+				const vec3 pvec = cross(direction, e2);
+				const real det = dot(e1, pvec);
+				if (det == 0)
+					continue;
+				const real inv_det = 1 / det;
+
+				const vec3 tvec = origin - p0;
+				const real u = dot(tvec, pvec) * inv_det;
+				if (u < 0 || u > 1)
+					continue;
+
+				const vec3 qvec = cross(tvec, e1);
+				const real v = dot(direction, qvec) * inv_det;
+				if (v < 0 || u + v > 1)
+					continue;
+
+				const real t = dot(e2, qvec) * inv_det;
+				if (t < t_min || t > t_max)
+					continue;
+
+				t_max = t;
+				closest = k;
+				count_hit(counted_prim::triangle);
+				if (any_hit)
+					return closest;
+			}
+			continue;
+		}
+
+		// Push the farther child first so the nearer one is visited first and shrinks t_max early.
+		if (direction[node.axis] < 0)
+		{
+			stack[top++] = index + 1;
+			stack[top++] = node.offset;
+		}
+		else
+		{
+			stack[top++] = node.offset;
+			stack[top++] = index + 1;
+		}
+	}
+
+	return closest;
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const size_t closest = find_hit<false>(r, t_min, t_max);
+	if (closest == SIZE_MAX)
+		return false;
+
+	// Flat shading: the geometric normal, with the winding deciding the front face.
+	const uint32_t* tri = &indices[3 * closest];
+	const point3 p0(vertices[tri[0]]);
+	const vec3 normal = cross(point3(vertices[tri[1]]) - p0, point3(vertices[tri[2]]) - p0);
+
+	rec.t = t_max;
+	rec.p = r.at(rec.t);
+	rec.set_face_normal(r, unit_vector(normal));
+	rec.mat = mat;
+
+	return true;
+}
+
+bool triangle_mesh::occluded(const ray& r, real t_min, real t_max) const
+{
+	return find_hit<true>(r, t_min, t_max) != SIZE_MAX;
+}
+
+bool triangle_mesh::bounding_box(aabb& output_box) const
+{
+	if (nodes.empty())
+		return false;
+
+	output_box = aabb(point3(nodes[0].min), point3(nodes[0].max));
+	return true;
+}
+
+// Parsers for the mesh files. Both read straight from the mapped file and split
+// it into parts that are parsed on their own threads and then concatenated.
+namespace mesh_parse
+{
+	// Runs fn(part) for part = 0 .. n_parts - 1, each on its own thread, and waits for all of them.
+	template <typename F>
+	void parallel(unsigned n_parts, F fn)
+	{
+		std::vector<std::thread> threads;
+		for (unsigned part = 1; part < n_parts; ++part)
+			threads.emplace_back(fn, part);
+		fn(0u);
+		for (std::thread& t : threads)
+			t.join();
+	}
+
+	inline unsigned parts_for(size_t bytes)
+	{
+		const size_t by_size = bytes / MESH_CHUNK_BYTES + 1;
+		return static_cast<unsigned>(std::min<size_t>(by_size, std::max(1u, std::thread::hardware_concurrency())));
+	}
+
+	inline bool is_blank(unsigned char c) { return c == ' ' || c == '\t' || c == '\r'; }
+	inline bool is_digit(unsigned char c) { return c >= '0' && c <= '9'; }
+
+	inline double power_of_ten(int e)
+	{
+		static const double exact[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		if (e >= 0 && e <= 22)
+			return exact[e];
+		if (e < 0 && e >= -22)
+			return 1 / exact[-e];
+		return std::pow(10.0, e);
+	}
+
+	// Decimal number with optional sign, fraction and exponent. Unlike strtod it needs
+	// no terminating '\0', so it can read up to the last byte of the mapping.
+	inline bool read_float(const unsigned char*& p, const unsigned char* end, float& out)
+	{
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int exponent = 0, digits = 0, significant = 0;
+		for (; p < end && is_digit(*p); ++p, ++digits)
+		{
+			if (significant < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				significant += mantissa > 0;
+			}
+			else
+			{
+				exponent++;
+			}
+		}
+		if (p < end && *p == '.')
+		{
+			for (++p; p < end && is_digit(*p); ++p, ++digits)
+			{
+				if (significant < 19)
+				{
+					mantissa = mantissa * 10 + (*p - '0');
+					significant += mantissa > 0;
+					exponent--;
+				}
+			}
+		}
+		if (digits == 0)
+			return false;
+
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			++p;
+			bool negative_exponent = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				negative_exponent = *p++ == '-';
+			if (p == end || !is_digit(*p))
+				return false;
+
+			int e = 0;
+			for (; p < end && is_digit(*p); ++p)
+				e = std::min(e * 10 + (*p - '0'), 9999);
+			exponent += negative_exponent ? -e : e;
+		}
+
+		const double value = static_cast<double>(mantissa) * power_of_ten(exponent);
+		out = static_cast<float>(negative ? -value : value);
+		return true;
+	}
+
+	inline bool read_int(const unsigned char*& p, const unsigned char* end, int64_t& out)
+	{
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		if (p == end || !is_digit(*p))
+			return false;
+
+		int64_t value = 0;
+		for (; p < end && is_digit(*p); ++p)
+			value = std::min<int64_t>(value * 10 + (*p - '0'), INT64_C(1) << 40);
+		out = negative ? -value : value;
+		return true;
+	}
+
+	// Line of the byte at p, for error messages.
+	inline size_t line_of(const unsigned char* begin, const unsigned char* p)
+	{
+		return 1 + std::count(begin, p, '\n');
+	}
+
+	struct obj_part
+	{
+		std::vector<vec3_t<float>> vertices;
+		std::vector<uint32_t> indices;		// absolute, except the relative ones listed in relative
+		std::vector<size_t> relative;		// entries of indices that count from this part's first vertex (as int32_t)
+		const unsigned char* error = nullptr;
+		const char* message = nullptr;
+	};
+
+	// Parses the 'v' and 'f' lines of [p, end); faces with more than three corners
+	// are split into a fan. Everything else (normals, texture coordinates, groups) is skipped.
+	inline void parse_obj_part(const unsigned char* p, const unsigned char* end, obj_part& out)
+	{
+		auto fail = [&](const unsigned char* at, const char* message) {
+			out.error = at;
+			out.message = message;
+		};
+
+		while (p < end)
+		{
+			const unsigned char* line_end = static_cast<const unsigned char*>(std::memchr(p, '\n', end - p));
+			if (line_end == nullptr)
+				line_end = end;
+
+			while (p < line_end && is_blank(*p))
+				p++;
+
+			if (line_end - p >= 2 && p[0] == 'v' && is_blank(p[1]))
+			{
+				const unsigned char* at = p;
+				p += 2;
+				float xyz[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					while (p < line_end && is_blank(*p))
+						p++;
+					if (!read_float(p, line_end, xyz[k]))
+						return fail(at, "expected: v <x> <y> <z>");
+				}
+				out.vertices.push_back(vec3_t<float>(xyz[0], xyz[1], xyz[2]));
+			}
+			else if (line_end - p >= 2 && p[0] == 'f' && is_blank(p[1]))
+			{
+				const unsigned char* at = p;
+				p += 2;
+				uint32_t first = 0, previous = 0;
+				size_t first_relative = 0, previous_relative = 0;		// 1 + entry in relative, 0 = absolute
+				int corners = 0;
+
+				for (;;)
+				{
+					while (p < line_end && is_blank(*p))
+						p++;
+					if (p == line_end)
+						break;
+
+					// v, v/vt, v//vn or v/vt/vn: only v is used.
+					int64_t v;
+					if (!read_int(p, line_end, v) || v == 0 || v > INT64_C(0xffffffff))
+						return fail(at, "bad vertex index in face");
+					while (p < line_end && !is_blank(*p))
+						p++;
+
+					// A negative index counts back from the last vertex so far; this part only
+					// knows its own vertices yet, so it is stored relative and rebased later.
+					const bool relative = v < 0;
+					const uint32_t index = relative ? static_cast<uint32_t>(static_cast<int32_t>(out.vertices.size() + v))
+						: static_cast<uint32_t>(v - 1);
+
+					if (corners >= 2)
+					{
+						const uint32_t corner[3] = { first, previous, index };
+						const bool is_relative[3] = { first_relative != 0, previous_relative != 0, relative };
+						for (int c = 0; c < 3; ++c)
+						{
+							if (is_relative[c])
+								out.relative.push_back(out.indices.size());
+							out.indices.push_back(corner[c]);
+						}
+					}
+
+					if (corners == 0)
+					{
+						first = index;
+						first_relative = relative;
+					}
+					previous = index;
+					previous_relative = relative;
+					corners++;
+				}
+
+				if (corners < 3)
+					return fail(at, "face with fewer than three vertices");
+			}
+
+			p = line_end + 1;
+		}
+	}
+
+	// Splits [data, data + size) at line starts into n_parts pieces.
+	inline std::vector<size_t> line_boundaries(const unsigned char* data, size_t size, unsigned n_parts)
+	{
+		std::vector<size_t> bounds(n_parts + 1, size);
+		bounds[0] = 0;
+		for (unsigned k = 1; k < n_parts; ++k)
+		{
+			const size_t guess = std::max(bounds[k - 1], size * k / n_parts);
+			const void* newline = guess > 0 ? std::memchr(data + guess - 1, '\n', size - guess + 1) : data;
+			bounds[k] = newline == nullptr ? size : static_cast<const unsigned char*>(newline) - data + (guess > 0 ? 1 : 0);
+		}
+		return bounds;
+	}
+
+	bool load_obj(const std::string& path, const mapped_file& file, mesh_data& mesh)
+	{
+		const unsigned char* data = file.data();
+		const size_t size = file.size();
+		const unsigned n_parts = parts_for(size);
+		const std::vector<size_t> bounds = line_boundaries(data, size, n_parts);
+
+		std::vector<obj_part> parts(n_parts);
+		parallel(n_parts, [&](unsigned k) { parse_obj_part(data + bounds[k], data + bounds[k + 1], parts[k]); });
+
+		// Where every part's vertices and indices go in the whole mesh.
+		std::vector<size_t> vertex_base(n_parts + 1, 0), index_base(n_parts + 1, 0);
+		for (unsigned k = 0; k < n_parts; ++k)
+		{
+			if (parts[k].error != nullptr)
+			{
+				std::cerr << path << ':' << line_of(data, parts[k].error) << ": " << parts[k].message << '\n';
+				return false;
+			}
+			vertex_base[k + 1] = vertex_base[k] + parts[k].vertices.size();
+			index_base[k + 1] = index_base[k] + parts[k].indices.size();
+		}
+
+		const size_t n_vertices = vertex_base[n_parts];
+		if (n_vertices > UINT32_MAX)
+		{
+			std::cerr << path << ": more than " << UINT32_MAX << " vertices\n";
+			return false;
+		}
+
+		mesh.vertices.resize(n_vertices);
+		mesh.indices.resize(index_base[n_parts]);
+
+		std::atomic<bool> out_of_range{ false };
+		parallel(n_parts, [&](unsigned k) {
+			obj_part& part = parts[k];
+			for (size_t e : part.relative)
+				part.indices[e] = static_cast<uint32_t>(static_cast<int64_t>(vertex_base[k]) + static_cast<int32_t>(part.indices[e]));
+
+			bool bad = false;
+			for (uint32_t index : part.indices)
+				bad |= index >= n_vertices;
+			if (bad)
+				out_of_range = true;
+
+			std::copy(part.vertices.begin(), part.vertices.end(), mesh.vertices.begin() + vertex_base[k]);
+			std::copy(part.indices.begin(), part.indices.end(), mesh.indices.begin() + index_base[k]);
+		});
+
+		if (out_of_range)
+		{
+			std::cerr << path << ": a face refers to a vertex that does not exist\n";
+			return false;
+		}
+
+		return true;
+	}
+
+	enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, none };
+
+	inline ply_type ply_type_of(const std::string& name)
+	{
+		if (name == "char" || name == "int8") return ply_type::int8;
+		if (name == "uchar" || name == "uint8") return ply_type::uint8;
+		if (name == "short" || name == "int16") return ply_type::int16;
+		if (name == "ushort" || name == "uint16") return ply_type::uint16;
+		if (name == "int" || name == "int32") return ply_type::int32;
+		if (name == "uint" || name == "uint32") return ply_type::uint32;
+		if (name == "float" || name == "float32") return ply_type::float32;
+		if (name == "double" || name == "float64") return ply_type::float64;
+		return ply_type::none;
+	}
+
+	inline size_t ply_size(ply_type t)
+	{
+		static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+		return sizes[static_cast<int>(t)];
+	}
+
+	// One scalar at p, byte-swapped when the file's byte order is not the machine's.
+	inline double ply_read(const unsigned char* p, ply_type t, bool swap)
+	{
+		unsigned char b[8];
+		const size_t n = ply_size(t);
+		for (size_t k = 0; k < n; ++k)
+			b[k] = p[swap ? n - 1 - k : k];
+
+		switch (t)
+		{
+		case ply_type::int8: { int8_t v; std::memcpy(&v, b, 1); return v; }
+		case ply_type::uint8: return b[0];
+		case ply_type::int16: { int16_t v; std::memcpy(&v, b, 2); return v; }
+		case ply_type::uint16: { uint16_t v; std::memcpy(&v, b, 2); return v; }
+		case ply_type::int32: { int32_t v; std::memcpy(&v, b, 4); return v; }
+		case ply_type::uint32: { uint32_t v; std::memcpy(&v, b, 4); return v; }
+		case ply_type::float32: { float v; std::memcpy(&v, b, 4); return v; }
+		case ply_type::float64: { double v; std::memcpy(&v, b, 8); return v; }
+		default: return 0;
+		}
+	}
+
+	struct ply_property
+	{
+		std::string name;
+		ply_type type = ply_type::none;			// of the value, or of the items of a list
+		ply_type count_type = ply_type::none;	// of the item count, none if not a list
+	};
+
+	struct ply_element
+	{
+		std::string name;
+		size_t count = 0;
+		std::vector<ply_property> properties;
+
+		bool fixed_size() const
+		{
+			for (const ply_property& p : properties)
+				if (p.count_type != ply_type::none)
+					return false;
+			return true;
+		}
+
+		size_t stride() const
+		{
+			size_t s = 0;
+			for (const ply_property& p : properties)
+				s += ply_size(p.type);
+			return s;
+		}
+
+		int find(const std::string& property) const
+		{
+			for (size_t k = 0; k < properties.size(); ++k)
+				if (properties[k].name == property)
+					return static_cast<int>(k);
+			return -1;
+		}
+	};
+
+	// A vertex index read from a PLY list; a negative or too large one becomes UINT32_MAX,
+	// which the check against the vertex count then rejects.
+	inline uint32_t ply_index(const unsigned char* p, ply_type t, bool swap)
+	{
+		const double v = ply_read(p, t, swap);
+		return v >= 0 && v < 4294967295.0 ? static_cast<uint32_t>(v) : UINT32_MAX;
+	}
+
+	// Bytes of one value of prop at p, or 0 if it runs past end.
+	inline size_t ply_value_size(const ply_property& prop, const unsigned char* p, const unsigned char* end, bool swap)
+	{
+		if (prop.count_type == ply_type::none)
+			return p + ply_size(prop.type) <= end ? ply_size(prop.type) : 0;
+
+		const size_t count_size = ply_size(prop.count_type);
+		if (p + count_size > end)
+			return 0;
+		const size_t n = count_size + static_cast<size_t>(std::max(0.0, ply_read(p, prop.count_type, swap))) * ply_size(prop.type);
+		return static_cast<size_t>(end - p) >= n ? n : 0;
+	}
+
+	// Bytes of one record of e at p, or 0 if it runs past end.
+	inline size_t ply_record_size(const ply_element& e, const unsigned char* p, const unsigned char* end, bool swap)
+	{
+		size_t n = 0;
+		for (const ply_property& prop : e.properties)
+		{
+			const size_t value_size = ply_value_size(prop, p + n, end, swap);
+			if (value_size == 0)
+				return 0;
+			n += value_size;
+		}
+		return n;
+	}
+
+	// Binary PLY, either byte order, with x, y, z per vertex and a vertex_indices list per face.
+	bool load_ply(const std::string& path, const mapped_file& file, mesh_data& mesh)
+	{
+		const unsigned char* data = file.data();
+		const unsigned char* end = data + file.size();
+
+		auto fail = [&](const std::string& message) {
+			std::cerr << path << ": " << message << '\n';
+			return false;
+		};
+
+		// Header: text lines up to end_header.
+		std::vector<ply_element> elements;
+		std::string format;
+		const unsigned char* p = data;
+		bool header_done = false;
+		for (int line = 0; p < end && !header_done; ++line)
+		{
+			const unsigned char* line_end = static_cast<const unsigned char*>(std::memchr(p, '\n', end - p));
+			if (line_end == nullptr)
+				break;
+
+			std::vector<std::string> tokens;
+			while (p < line_end)
+			{
+				while (p < line_end && is_blank(*p))
+					p++;
+				const unsigned char* token = p;
+				while (p < line_end && !is_blank(*p))
+					p++;
+				if (p > token)
+					tokens.emplace_back(token, p);
+			}
+			p = line_end + 1;
+
+			if (line == 0)
+			{
+				if (tokens.size() != 1 || tokens[0] != "ply")
+					return fail("not a PLY file");
+				continue;
+			}
+			if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info")
+				continue;
+
+			if (tokens[0] == "end_header")
+				header_done = true;
+			else if (tokens[0] == "format" && tokens.size() == 3)
+				format = tokens[1];
+			else if (tokens[0] == "element" && tokens.size() == 3)
+			{
+				ply_element e;
+				e.name = tokens[1];
+				e.count = static_cast<size_t>(std::strtoull(tokens[2].c_str(), nullptr, 10));
+				elements.push_back(e);
+			}
+			else if (tokens[0] == "property" && !elements.empty())
+			{
+				ply_property prop;
+				if (tokens.size() == 5 && tokens[1] == "list")
+				{
+					prop.count_type = ply_type_of(tokens[2]);
+					prop.type = ply_type_of(tokens[3]);
+					prop.name = tokens[4];
+					if (prop.count_type == ply_type::none || prop.count_type == ply_type::float32 || prop.count_type == ply_type::float64)
+						return fail("bad list count type '" + tokens[2] + "'");
+				}
+				else if (tokens.size() == 3)
+				{
+					prop.type = ply_type_of(tokens[1]);
+					prop.name = tokens[2];
+				}
+				if (prop.type == ply_type::none)
+					return fail("bad property in header");
+				elements.back().properties.push_back(prop);
+			}
+			else
+				return fail("bad header line");
+		}
+
+		if (!header_done)
+			return fail("no end_header");
+		if (format != "binary_little_endian" && format != "binary_big_endian")
+			return fail("only binary PLY files are supported, this one is " + (format.empty() ? std::string("unknown") : format));
+
+		const uint16_t one = 1;
+		const bool machine_little = *reinterpret_cast<const unsigned char*>(&one) == 1;
+		const bool swap = (format == "binary_little_endian") != machine_little;
+
+		bool have_vertices = false, have_faces = false;
+		for (const ply_element& e : elements)
+		{
+			if (have_vertices && have_faces)
+				break;
+
+			if (e.name == "vertex")
+			{
+				const int x = e.find("x"), y = e.find("y"), z = e.find("z");
+				if (x < 0 || y < 0 || z < 0 || !e.fixed_size())
+					return fail("vertices need x, y and z and no list properties");
+
+				const size_t stride = e.stride();
+				if (e.count > UINT32_MAX || static_cast<size_t>(end - p) / stride < e.count)
+					return fail("truncated vertex data");
+
+				size_t offset[3] = {};
+				const int axes[3] = { x, y, z };
+				for (int a = 0; a < 3; ++a)
+					for (int k = 0; k < axes[a]; ++k)
+						offset[a] += ply_size(e.properties[k].type);
+
+				const ply_type types[3] = { e.properties[x].type, e.properties[y].type, e.properties[z].type };
+				const unsigned char* base = p;
+				const unsigned n_parts = parts_for(e.count * stride);
+				mesh.vertices.resize(e.count);
+				parallel(n_parts, [&](unsigned part) {
+					const size_t begin = e.count * part / n_parts, last = e.count * (part + 1) / n_parts;
+					for (size_t k = begin; k < last; ++k)
+					{
+						const unsigned char* record = base + k * stride;
+						mesh.vertices[k] = vec3_t<float>(
+							static_cast<float>(ply_read(record + offset[0], types[0], swap)),
+							static_cast<float>(ply_read(record + offset[1], types[1], swap)),
+							static_cast<float>(ply_read(record + offset[2], types[2], swap)));
+					}
+				});
+
+				p += e.count * stride;
+				have_vertices = true;
+				continue;
+			}
+
+			if (e.name == "face")
+			{
+				int list = e.find("vertex_indices");
+				if (list < 0)
+					list = e.find("vertex_index");
+				if (list < 0 || e.properties[list].count_type == ply_type::none
+					|| e.properties[list].type == ply_type::float32 || e.properties[list].type == ply_type::float64)
+					return fail("faces need an integer vertex_indices list");
+
+				const ply_property& prop = e.properties[list];
+				const size_t count_size = ply_size(prop.count_type);
+				const size_t item_size = ply_size(prop.type);
+
+				// Fast path: faces that are nothing but a triangle list have a fixed stride,
+				// so they can be split between threads; anything else is walked in order.
+				bool all_triangles = e.properties.size() == 1;
+				const size_t stride = count_size + 3 * item_size;
+				all_triangles = all_triangles && static_cast<size_t>(end - p) / stride >= e.count;
+
+				if (all_triangles)
+				{
+					const unsigned char* base = p;
+					const unsigned n_parts = parts_for(e.count * stride);
+					std::atomic<bool> mixed{ false };
+					mesh.indices.resize(3 * e.count);
+					parallel(n_parts, [&](unsigned part) {
+						const size_t begin = e.count * part / n_parts, last = e.count * (part + 1) / n_parts;
+						for (size_t k = begin; k < last && !mixed; ++k)
+						{
+							const unsigned char* record = base + k * stride;
+							if (ply_read(record, prop.count_type, swap) != 3)
+							{
+								mixed = true;
+								break;
+							}
+							for (int c = 0; c < 3; ++c)
+								mesh.indices[3 * k + c] = ply_index(record + count_size + c * item_size, prop.type, swap);
+						}
+					});
+					all_triangles = !mixed;
+					if (all_triangles)
+						p += e.count * stride;
+				}
+
+				if (!all_triangles)
+				{
+					mesh.indices.clear();
+					for (size_t k = 0; k < e.count; ++k)
+					{
+						const size_t record_size = ply_record_size(e, p, end, swap);
+						if (record_size == 0)
+							return fail("truncated face data");
+
+						const unsigned char* q = p;
+						for (int before = 0; before < list; ++before)
+							q += ply_value_size(e.properties[before], q, end, swap);
+
+						// The count must fit in what is left of the record before it becomes a size_t.
+						const double count = ply_read(q, prop.count_type, swap);
+						q += count_size;
+						if (count < 0 || count > static_cast<double>((p + record_size - q) / item_size))
+							return fail("bad face vertex count");
+
+						const size_t corners = static_cast<size_t>(count);
+						for (size_t c = 2; c < corners; ++c)
+						{
+							mesh.indices.push_back(ply_index(q, prop.type, swap));
+							mesh.indices.push_back(ply_index(q + (c - 1) * item_size, prop.type, swap));
+							mesh.indices.push_back(ply_index(q + c * item_size, prop.type, swap));
+						}
+						p += record_size;
+					}
+				}
+
+				have_faces = true;
+				continue;
+			}
+
+			// Any other element is skipped.
+			if (e.fixed_size())
+			{
+				if (static_cast<size_t>(end - p) / std::max<size_t>(e.stride(), 1) < e.count)
+					return fail("truncated " + e.name + " data");
+				p += e.count * e.stride();
+			}
+			else
+			{
+				for (size_t k = 0; k < e.count; ++k)
+				{
+					const size_t record_size = ply_record_size(e, p, end, swap);
+					if (record_size == 0)
+						return fail("truncated " + e.name + " data");
+					p += record_size;
+				}
+			}
+		}
+
+		if (!have_vertices || !have_faces)
+			return fail("needs a vertex and a face element");
+
+		for (uint32_t index : mesh.indices)
+		{
+			if (index >= mesh.vertices.size())
+				return fail("a face refers to a vertex that does not exist");
+		}
+
+		return true;
+	}
+}
+
+// Loads an OBJ or binary PLY file (told apart by the "ply" magic) into mesh.
+bool load_mesh(const std::string& path, mesh_data& mesh)
+{
+	mapped_file file(path);
+	if (!file.is_open())
+	{
+		std::cerr << "Cannot open mesh " << path << '\n';
+		return false;
+	}
+
+	mesh = mesh_data();
+	const bool ply = file.size() >= 4 && std::memcmp(file.data(), "ply", 3) == 0 && (file.data()[3] == '\n' || file.data()[3] == '\r');
+	return ply ? mesh_parse::load_ply(path, file, mesh) : mesh_parse::load_obj(path, file, mesh);
+}
+
+// Loads the meshes of a scene and adds them to world. Mesh paths are relative to the
+// scene file's directory; first_material is where the scene's materials start in the
+// material table, as in build_world. n_triangles receives the number of triangles added;
+// geometry, if given, gets each mesh's placed vertices, indices and material.
+bool build_meshes(const std::string& scene_path, const scene_mesh* meshes, size_t n_meshes,
+	uint32_t first_material, hittable_list& world, size_t& n_triangles, hasher* geometry = nullptr)
+{
+	const size_t slash = scene_path.find_last_of("/\\");
+	const std::string directory = slash == std::string::npos ? std::string() : scene_path.substr(0, slash + 1);
+
+	n_triangles = 0;
+	for (size_t k = 0; k < n_meshes; ++k)
+	{
+		const scene_mesh& m = meshes[k];
+		const std::string name(m.path, strnlen(m.path, sizeof(m.path)));
+		const bool absolute = name.find_first_of("/\\") == 0 || (name.size() > 1 && name[1] == ':');
+		const std::string path = absolute || directory.empty() ? name : directory + name;
+
+		const auto sta = std::chrono::steady_clock::now();
+		mesh_data data;
+		if (!load_mesh(path, data))
+			return false;
+
+		const vec3_t<float> offset(m.offset);
+		const float scale = static_cast<float>(m.scale);
+		for (vec3_t<float>& v : data.vertices)
+			v = scale * v + offset;
+
+		if (geometry)
+		{
+			geometry->add(data.vertices.data(), data.vertices.size() * sizeof(vec3_t<float>));
+			geometry->add(data.indices.data(), data.indices.size() * sizeof(uint32_t));
+			geometry->add(m.material);
+		}
+
+		const auto build_sta = std::chrono::steady_clock::now();
+		shared_ptr<triangle_mesh> mesh = make_shared<triangle_mesh>(std::move(data), first_material + m.material);
+		const auto end = std::chrono::steady_clock::now();
+
+		std::cerr << "mesh " << path << ": " << mesh->size() << " triangles, " << mesh->vertex_count() << " vertices, loaded in "
+			<< std::chrono::duration<double>(build_sta - sta).count() << " s, BVH in "
+			<< std::chrono::duration<double>(end - build_sta).count() << " s\n";
+
+		if (mesh->size() == 0)
+			continue;
+		n_triangles += mesh->size();
+		world.add(mesh);
+	}
+
+	return true;
+}
+
+#endif
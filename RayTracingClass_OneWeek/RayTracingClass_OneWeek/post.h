@@ -0,0 +1,538 @@
+#pragma once
+
+#define POST_H
+#ifdef POST_H
+
+#include "rtweekend.h"
+
+#include "film.h"
+#include "PPM.h"
+#include "simd.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Post-processing on a linear float framebuffer: exposure and tone mapping, grayscale,
+// flips and filtered resampling, and last gamma 2 and quantization into a PPM. Every stage
+// hands bands of rows to the tile_scheduler, and every per-pixel kernel has an AVX2 version
+// doing the scalar kernel's arithmetic in the same order, so every instruction set gives the
+// same image.
+
+#define POST_BAND 16			// rows per scheduler job
+#define LANCZOS_RADIUS 3
+
+enum class tonemap_curve
+{
+	none,		// clip at 1
+	reinhard,	// x / (1 + x)
+	aces		// Narkowicz's fit of the ACES filmic curve
+};
+
+enum class resample_filter
+{
+	box,
+	bilinear,
+	lanczos
+};
+
+inline const char* tonemap_curve_name(tonemap_curve curve)
+{
+	switch (curve)
+	{
+	case tonemap_curve::reinhard: return "reinhard";
+	case tonemap_curve::aces: return "aces";
+	default: return "none";
+	}
+}
+
+inline bool parse_tonemap_curve(const std::string& name, tonemap_curve& curve)
+{
+	for (tonemap_curve c : { tonemap_curve::none, tonemap_curve::reinhard, tonemap_curve::aces })
+	{
+		if (name == tonemap_curve_name(c))
+		{
+			curve = c;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline const char* resample_filter_name(resample_filter filter)
+{
+	switch (filter)
+	{
+	case resample_filter::box: return "box";
+	case resample_filter::bilinear: return "bilinear";
+	default: return "lanczos";
+	}
+}
+
+inline bool parse_resample_filter(const std::string& name, resample_filter& filter)
+{
+	for (resample_filter f : { resample_filter::box, resample_filter::bilinear, resample_filter::lanczos })
+	{
+		if (name == resample_filter_name(f))
+		{
+			filter = f;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Linear HDR image, one float plane per channel, row by row from the bottom like the film.
+class hdr_image
+{
+public:
+	hdr_image(int width = 0, int height = 0) : w(width), h(height)
+	{
+		for (std::vector<float>& p : planes)
+			p.assign(size_t(width) * height, 0);
+	}
+
+	// The film's pixel means.
+	explicit hdr_image(const film& f) : hdr_image(f.width(), f.height())
+	{
+		const std::vector<film::pixel>& pixels = f.data();
+		for (size_t k = 0; k < pixels.size(); ++k)
+			for (int c = 0; c < 3; ++c)
+				planes[c][k] = pixels[k].mean[c];
+	}
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	float* row(int c, int y) { return planes[c].data() + size_t(y) * w; }
+	const float* row(int c, int y) const { return planes[c].data() + size_t(y) * w; }
+
+	void set(int i, int j, const float rgb[3])
+	{
+		for (int c = 0; c < 3; ++c)
+			planes[c][size_t(j) * w + i] = rgb[c];
+	}
+
+private:
+	int w;
+	int h;
+	std::vector<float> planes[3];
+};
+
+// Where each output pixel of a resampling pass reads: taps source indices and weights per
+// output pixel, stored tap by tap (entry t * n_out + x), so a kernel can load the t-th tap
+// of eight neighbouring outputs at once. Sources outside the image are clamped to the edge.
+struct resample_table
+{
+	int taps = 0;
+	int n_out = 0;
+	std::vector<int> index;
+	std::vector<float> weight;
+};
+
+inline double resample_weight(resample_filter filter, double x)
+{
+	switch (filter)
+	{
+	case resample_filter::box:
+		return x >= -0.5 && x < 0.5 ? 1 : 0;
+	case resample_filter::bilinear:
+		return std::max(0.0, 1 - std::fabs(x));
+	default:
+		if (x == 0)
+			return 1;
+		if (std::fabs(x) >= LANCZOS_RADIUS)
+			return 0;
+		return LANCZOS_RADIUS * std::sin(pi * x) * std::sin(pi * x / LANCZOS_RADIUS) / (pi * pi * x * x);
+	}
+}
+
+inline resample_table make_resample_table(int n_in, int n_out, resample_filter filter)
+{
+	// Shrinking stretches the filter over the source pixels one output pixel covers.
+	const double scale = double(n_in) / n_out;
+	const double stretch = std::max(1.0, scale);
+	const double radius = stretch * (filter == resample_filter::box ? 0.5 : filter == resample_filter::bilinear ? 1.0 : LANCZOS_RADIUS);
+
+	resample_table table;
+	table.taps = static_cast<int>(std::floor(2 * radius)) + 1;
+	table.n_out = n_out;
+	table.index.assign(size_t(table.taps) * n_out, 0);
+	table.weight.assign(size_t(table.taps) * n_out, 0);
+
+	std::vector<double> w(table.taps);
+	for (int x = 0; x < n_out; ++x)
+	{
+		const double center = (x + 0.5) * scale - 0.5;
+		const int first = static_cast<int>(std::ceil(center - radius));
+
+		double sum = 0;
+		for (int t = 0; t < table.taps; ++t)
+		{
+			w[t] = resample_weight(filter, (first + t - center) / stretch);
+			sum += w[t];
+		}
+
+		for (int t = 0; t < table.taps; ++t)
+		{
+			const size_t k = size_t(t) * n_out + x;
+			table.index[k] = std::min(std::max(first + t, 0), n_in - 1);
+			table.weight[k] = static_cast<float>(sum != 0 ? w[t] / sum : 0);
+		}
+
+		// A box narrower than the pixel spacing can miss every source: take the nearest.
+		if (sum == 0)
+		{
+			const int nearest = std::min(std::max(static_cast<int>(std::floor(center + 0.5)), 0), n_in - 1);
+			table.index[x] = nearest;
+			table.weight[x] = 1;
+		}
+	}
+	return table;
+}
+
+// Per-row kernels over pixels [begin, end). c points at the row of each channel.
+
+inline void post_tonemap_scalar(float* const c[3], int begin, int end, float scale, tonemap_curve curve)
+{
+	for (int ch = 0; ch < 3; ++ch)
+	{
+		for (int k = begin; k < end; ++k)
+		{
+			float x = c[ch][k] * scale;
+			if (curve == tonemap_curve::reinhard)
+				x = x / (1.0f + x);
+			else if (curve == tonemap_curve::aces)
+				x = std::min(std::max((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f), 1.0f);
+			c[ch][k] = x;
+		}
+	}
+}
+
+inline void post_gray_scalar(float* const c[3], int begin, int end)
+{
+	for (int k = begin; k < end; ++k)
+	{
+		const float l = 0.2126f * c[0][k] + 0.7152f * c[1][k] + 0.0722f * c[2][k];
+		c[0][k] = l;
+		c[1][k] = l;
+		c[2][k] = l;
+	}
+}
+
+// Gamma 2 without sqrt of the value: floor(256 sqrt(x)) = floor(sqrt(floor(65536 x))), and
+// the integer square root of a number below 2^16 is exact in float. So this gives exactly
+// the bytes write_color computes in double, clamp at 0.999 included, for any float x.
+inline unsigned char post_gamma_byte(float x)
+{
+	float y = x * 65536.0f;
+	y = y > 0 ? y : 0;			// and NaN to 0
+	y = y < 65535.0f ? y : 65535.0f;
+	return static_cast<unsigned char>(static_cast<int>(std::sqrt(std::floor(y))));
+}
+
+inline void post_quantize_scalar(const float* const c[3], int begin, int end, PPM::RGB* out)
+{
+	for (int k = begin; k < end; ++k)
+	{
+		out[k].r = post_gamma_byte(c[0][k]);
+		out[k].g = post_gamma_byte(c[1][k]);
+		out[k].b = post_gamma_byte(c[2][k]);
+	}
+}
+
+inline void post_reverse_scalar(float* p, int n)
+{
+	std::reverse(p, p + n);
+}
+
+// Vertical pass: out[x] = sum over t of weight[t] * rows[t][x].
+inline void post_resample_rows_scalar(const float* const* rows, const float* weight, int taps, int begin, int end, float* out)
+{
+	for (int x = begin; x < end; ++x)
+	{
+		float sum = 0;
+		for (int t = 0; t < taps; ++t)
+			sum += weight[t] * rows[t][x];
+		out[x] = sum;
+	}
+}
+
+// Horizontal pass over one row through a resample_table.
+inline void post_resample_row_scalar(const float* in, const resample_table& table, int begin, int end, float* out)
+{
+	for (int x = begin; x < end; ++x)
+	{
+		float sum = 0;
+		for (int t = 0; t < table.taps; ++t)
+		{
+			const size_t k = size_t(t) * table.n_out + x;
+			sum += table.weight[k] * in[table.index[k]];
+		}
+		out[x] = sum;
+	}
+}
+
+#if RT_X86
+
+RT_TARGET_AVX2 inline void post_tonemap_avx2(float* const c[3], int begin, int end, float scale, tonemap_curve curve)
+{
+	const __m256 s = _mm256_set1_ps(scale);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+
+	int k = begin;
+	for (; k + 8 <= end; k += 8)
+	{
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			__m256 x = _mm256_mul_ps(_mm256_loadu_ps(c[ch] + k), s);
+			if (curve == tonemap_curve::reinhard)
+			{
+				x = _mm256_div_ps(x, _mm256_add_ps(one, x));
+			}
+			else if (curve == tonemap_curve::aces)
+			{
+				const __m256 num = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x), _mm256_set1_ps(0.03f)));
+				const __m256 den = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+				x = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(num, den), zero), one);
+			}
+			_mm256_storeu_ps(c[ch] + k, x);
+		}
+	}
+
+	post_tonemap_scalar(c, k, end, scale, curve);
+}
+
+RT_TARGET_AVX2 inline void post_gray_avx2(float* const c[3], int begin, int end)
+{
+	int k = begin;
+	for (; k + 8 <= end; k += 8)
+	{
+		const __m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), _mm256_loadu_ps(c[0] + k)),
+			_mm256_mul_ps(_mm256_set1_ps(0.7152f), _mm256_loadu_ps(c[1] + k))), _mm256_mul_ps(_mm256_set1_ps(0.0722f), _mm256_loadu_ps(c[2] + k)));
+		for (int ch = 0; ch < 3; ++ch)
+			_mm256_storeu_ps(c[ch] + k, l);
+	}
+
+	post_gray_scalar(c, k, end);
+}
+
+RT_TARGET_AVX2 inline __m256i post_gamma_avx2(__m256 x)
+{
+	// max_ps returns its second operand for NaN, like the scalar y > 0 ? y : 0.
+	__m256 y = _mm256_max_ps(_mm256_mul_ps(x, _mm256_set1_ps(65536.0f)), _mm256_setzero_ps());
+	y = _mm256_min_ps(y, _mm256_set1_ps(65535.0f));
+	return _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_floor_ps(y)));
+}
+
+RT_TARGET_AVX2 inline void post_quantize_avx2(const float* const c[3], int begin, int end, PPM::RGB* out)
+{
+	alignas(32) int32_t bytes[3][8];
+
+	int k = begin;
+	for (; k + 8 <= end; k += 8)
+	{
+		for (int ch = 0; ch < 3; ++ch)
+			_mm256_store_si256(reinterpret_cast<__m256i*>(bytes[ch]), post_gamma_avx2(_mm256_loadu_ps(c[ch] + k)));
+
+		for (int l = 0; l < 8; ++l)
+		{
+			out[k + l].r = static_cast<unsigned char>(bytes[0][l]);
+			out[k + l].g = static_cast<unsigned char>(bytes[1][l]);
+			out[k + l].b = static_cast<unsigned char>(bytes[2][l]);
+		}
+	}
+
+	post_quantize_scalar(c, k, end, out);
+}
+
+// Swaps reversed blocks of eight from both ends towards the middle.
+RT_TARGET_AVX2 inline void post_reverse_avx2(float* p, int n)
+{
+	const __m256i reversed = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	int lo = 0, hi = n;
+	for (; hi - lo >= 16; lo += 8, hi -= 8)
+	{
+		const __m256 a = _mm256_loadu_ps(p + lo);
+		const __m256 b = _mm256_loadu_ps(p + hi - 8);
+		_mm256_storeu_ps(p + lo, _mm256_permutevar8x32_ps(b, reversed));
+		_mm256_storeu_ps(p + hi - 8, _mm256_permutevar8x32_ps(a, reversed));
+	}
+
+	std::reverse(p + lo, p + hi);
+}
+
+RT_TARGET_AVX2 inline void post_resample_rows_avx2(const float* const* rows, const float* weight, int taps, int begin, int end, float* out)
+{
+	int x = begin;
+	for (; x + 8 <= end; x += 8)
+	{
+		__m256 sum = _mm256_setzero_ps();
+		for (int t = 0; t < taps; ++t)
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weight[t]), _mm256_loadu_ps(rows[t] + x)));
+		_mm256_storeu_ps(out + x, sum);
+	}
+
+	post_resample_rows_scalar(rows, weight, taps, x, end, out);
+}
+
+// Eight outputs at a time, each tap gathered from the eight source positions.
+RT_TARGET_AVX2 inline void post_resample_row_avx2(const float* in, const resample_table& table, int begin, int end, float* out)
+{
+	int x = begin;
+	for (; x + 8 <= end; x += 8)
+	{
+		__m256 sum = _mm256_setzero_ps();
+		for (int t = 0; t < table.taps; ++t)
+		{
+			const size_t k = size_t(t) * table.n_out + x;
+			const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table.index.data() + k));
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(table.weight.data() + k), _mm256_i32gather_ps(in, index, 4)));
+		}
+		_mm256_storeu_ps(out + x, sum);
+	}
+
+	post_resample_row_scalar(in, table, x, end, out);
+}
+
+#endif
+
+struct post_kernels
+{
+	void (*tonemap)(float* const c[3], int begin, int end, float scale, tonemap_curve curve);
+	void (*gray)(float* const c[3], int begin, int end);
+	void (*quantize)(const float* const c[3], int begin, int end, PPM::RGB* out);
+	void (*reverse)(float* p, int n);
+	void (*resample_rows)(const float* const* rows, const float* weight, int taps, int begin, int end, float* out);
+	void (*resample_row)(const float* in, const resample_table& table, int begin, int end, float* out);
+};
+
+inline post_kernels select_post_kernels(simd_level level)
+{
+#if RT_X86
+	if (level >= simd_level::avx2)
+		return { post_tonemap_avx2, post_gray_avx2, post_quantize_avx2, post_reverse_avx2, post_resample_rows_avx2, post_resample_row_avx2 };
+#else
+	(void)level;
+#endif
+	return { post_tonemap_scalar, post_gray_scalar, post_quantize_scalar, post_reverse_scalar, post_resample_rows_scalar, post_resample_row_scalar };
+}
+
+class post_processor
+{
+public:
+	explicit post_processor(simd_level level = detect_simd_level()) : kernels(select_post_kernels(level)) {}
+
+	// Scales by 2^stops and applies the curve. The result stays linear; write() applies the gamma.
+	void tonemap(hdr_image& image, float stops, tonemap_curve curve, tile_scheduler& scheduler) const;
+
+	// Rec. 709 luminance, the weights film::luminance uses, in every channel.
+	void gray_scale(hdr_image& image, tile_scheduler& scheduler) const;
+
+	void horizontal_flip(hdr_image& image, tile_scheduler& scheduler) const;
+	void vertical_flip(hdr_image& image, tile_scheduler& scheduler) const;
+
+	// Separable resampling to width x height: a horizontal pass, then a vertical one.
+	hdr_image resample(const hdr_image& image, int width, int height, resample_filter filter, tile_scheduler& scheduler) const;
+
+	// Gamma 2 and quantization into ppm, which must have the image's size. Gives the same
+	// bytes as write_color for every pixel, as film::write does.
+	void write(const hdr_image& image, PPM& ppm, tile_scheduler& scheduler) const;
+
+private:
+	post_kernels kernels;
+
+	// Calls fn(y) for rows [0, height), a band of POST_BAND rows per scheduler job.
+	template <typename RowFn>
+	static void for_rows(int height, tile_scheduler& scheduler, RowFn fn)
+	{
+		std::vector<tile> bands;
+		for (int y = 0; y < height; y += POST_BAND)
+			bands.push_back({ 0, y, 1, std::min(y + POST_BAND, height) });
+
+		scheduler.run(bands, [&](const tile& band, unsigned) {
+			for (int y = band.y0; y < band.y1; ++y)
+				fn(y);
+		});
+	}
+};
+
+void post_processor::tonemap(hdr_image& image, float stops, tonemap_curve curve, tile_scheduler& scheduler) const
+{
+	if (stops == 0 && curve == tonemap_curve::none)
+		return;
+
+	const float scale = std::exp2(stops);
+	for_rows(image.height(), scheduler, [&](int y) {
+		float* const c[3] = { image.row(0, y), image.row(1, y), image.row(2, y) };
+		kernels.tonemap(c, 0, image.width(), scale, curve);
+	});
+}
+
+void post_processor::gray_scale(hdr_image& image, tile_scheduler& scheduler) const
+{
+	for_rows(image.height(), scheduler, [&](int y) {
+		float* const c[3] = { image.row(0, y), image.row(1, y), image.row(2, y) };
+		kernels.gray(c, 0, image.width());
+	});
+}
+
+void post_processor::horizontal_flip(hdr_image& image, tile_scheduler& scheduler) const
+{
+	for_rows(image.height(), scheduler, [&](int y) {
+		for (int c = 0; c < 3; ++c)
+			kernels.reverse(image.row(c, y), image.width());
+	});
+}
+
+void post_processor::vertical_flip(hdr_image& image, tile_scheduler& scheduler) const
+{
+	const int h = image.height();
+	for_rows(h / 2, scheduler, [&](int y) {
+		for (int c = 0; c < 3; ++c)
+			std::swap_ranges(image.row(c, y), image.row(c, y) + image.width(), image.row(c, h - 1 - y));
+	});
+}
+
+hdr_image post_processor::resample(const hdr_image& image, int width, int height, resample_filter filter, tile_scheduler& scheduler) const
+{
+	const resample_table columns = make_resample_table(image.width(), width, filter);
+	const resample_table rows = make_resample_table(image.height(), height, filter);
+
+	hdr_image wide(width, image.height());
+	for_rows(image.height(), scheduler, [&](int y) {
+		for (int c = 0; c < 3; ++c)
+			kernels.resample_row(image.row(c, y), columns, 0, width, wide.row(c, y));
+	});
+
+	hdr_image result(width, height);
+	for_rows(height, scheduler, [&](int y) {
+		std::vector<const float*> taps(rows.taps);
+		std::vector<float> weight(rows.taps);
+		for (int t = 0; t < rows.taps; ++t)
+			weight[t] = rows.weight[size_t(t) * height + y];
+
+		for (int c = 0; c < 3; ++c)
+		{
+			for (int t = 0; t < rows.taps; ++t)
+				taps[t] = wide.row(c, rows.index[size_t(t) * height + y]);
+			kernels.resample_rows(taps.data(), weight.data(), rows.taps, 0, width, result.row(c, y));
+		}
+	});
+	return result;
+}
+
+void post_processor::write(const hdr_image& image, PPM& ppm, tile_scheduler& scheduler) const
+{
+	for_rows(image.height(), scheduler, [&](int y) {
+		const float* const c[3] = { image.row(0, y), image.row(1, y), image.row(2, y) };
+		kernels.quantize(c, 0, image.width(), ppm.image[y]);
+	});
+}
+
+#endif
@@ -0,0 +1,144 @@
+#pragma once
+
+#define PREVIEW_H
+#ifdef PREVIEW_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "film.h"
+#include "PPM.h"
+#include "tile_scheduler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Progressive preview frames. Finished tiles are copied into a frame of their own, so
+// the film is only read where no worker is writing, and the frame is written out whole
+// at a fixed cadence: to a file, through a temporary file renamed over it so a viewer
+// never sees half a frame, or as a stream of binary PPM frames on stdout for path "-".
+class preview
+{
+public:
+	preview(const std::string& path, int width, int height, double seconds)
+		: path(path), frame(height, width), cadence(seconds), last(std::chrono::steady_clock::now())
+	{
+#ifdef _WIN32
+		if (path == "-")
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+
+	preview(const preview&) = delete;
+	preview& operator=(const preview&) = delete;
+
+	int frames() const { return n_frames; }
+
+	// Copies tile t of f into the frame. A pixel without samples yet shows the pixel at the
+	// corner of its block x block block, counted from the tile's corner like the levels are.
+	void update(const film& f, const tile& t, int block)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		copy(f, t, block);
+	}
+
+	// update, then write the frame if the cadence has passed since the last one.
+	void tile_done(const film& f, const tile& t, int block)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		copy(f, t, block);
+		if (std::chrono::steady_clock::now() - last >= std::chrono::duration<double>(cadence))
+			write();
+	}
+
+	// Writes the frame now, e.g. at the end of a level or pass.
+	bool flush()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return write();
+	}
+
+private:
+	std::string path;
+	PPM frame;
+	double cadence;
+	std::chrono::steady_clock::time_point last;
+	int n_frames = 0;
+	std::mutex mtx;
+
+	void copy(const film& f, const tile& t, int block)
+	{
+		for (int j = t.y0; j < t.y1; ++j)
+		{
+			for (int i = t.x0; i < t.x1; ++i)
+			{
+				int si = i, sj = j;
+				if (f.samples(i, j) == 0)
+				{
+					si = t.x0 + (i - t.x0) / block * block;
+					sj = t.y0 + (j - t.y0) / block * block;
+					if (f.samples(si, sj) == 0)
+						continue;
+				}
+				write_color(frame, j, i, f.mean(si, sj), 1);
+			}
+		}
+	}
+
+	// Binary PPM, top row first.
+	bool write_ppm(std::FILE* out) const
+	{
+		const int w = frame.get_width(), h = frame.get_height();
+		std::fprintf(out, "P6\n%d %d\n255\n", w, h);
+		for (int j = h - 1; j >= 0; --j)
+			std::fwrite(frame.image[j], sizeof(PPM::RGB), w, out);
+		return std::fflush(out) == 0 && !std::ferror(out);
+	}
+
+	bool write()
+	{
+		last = std::chrono::steady_clock::now();
+		n_frames++;
+
+		if (path == "-")
+			return write_ppm(stdout);
+
+		const std::string temp_path = path + ".tmp";
+		std::FILE* out = std::fopen(temp_path.c_str(), "wb");
+		if (out == nullptr)
+		{
+			std::cerr << "Cannot write preview " << temp_path << '\n';
+			return false;
+		}
+		const bool ok = write_ppm(out);
+		std::fclose(out);
+		if (!ok)
+		{
+			std::cerr << "Cannot write preview " << temp_path << '\n';
+			return false;
+		}
+
+		// rename replaces the old frame in one step on POSIX; Windows needs it removed first.
+		if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+		{
+			std::remove(path.c_str());
+			if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+			{
+				std::cerr << "Cannot rename " << temp_path << " to " << path << '\n';
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,225 @@
+#pragma once
+
+#define PROFILE_H
+#ifdef PROFILE_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "instrument.h"
+#include "integrator.h"
+#include "material.h"
+#include "PPM.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define PROFILE_TOP_MATERIALS 16	// materials listed in the report, most scatter events first
+#define PROFILE_HEAT_PERCENTILE 0.99	// pixel cost drawn white in the heatmap; above it everything clips
+
+inline const char* material_type_name(material_type type)
+{
+	switch (type)
+	{
+	case material_type::metal:
+		return "metal";
+	case material_type::dielectric:
+		return "dielectric";
+	case material_type::diffuse_light:
+		return "diffuse_light";
+	default:
+		return "lambertian";
+	}
+}
+
+// Wall time of a render: per tile, per worker and per pixel.
+// Tiles of one pass never overlap, so workers add pixel times without a lock.
+class render_profile
+{
+public:
+	render_profile(int width, int height, unsigned n_workers)
+		: w(width), h(height), busy(n_workers, 0), worker_tiles(n_workers, 0), pixel_seconds(size_t(width) * height, 0) {}
+
+	void add_tile(const tile& t, int pass, unsigned worker, double seconds)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		tiles.push_back({ t, pass, worker, seconds });
+		busy[worker] += seconds;
+		worker_tiles[worker]++;
+	}
+
+	void add_pixel(int i, int j, double seconds) { pixel_seconds[size_t(j) * w + i] += seconds; }
+
+	// For integrators that cannot time single pixels: the tile's time, split evenly over its pixels.
+	void spread_tile(const tile& t, double seconds)
+	{
+		const double share = seconds / (double(t.x1 - t.x0) * (t.y1 - t.y0));
+		for (int j = t.y0; j < t.y1; ++j)
+			for (int i = t.x0; i < t.x1; ++i)
+				add_pixel(i, j, share);
+	}
+
+	bool write_json(const std::string& path, const path_stats& stats, const instrument_counters& counters,
+		const material_table& materials, double render_seconds) const;
+
+	// Black (cheapest) through red and yellow to white (PROFILE_HEAT_PERCENTILE of the pixel costs).
+	void write_heatmap(PPM& ppm) const
+	{
+		std::vector<double> sorted(pixel_seconds);
+		const size_t k = static_cast<size_t>(PROFILE_HEAT_PERCENTILE * (sorted.size() - 1));
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		const double top = sorted[k] > 0 ? sorted[k] : 1;
+
+		for (int j = 0; j < h; ++j)
+			for (int i = 0; i < w; ++i)
+				write_color(ppm, j, i, heat_color(pixel_seconds[size_t(j) * w + i] / top), 1);
+	}
+
+private:
+	struct tile_time
+	{
+		tile t;
+		int pass;
+		unsigned worker;
+		double seconds;
+	};
+
+	int w;
+	int h;
+	std::vector<double> busy;
+	std::vector<uint64_t> worker_tiles;
+	std::vector<double> pixel_seconds;
+	std::vector<tile_time> tiles;
+	std::mutex mtx;
+};
+
+bool render_profile::write_json(const std::string& path, const path_stats& stats, const instrument_counters& counters,
+	const material_table& materials, double render_seconds) const
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+	{
+		std::cerr << "Cannot write profile " << path << '\n';
+		return false;
+	}
+
+	// Rays: every depth_rays entry past the first is a secondary ray.
+	uint64_t total_rays = 0;
+	for (uint64_t n : stats.depth_rays)
+		total_rays += n;
+	const uint64_t primary = stats.depth_rays.empty() ? 0 : stats.depth_rays[0];
+
+	size_t depths = stats.depth_rays.size();
+	while (depths > 0 && stats.depth_rays[depths - 1] == 0)
+		depths--;
+
+	out << "{\n"
+		<< "  \"image\": { \"width\": " << w << ", \"height\": " << h << " },\n"
+		<< "  \"render_seconds\": " << render_seconds << ",\n"
+		<< "  \"rays\": { \"total\": " << total_rays << ", \"primary\": " << primary
+		<< ", \"secondary\": " << total_rays - primary << ", \"roulette_kills\": " << stats.roulette_kills
+		<< ", \"shadow\": " << stats.shadow_rays << ",\n"
+		<< "    \"per_depth\": [";
+	for (size_t d = 0; d < depths; ++d)
+		out << (d ? ", " : "") << stats.depth_rays[d];
+	out << "] },\n";
+
+	// path_length[n]: paths that ended after tracing n rays; the last bucket also holds longer ones.
+	int lengths = INSTRUMENT_MAX_PATH + 1;
+	while (lengths > 0 && counters.path_length[lengths - 1] == 0)
+		lengths--;
+	out << "  \"path_length\": [";
+	for (int n = 0; n < lengths; ++n)
+		out << (n ? ", " : "") << counters.path_length[n];
+	out << "],\n";
+
+	out << "  \"intersections\": {";
+	bool first = true;
+	for (int p = 0; p < n_counted_prims; ++p)
+	{
+		if (counters.tests[p] == 0)
+			continue;
+		out << (first ? "\n" : ",\n") << "    \"" << counted_prim_name(p) << "\": { \"tests\": " << counters.tests[p]
+			<< ", \"hits\": " << counters.hits[p] << " }";
+		first = false;
+	}
+	out << "\n  },\n";
+
+	out << "  \"scatter\": {";
+	for (int m = 0; m < n_counted_materials; ++m)
+	{
+		out << (m ? ",\n" : "\n") << "    \"" << material_type_name(static_cast<material_type>(m)) << "\": { \"scattered\": "
+			<< counters.scattered[m] << ", \"absorbed\": " << counters.absorbed[m] << " }";
+	}
+	out << "\n  },\n";
+
+	// Which materials (material 0 is the ground in the built-in scene) take the most bounces.
+	uint64_t total_scatters = 0;
+	std::vector<uint32_t> order;
+	for (size_t k = 0; k < counters.material_scatters.size(); ++k)
+	{
+		total_scatters += counters.material_scatters[k];
+		if (counters.material_scatters[k] > 0)
+			order.push_back(static_cast<uint32_t>(k));
+	}
+	const size_t top = std::min<size_t>(order.size(), PROFILE_TOP_MATERIALS);
+	std::partial_sort(order.begin(), order.begin() + top, order.end(), [&](uint32_t a, uint32_t b) {
+		return counters.material_scatters[a] > counters.material_scatters[b];
+	});
+
+	out << "  \"top_materials\": [";
+	for (size_t k = 0; k < top; ++k)
+	{
+		const uint32_t m = order[k];
+		out << (k ? ",\n" : "\n") << "    { \"material\": " << m << ", \"type\": \""
+			<< (m < materials.size() ? material_type_name(materials[m].type) : "unknown")
+			<< "\", \"scatters\": " << counters.material_scatters[m]
+			<< ", \"share\": " << double(counters.material_scatters[m]) / total_scatters << " }";
+	}
+	out << "\n  ],\n";
+
+	// Load balance: imbalance is the busiest worker's time over the mean, 1 is perfect.
+	double busy_sum = 0, busy_max = 0;
+	for (double b : busy)
+	{
+		busy_sum += b;
+		busy_max = std::max(busy_max, b);
+	}
+	const double busy_mean = busy.empty() ? 0 : busy_sum / busy.size();
+
+	out << "  \"threads\": [";
+	for (size_t k = 0; k < busy.size(); ++k)
+	{
+		out << (k ? ",\n" : "\n") << "    { \"worker\": " << k << ", \"busy_seconds\": " << busy[k]
+			<< ", \"tiles\": " << worker_tiles[k] << " }";
+	}
+	out << "\n  ],\n"
+		<< "  \"load_balance\": { \"mean_busy_seconds\": " << busy_mean << ", \"max_busy_seconds\": " << busy_max
+		<< ", \"imbalance\": " << (busy_mean > 0 ? busy_max / busy_mean : 1) << " },\n";
+
+	out << "  \"tiles\": [";
+	for (size_t k = 0; k < tiles.size(); ++k)
+	{
+		const tile_time& t = tiles[k];
+		out << (k ? ",\n" : "\n") << "    { \"x0\": " << t.t.x0 << ", \"y0\": " << t.t.y0 << ", \"x1\": " << t.t.x1
+			<< ", \"y1\": " << t.t.y1 << ", \"pass\": " << t.pass << ", \"worker\": " << t.worker
+			<< ", \"seconds\": " << t.seconds << " }";
+	}
+	out << "\n  ]\n}\n";
+
+	if (!out)
+	{
+		std::cerr << "Cannot write profile " << path << '\n';
+		return false;
+	}
+
+	return true;
+}
+
+#endif
@@ -5,25 +5,28 @@
 
 #include "vec3.h"
 
-class ray
+template <typename T>
+class ray_t
 {
 public:
-	ray() {}
-	ray(const point3& origin, const vec3& direction)
+	ray_t() {}
+	ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction)
 		: orig(origin), dir(direction)
 	{}
 
-	point3 origin() const { return orig; }
-	vec3 direction() const { return dir; }
+	vec3_t<T> origin() const { return orig; }
+	vec3_t<T> direction() const { return dir; }
 
-	point3 at(double t) const
+	vec3_t<T> at(T t) const
 	{
 		return orig + t * dir;
 	}
 
 private:
-	point3 orig;
-	vec3 dir;
+	vec3_t<T> orig;
+	vec3_t<T> dir;
 };
 
-#endif
\ No newline at end of file
+using ray = ray_t<real>;
+
+#endif
@@ -7,7 +7,8 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+
+#include "sampler.h"
 
 // Usings
 
@@ -15,6 +16,19 @@ using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// Precision of the whole renderer: vectors, rays, hit records, the camera and the hittable interface.
+// Build with RT_USE_FLOAT=1 for the single-precision fast path.
+
+#ifndef RT_USE_FLOAT
+#define RT_USE_FLOAT 0
+#endif
+
+#if RT_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -27,25 +41,25 @@ inline double degrees_to_radians(double degrees)
 	return degrees * pi / 180.0;
 }
 
+inline sampler& default_sampler()
+{
+	// Per-thread generator for scene setup. Rendering code is handed its own sampler instead.
+	thread_local sampler s(0, false);
+	return s;
+}
+
 inline double random_double()
 {
 	// Returns a random real in [0, 1).
-	return rand() / (RAND_MAX + 1.0);
+	return default_sampler().get_1d();
 }
 
 inline double random_double(double min, double max)
 {
 	// Returns a random real in [min, max).
-	return min + (max - min) * random_double();
+	return default_sampler().get_1d(min, max);
 }
 
-//inline double random_double()
-//{
-//	static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-//	static std::mt19937 generator;
-//	return distribution(generator);
-//}
-
 inline double clamp(double x, double min, double max)
 {
 	if (x < min) return min;
@@ -0,0 +1,395 @@
+#pragma once
+
+#define SAMPLER_H
+#ifdef SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+
+// PCG32 generator (M.E. O'Neill, pcg-random.org): 64-bit LCG state, 32-bit permuted output.
+class pcg32
+{
+public:
+	pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+	pcg32(uint64_t init_state, uint64_t stream) { seed(init_state, stream); }
+
+	void seed(uint64_t init_state, uint64_t stream)
+	{
+		state = 0;
+		inc = (stream << 1) | 1;
+		next_uint();
+		state += init_state;
+		next_uint();
+	}
+
+	uint32_t next_uint()
+	{
+		uint64_t old_state = state;
+		state = old_state * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+		uint32_t rot = static_cast<uint32_t>(old_state >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+
+	double next_double()
+	{
+		// Returns a random real in [0, 1).
+		return next_uint() * (1.0 / 4294967296.0);
+	}
+
+	uint64_t state;
+	uint64_t inc;
+};
+
+// SplitMix64 finalizer, used to turn (seed, pixel, sample, bounce) counters into well-mixed PCG seeds.
+inline uint64_t mix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// 32-bit integer hash (C. Wellons' lowbias32), for the per-dimension scramble seeds.
+inline uint32_t mix32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	return x ^ (x >> 16);
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Owen scrambling of the bits of x, most significant first (Burley, "Practical Hash-based
+// Owen Scrambling", 2020): a Laine-Karras hash on the reversed bits only lets lower bits
+// depend on higher ones.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// Element i of a pseudo-random permutation of [0, l) chosen by p (Kensler, "Correlated
+// Multi-Jittered Sampling", 2013).
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+
+	do
+	{
+		i ^= p; i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8; i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1; i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11; i *= 0x74dcb303u;
+		i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+
+	return (i + p) % l;
+}
+
+// First two dimensions of the Sobol sequence: van der Corput, and the dimension
+// with primitive polynomial x + 1, whose direction numbers are v_k = v_{k-1} ^ (v_{k-1} >> 1).
+inline uint32_t sobol_0(uint32_t index)
+{
+	return reverse_bits(index);
+}
+
+struct sobol_1_table
+{
+	uint32_t xor_of[4][256];	// xor_of[b][x]: sum of the directions selected by byte b of the index being x
+
+	sobol_1_table()
+	{
+		uint32_t v[32];
+		v[0] = 1u << 31;
+		for (int k = 1; k < 32; ++k)
+			v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+
+		for (int b = 0; b < 4; ++b)
+			for (uint32_t x = 0; x < 256; ++x)
+			{
+				xor_of[b][x] = 0;
+				for (int k = 0; k < 8; ++k)
+					if (x & (1u << k))
+						xor_of[b][x] ^= v[8 * b + k];
+			}
+	}
+};
+
+inline uint32_t sobol_1(uint32_t index)
+{
+	static const sobol_1_table table;
+	return table.xor_of[0][index & 0xff] ^ table.xor_of[1][(index >> 8) & 0xff]
+		^ table.xor_of[2][(index >> 16) & 0xff] ^ table.xor_of[3][index >> 24];
+}
+
+// Radical inverse of index in the given base with Owen scrambling: every digit goes through
+// a permutation chosen by the digits below it, so the points stay stratified but the
+// large bases no longer line up in the diagonal bands plain Halton has at low sample counts.
+inline double owen_radical_inverse(uint32_t base, uint64_t index, uint32_t seed)
+{
+	const double inv_base = 1.0 / base;
+	double inv = inv_base, result = 0;
+	uint64_t prefix = seed;
+	while (index > 0)
+	{
+		const uint32_t digit = static_cast<uint32_t>(index % base);
+		result += permute(digit, base, static_cast<uint32_t>(mix64(prefix))) * inv;
+		prefix = prefix * base + digit + 1;
+		index /= base;
+		inv *= inv_base;
+	}
+
+	// The remaining digits are all zero, each permuted at random: together a uniform
+	// value below the last digit written.
+	result += (mix64(prefix) >> 11) * (1.0 / 9007199254740992.0) * inv * base;
+	return result < 1 ? result : std::nextafter(1.0, 0.0);
+}
+
+enum class sample_pattern
+{
+	independent,	// white noise
+	stratified,		// jittered strata of the pixel's planned sample count, shuffled per dimension
+	sobol,			// Owen-scrambled Sobol (0,2)-sequence, one shuffled 2D set per dimension pair
+	halton			// Owen-scrambled Halton, scrambled per pixel
+};
+
+inline const char* sample_pattern_name(sample_pattern pattern)
+{
+	switch (pattern)
+	{
+	case sample_pattern::stratified: return "stratified";
+	case sample_pattern::sobol: return "sobol";
+	case sample_pattern::halton: return "halton";
+	default: return "independent";
+	}
+}
+
+struct sample2
+{
+	double x, y;
+};
+
+#define SAMPLER_CAMERA_DIMS 4	// pixel jitter (2D) and lens (2D)
+#define SAMPLER_BOUNCE_DIMS 7	// per bounce: scatter direction (up to 3D), Russian roulette (1D), light sample (3D)
+#define SAMPLER_ROULETTE_DIM 3	// Russian roulette's dimension within a bounce
+#define SAMPLER_LIGHT_DIM 4		// first of the light choice (1D) and the direction towards it (2D)
+#define SAMPLER_HALTON_DIMS 32	// higher Halton bases correlate badly; later dimensions are independent
+
+// Source of random numbers for one render thread. Every function that needs
+// randomness while tracing takes a sampler& instead of touching global state.
+//
+// Streaming mode: one PCG stream per thread, chosen with set_stream().
+// Counter-based mode: the generator is reseeded from (seed, pixel, sample, bounce)
+// at start_sample() and next_bounce(), so every sample draws the same numbers
+// regardless of which thread renders it or in what order.
+//
+// Every get_1d() and get_2d() takes the next dimension(s) of the sample. In counter-based
+// mode the pattern decides the values: the camera uses the first SAMPLER_CAMERA_DIMS
+// dimensions and every bounce starts at its own block of SAMPLER_BOUNCE_DIMS, so
+// the same decision reads the same dimension in every sample. Streaming mode is always
+// independent, since the patterns need to know which sample of which pixel is drawn.
+class sampler
+{
+public:
+	explicit sampler(uint64_t seed = 0, bool counter_based = true,
+		sample_pattern pattern = sample_pattern::independent, uint32_t sample_count = 0)
+		: seed(seed), counter_based(counter_based), pattern(counter_based ? pattern : sample_pattern::independent),
+		sample_count(sample_count)
+	{
+		gen.seed(mix64(seed), 0);
+	}
+
+	bool is_counter_based() const { return counter_based; }
+	sample_pattern get_pattern() const { return pattern; }
+
+	// Generator state, for checkpoints. Only matters in streaming mode.
+	const pcg32& generator() const { return gen; }
+	void set_generator(const pcg32& g) { gen = g; }
+
+	void set_stream(uint64_t stream)
+	{
+		gen.seed(mix64(seed), stream);
+	}
+
+	// A non-zero bounce resumes a path part-way, as the wavefront integrator does.
+	void start_sample(uint64_t pixel, uint64_t sample, uint64_t bounce = 0)
+	{
+		if (!counter_based)
+			return;
+
+		if (pixel != pixel_index || !pixel_seeded)
+		{
+			pixel_seed = static_cast<uint32_t>(mix64(seed ^ mix64(pixel)));
+			pixel_seeded = true;
+		}
+		pixel_index = pixel;
+		sample_index = sample;
+		this->bounce = bounce;
+		reseed();
+	}
+
+	void next_bounce()
+	{
+		if (!counter_based)
+			return;
+
+		++bounce;
+		reseed();
+	}
+
+	// Jumps to dimension offset of the current bounce, so a decision taken after a
+	// variable number of draws still reads the same dimension in every sample.
+	void skip_to(uint32_t offset)
+	{
+		dim = bounce_start() + offset;
+	}
+
+	double get_1d()
+	{
+		const uint32_t d = dim++;
+
+		switch (pattern)
+		{
+		case sample_pattern::stratified:
+			if (sample_index < sample_count)
+				return (permute(uint32_t(sample_index), sample_count, dimension_seed(d)) + gen.next_double()) / sample_count;
+			break;
+		case sample_pattern::sobol:
+		{
+			const uint32_t s = dimension_seed(d);
+			return to_unit(owen_scramble(sobol_0(owen_scramble(uint32_t(sample_index), s)), mix_seed(s, 1)));
+		}
+		case sample_pattern::halton:
+			if (d < SAMPLER_HALTON_DIMS)
+				return halton(d);
+			break;
+		default:
+			break;
+		}
+
+		return gen.next_double();
+	}
+
+	double get_1d(double min, double max)
+	{
+		// Returns a random real in [min, max).
+		return min + (max - min) * get_1d();
+	}
+
+	sample2 get_2d()
+	{
+		const uint32_t d = dim;
+
+		switch (pattern)
+		{
+		case sample_pattern::stratified:
+			if (sample_index < sample_count)
+			{
+				// A square grid of at least sample_count cells, visited in shuffled order.
+				dim += 2;
+				const uint32_t m = static_cast<uint32_t>(std::ceil(std::sqrt(double(sample_count))));
+				const uint32_t cell = permute(uint32_t(sample_index), m * m, dimension_seed(d));
+				const double x = (cell % m + gen.next_double()) / m;
+				const double y = (cell / m + gen.next_double()) / m;
+				return { x, y };
+			}
+			break;
+		case sample_pattern::sobol:
+		{
+			// Padding: every dimension pair gets its own shuffle of the 2D sequence.
+			dim += 2;
+			const uint32_t s = dimension_seed(d);
+			const uint32_t index = owen_scramble(uint32_t(sample_index), s);
+			return { to_unit(owen_scramble(sobol_0(index), mix_seed(s, 1))), to_unit(owen_scramble(sobol_1(index), mix_seed(s, 2))) };
+		}
+		default:
+			break;
+		}
+
+		const double x = get_1d();
+		const double y = get_1d();
+		return { x, y };
+	}
+
+private:
+	pcg32 gen;
+	uint64_t seed;
+	bool counter_based;
+	sample_pattern pattern;
+	uint32_t sample_count;		// samples per pixel the stratified pattern plans for
+
+	uint64_t pixel_index = 0;
+	uint64_t sample_index = 0;
+	uint64_t bounce = 0;
+	uint32_t dim = 0;
+	uint32_t pixel_seed = 0;		// hash of (seed, pixel_index) the pattern scrambles are drawn from
+	bool pixel_seeded = false;
+
+	void reseed()
+	{
+		uint64_t h = mix64(seed ^ mix64(pixel_index ^ mix64(sample_index ^ mix64(bounce))));
+		gen.seed(h, pixel_index);
+		dim = bounce_start();
+	}
+
+	uint32_t bounce_start() const
+	{
+		return bounce == 0 ? 0 : uint32_t(SAMPLER_CAMERA_DIMS + (bounce - 1) * SAMPLER_BOUNCE_DIMS);
+	}
+
+	// Same for every sample of a pixel, different per pixel and dimension.
+	uint32_t dimension_seed(uint32_t d) const
+	{
+		return mix32(pixel_seed ^ mix32(d));
+	}
+
+	static uint32_t mix_seed(uint32_t s, uint32_t k)
+	{
+		return mix32(s + k * 0x9e3779b9u);
+	}
+
+	static double to_unit(uint32_t x)
+	{
+		return x * (1.0 / 4294967296.0);
+	}
+
+	double halton(uint32_t d) const
+	{
+		static const uint32_t primes[SAMPLER_HALTON_DIMS] = {
+			2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+			59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+		};
+
+		return owen_radical_inverse(primes[d], sample_index, dimension_seed(d));
+	}
+};
+
+#endif
@@ -0,0 +1,429 @@
+#pragma once
+
+#define SCENE_H
+#ifdef SCENE_H
+
+#include "rtweekend.h"
+
+#include "hash.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Camera and render settings of a scene. Plain data with fixed-size members,
+// so the scene cache can store it as is.
+struct scene_settings
+{
+	vec3_t<double> lookfrom{ 13, 2, 3 };
+	vec3_t<double> lookat{ 0, 0, 0 };
+	vec3_t<double> vup{ 0, 1, 0 };
+	double vfov = 20;
+	double aperture = 0.1;
+	double focus_dist = 10.0;
+	double aspect_ratio = 3.0 / 2.0;
+	int32_t image_width = 1200;
+	int32_t samples_per_pixel = 500;
+	int32_t max_depth = 50;
+	int32_t sky = 1;		// 0 = black background, for closed scenes lit by their own lights
+};
+
+struct material_desc
+{
+	material_type type;
+	uint32_t reserved;
+	vec3_t<double> albedo;
+	double param;			// fuzz for metal, index of refraction for dielectric
+							// (albedo is the emitted radiance of a diffuse_light)
+};
+
+struct scene_sphere
+{
+	vec3_t<double> center;
+	double radius;
+	uint32_t material;		// index into scene_desc::materials
+	uint32_t reserved;
+};
+
+// A triangle mesh file placed in the scene, scaled about its origin and then moved by offset.
+struct scene_mesh
+{
+	vec3_t<double> offset;
+	double scale;
+	uint32_t material;		// index into scene_desc::materials
+	uint32_t reserved;
+	char path[256];			// as written in the scene file, '\0'-terminated
+};
+
+// A scene as data: what random_scene() builds and what a scene file describes.
+struct scene_desc
+{
+	scene_settings settings;
+	std::vector<material_desc> materials;
+	std::vector<scene_sphere> spheres;
+	std::vector<scene_mesh> meshes;
+
+	template <typename T>
+	uint32_t add_material(material_type type, const vec3_t<T>& albedo, double param)
+	{
+		materials.push_back({ type, 0, vec3_t<double>(albedo), param });
+		return static_cast<uint32_t>(materials.size() - 1);
+	}
+
+	template <typename T>
+	void add_sphere(const vec3_t<T>& center, double radius, uint32_t material)
+	{
+		spheres.push_back({ vec3_t<double>(center), radius, material, 0 });
+	}
+};
+
+inline material make_material(const material_desc& m)
+{
+	const color albedo(m.albedo);
+
+	switch (m.type)
+	{
+	case material_type::metal:
+		return make_metal(albedo, static_cast<real>(m.param));
+	case material_type::dielectric:
+		return make_dielectric(static_cast<real>(m.param));
+	case material_type::diffuse_light:
+		return make_diffuse_light(albedo);
+	default:
+		return make_lambertian(albedo);
+	}
+}
+
+// One sphere object per scene sphere. The scene's materials are appended to materials.
+inline hittable_list build_world(const scene_desc& desc, material_table& materials)
+{
+	const uint32_t first_material = static_cast<uint32_t>(materials.size());
+	for (const material_desc& m : desc.materials)
+		materials.add(make_material(m));
+
+	hittable_list world;
+	world.objects.reserve(desc.spheres.size());
+	for (const scene_sphere& s : desc.spheres)
+		world.add(make_shared<sphere>(point3(s.center), static_cast<real>(s.radius), first_material + s.material));
+
+	return world;
+}
+
+// Adds every sphere's center, radius and material to h, for the scene hash a checkpoint is
+// matched against: a moved or resized sphere changes it, a material edit does not.
+inline void hash_spheres(hasher& h, const scene_sphere* spheres, size_t n_spheres)
+{
+	for (size_t k = 0; k < n_spheres; ++k)
+	{
+		h.add(spheres[k].center);
+		h.add(spheres[k].radius);
+		h.add(spheres[k].material);
+	}
+}
+
+// Every sphere with an emitting material becomes a light. first_material is where the
+// scene's materials start in materials, as in build_world.
+inline light_list build_lights(const scene_settings& settings, const scene_sphere* spheres, size_t n_spheres,
+	const material_table& materials, uint32_t first_material)
+{
+	std::vector<sphere_light> lights;
+	for (size_t k = 0; k < n_spheres; ++k)
+	{
+		const scene_sphere& s = spheres[k];
+		const material& m = materials[first_material + s.material];
+		if (m.type == material_type::diffuse_light)
+			lights.push_back({ point3(s.center), static_cast<real>(s.radius), first_material + s.material, m.albedo });
+	}
+
+	return light_list(std::move(lights), settings.sky != 0);
+}
+
+// Text scene format, one statement per line, '#' starts a comment:
+//
+//   width 1200                  image width in pixels
+//   aspect 1.5                  image width / height
+//   spp 500                     samples per pixel
+//   max_depth 50
+//   lookfrom 13 2 3
+//   lookat 0 0 0
+//   vup 0 1 0
+//   vfov 20                     vertical field of view in degrees
+//   aperture 0.1
+//   focus_dist 10
+//   material <name> lambertian <r> <g> <b>
+//   material <name> metal <r> <g> <b> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   material <name> diffuse_light <r> <g> <b>   emitted radiance, may exceed 1
+//   sky 1                       0 = no sky light, the background is black
+//   sphere <x> <y> <z> <radius> <material name>
+//   mesh <file> <material name> [<x> <y> <z> <scale>]   OBJ or binary PLY, relative to the scene file
+//
+// Materials must be defined before the spheres and meshes that use them. A mesh with a
+// diffuse_light material glows but is not sampled as a light, so give it a material of its own.
+bool load_scene_text(const std::string& path, scene_desc& desc)
+{
+	mapped_file file(path);
+	if (!file.is_open())
+	{
+		std::cerr << "Cannot open scene " << path << '\n';
+		return false;
+	}
+
+	const unsigned char* data = file.data();
+	const size_t size = file.size();
+
+	scene_desc result;
+	std::unordered_map<std::string, uint32_t> material_names;
+
+	// Reused for every line, so parsing millions of spheres does not allocate per token.
+	const int max_tokens = 8;
+	std::string tokens[max_tokens];
+	int line = 0;
+
+	auto fail = [&](const std::string& message) {
+		std::cerr << path << ':' << line << ": " << message << '\n';
+		return false;
+	};
+
+	auto number = [&](int k, double& out) {
+		char* end = nullptr;
+		out = std::strtod(tokens[k].c_str(), &end);
+		return *end == '\0';
+	};
+
+	auto integer = [&](int k, int32_t& out) {
+		char* end = nullptr;
+		const long value = std::strtol(tokens[k].c_str(), &end, 10);
+		out = static_cast<int32_t>(value);
+		return *end == '\0' && value > 0;
+	};
+
+	auto read_vec3 = [&](int k, vec3_t<double>& out) {
+		double x, y, z;
+		if (!number(k, x) || !number(k + 1, y) || !number(k + 2, z))
+			return false;
+		out = vec3_t<double>(x, y, z);
+		return true;
+	};
+
+	size_t pos = 0;
+	while (pos < size)
+	{
+		++line;
+
+		int n = 0;
+		while (pos < size && data[pos] != '\n' && data[pos] != '#')
+		{
+			if (isspace(data[pos]))
+			{
+				pos++;
+				continue;
+			}
+
+			if (n == max_tokens)
+				return fail("too many values");
+
+			std::string& token = tokens[n++];
+			token.clear();
+			while (pos < size && !isspace(data[pos]) && data[pos] != '#')
+				token += static_cast<char>(data[pos++]);
+		}
+
+		// Skip a trailing comment and the newline.
+		while (pos < size && data[pos] != '\n')
+			pos++;
+		pos++;
+
+		if (n == 0)
+			continue;
+
+		const std::string& key = tokens[0];
+		bool ok;
+
+		if (key == "sphere")
+		{
+			scene_sphere s = {};
+			ok = n == 6 && read_vec3(1, s.center) && number(4, s.radius);
+			if (!ok)
+				return fail("expected: sphere <x> <y> <z> <radius> <material>");
+
+			auto found = material_names.find(tokens[5]);
+			if (found == material_names.end())
+				return fail("unknown material '" + tokens[5] + "'");
+
+			s.material = found->second;
+			result.spheres.push_back(s);
+		}
+		else if (key == "mesh")
+		{
+			scene_mesh m = {};
+			m.scale = 1;
+			ok = (n == 3 || (n == 7 && read_vec3(3, m.offset) && number(6, m.scale))) && tokens[1].size() < sizeof(m.path);
+			if (!ok)
+				return fail("expected: mesh <file> <material> [<x> <y> <z> <scale>], with a file name shorter than 256 characters");
+
+			auto found = material_names.find(tokens[2]);
+			if (found == material_names.end())
+				return fail("unknown material '" + tokens[2] + "'");
+
+			m.material = found->second;
+			std::memcpy(m.path, tokens[1].c_str(), tokens[1].size() + 1);
+			result.meshes.push_back(m);
+		}
+		else if (key == "material")
+		{
+			if (n < 3)
+				return fail("expected: material <name> <type> ...");
+
+			material_desc m = {};
+			const std::string& type = tokens[2];
+			if (type == "lambertian")
+			{
+				m.type = material_type::lambertian;
+				ok = n == 6 && read_vec3(3, m.albedo);
+			}
+			else if (type == "metal")
+			{
+				m.type = material_type::metal;
+				ok = n == 7 && read_vec3(3, m.albedo) && number(6, m.param);
+			}
+			else if (type == "dielectric")
+			{
+				m.type = material_type::dielectric;
+				ok = n == 4 && number(3, m.param);
+			}
+			else if (type == "diffuse_light")
+			{
+				m.type = material_type::diffuse_light;
+				ok = n == 6 && read_vec3(3, m.albedo);
+			}
+			else
+			{
+				return fail("unknown material type '" + type + "'");
+			}
+
+			if (!ok)
+				return fail("wrong values for a " + type + " material");
+			if (!material_names.emplace(tokens[1], static_cast<uint32_t>(result.materials.size())).second)
+				return fail("material '" + tokens[1] + "' is defined twice");
+
+			result.materials.push_back(m);
+		}
+		else if (key == "width")
+			ok = n == 2 && integer(1, result.settings.image_width);
+		else if (key == "aspect")
+			ok = n == 2 && number(1, result.settings.aspect_ratio) && result.settings.aspect_ratio > 0;
+		else if (key == "spp")
+			ok = n == 2 && integer(1, result.settings.samples_per_pixel);
+		else if (key == "max_depth")
+			ok = n == 2 && integer(1, result.settings.max_depth);
+		else if (key == "lookfrom")
+			ok = n == 4 && read_vec3(1, result.settings.lookfrom);
+		else if (key == "lookat")
+			ok = n == 4 && read_vec3(1, result.settings.lookat);
+		else if (key == "vup")
+			ok = n == 4 && read_vec3(1, result.settings.vup);
+		else if (key == "vfov")
+			ok = n == 2 && number(1, result.settings.vfov);
+		else if (key == "aperture")
+			ok = n == 2 && number(1, result.settings.aperture);
+		else if (key == "focus_dist")
+			ok = n == 2 && number(1, result.settings.focus_dist);
+		else if (key == "sky")
+		{
+			ok = n == 2 && (tokens[1] == "0" || tokens[1] == "1");
+			result.settings.sky = ok && tokens[1] == "1";
+		}
+		else
+			return fail("unknown statement '" + key + "'");
+
+		if (!ok)
+			return fail("wrong values for '" + key + "'");
+	}
+
+	desc = std::move(result);
+	return true;
+}
+
+// Writes desc in the format load_scene_text reads, with enough digits to read back the same doubles.
+bool save_scene_text(const std::string& path, const scene_desc& desc)
+{
+	std::ofstream output(path);
+	if (!output.is_open())
+	{
+		std::cerr << "Cannot write scene " << path << '\n';
+		return false;
+	}
+
+	output.precision(std::numeric_limits<double>::max_digits10);
+
+	auto write_vec3 = [&](const vec3_t<double>& v) -> std::ostream& {
+		return output << v.x() << ' ' << v.y() << ' ' << v.z();
+	};
+
+	const scene_settings& s = desc.settings;
+	output << "width " << s.image_width << '\n'
+		<< "aspect " << s.aspect_ratio << '\n'
+		<< "spp " << s.samples_per_pixel << '\n'
+		<< "max_depth " << s.max_depth << '\n';
+	output << "lookfrom "; write_vec3(s.lookfrom) << '\n';
+	output << "lookat "; write_vec3(s.lookat) << '\n';
+	output << "vup "; write_vec3(s.vup) << '\n';
+	output << "vfov " << s.vfov << '\n'
+		<< "aperture " << s.aperture << '\n'
+		<< "focus_dist " << s.focus_dist << '\n'
+		<< "sky " << s.sky << "\n\n";
+
+	for (size_t k = 0; k < desc.materials.size(); ++k)
+	{
+		const material_desc& m = desc.materials[k];
+		output << "material m" << k << ' ';
+		switch (m.type)
+		{
+		case material_type::metal:
+			output << "metal "; write_vec3(m.albedo) << ' ' << m.param << '\n';
+			break;
+		case material_type::dielectric:
+			output << "dielectric " << m.param << '\n';
+			break;
+		case material_type::diffuse_light:
+			output << "diffuse_light "; write_vec3(m.albedo) << '\n';
+			break;
+		default:
+			output << "lambertian "; write_vec3(m.albedo) << '\n';
+			break;
+		}
+	}
+
+	output << '\n';
+	for (const scene_sphere& sp : desc.spheres)
+	{
+		output << "sphere "; write_vec3(sp.center) << ' ' << sp.radius << " m" << sp.material << '\n';
+	}
+	for (const scene_mesh& m : desc.meshes)
+	{
+		output << "mesh " << m.path << " m" << m.material << ' '; write_vec3(m.offset) << ' ' << m.scale << '\n';
+	}
+
+	if (!output)
+	{
+		std::cerr << "Cannot write scene " << path << '\n';
+		return false;
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,500 @@
+#pragma once
+
+#define SCENE_CACHE_H
+#ifdef SCENE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hash.h"
+#include "hittable.h"
+#include "instrument.h"
+#include "mapped_file.h"
+#include "scene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define SCENE_CACHE_VERSION 4
+#define SCENE_CACHE_LEAF_SIZE 4
+#define SCENE_CACHE_SAH_DEPTH 32		// deeper subtrees are split at the median, which bounds the tree depth
+#define SCENE_CACHE_MAX_DEPTH 64
+
+// Size and content hash of the scene file a cache was compiled from. A modification time
+// would miss a same-size edit within its resolution; hashing the text costs a fraction of
+// parsing it.
+struct file_stamp
+{
+	uint64_t size = 0;
+	uint64_t hash = 0;
+
+	bool read(const std::string& path)
+	{
+		mapped_file file(path);
+		if (!file.is_open())
+			return false;
+
+		hasher h;
+		h.add(file.data(), file.size());
+		size = file.size();
+		hash = h.value();
+		return true;
+	}
+
+	bool operator==(const file_stamp& other) const { return size == other.size && hash == other.hash; }
+};
+
+struct scene_cache_node
+{
+	vec3_t<double> min;
+	vec3_t<double> max;
+	uint32_t offset;		// first sphere of a leaf, or the second child of an interior node (the first child is the next node)
+	uint32_t count;			// spheres in a leaf, 0 for an interior node
+	uint32_t axis;			// split axis, to visit the nearer child first
+	uint32_t reserved;
+};
+
+struct scene_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t n_materials;
+	uint64_t n_nodes;
+	uint64_t n_spheres;
+	uint64_t n_meshes;
+	file_stamp source;
+	uint64_t materials_offset;
+	uint64_t nodes_offset;
+	uint64_t spheres_offset;
+	uint64_t meshes_offset;
+	scene_settings settings;
+};
+
+// A compiled scene: settings, materials, a flat BVH, the spheres in leaf order and
+// the mesh statements (the mesh files themselves are loaded on every run), in one file that is memory-mapped and traversed in place, so a large scene
+// needs neither parsing nor a BVH build once it has been compiled.
+class scene_cache : public hittable
+{
+public:
+	scene_cache() {}
+
+	// Builds the BVH over desc and writes the cache file.
+	static bool compile(const scene_desc& desc, const file_stamp& source, const std::string& path);
+
+	// Maps a cache file. Fails if it is missing, truncated or from another version.
+	bool open(const std::string& path);
+
+	const file_stamp& source() const { return header->source; }
+	const scene_settings& settings() const { return header->settings; }
+	size_t size() const { return static_cast<size_t>(header->n_spheres); }
+	const scene_sphere* sphere_data() const { return spheres; }		// size() spheres, in leaf order
+	size_t mesh_count() const { return static_cast<size_t>(header->n_meshes); }
+	const scene_mesh* mesh_list() const { return meshes; }
+
+	// Hit records index this table.
+	const material_table& materials() const { return material_list; }
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+private:
+	mapped_file file;
+	const scene_cache_header* header = nullptr;
+	const scene_cache_node* nodes = nullptr;
+	const scene_sphere* spheres = nullptr;
+	const scene_mesh* meshes = nullptr;
+	material_table material_list;
+
+	static uint64_t align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+	// The closest sphere hit in [t_min, t_max], with t_max lowered to its t, or with any_hit
+	// the first one found. nullptr if there is none.
+	template <bool any_hit>
+	const scene_sphere* find_hit(const ray& r, real t_min, real& t_max) const;
+};
+
+namespace scene_cache_build
+{
+	struct primitive
+	{
+		uint32_t index;
+		aabb box;
+		point3 centroid;
+	};
+
+	struct builder
+	{
+		const scene_desc& desc;
+		std::vector<primitive>& prims;
+		std::vector<scene_cache_node> nodes;
+		std::vector<uint32_t> order;
+
+		uint32_t build(size_t start, size_t end, int depth)
+		{
+			const uint32_t index = static_cast<uint32_t>(nodes.size());
+			nodes.push_back(scene_cache_node());
+
+			if (end - start <= SCENE_CACHE_LEAF_SIZE)
+			{
+				scene_cache_node& leaf = nodes[index];
+				leaf.offset = static_cast<uint32_t>(order.size());
+				leaf.count = static_cast<uint32_t>(end - start);
+
+				// Bounds from the stored doubles, so they enclose the spheres in either precision.
+				for (size_t k = start; k < end; ++k)
+				{
+					const scene_sphere& s = desc.spheres[prims[k].index];
+					const vec3_t<double> extent(s.radius, s.radius, s.radius);
+					const vec3_t<double> lo = s.center - extent, hi = s.center + extent;
+					for (int a = 0; a < 3; ++a)
+					{
+						leaf.min[a] = k == start ? lo[a] : std::fmin(leaf.min[a], lo[a]);
+						leaf.max[a] = k == start ? hi[a] : std::fmax(leaf.max[a], hi[a]);
+					}
+					order.push_back(prims[k].index);
+				}
+				return index;
+			}
+
+			size_t mid;
+			if (depth < SCENE_CACHE_SAH_DEPTH)
+			{
+				mid = bvh_split(prims, start, end);
+			}
+			else
+			{
+				aabb centroids(prims[start].centroid, prims[start].centroid);
+				for (size_t k = start + 1; k < end; ++k)
+					centroids = surrounding_box(centroids, aabb(prims[k].centroid, prims[k].centroid));
+
+				const int axis = centroids.longest_axis();
+				mid = start + (end - start) / 2;
+				std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+					[axis](const primitive& a, const primitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+			}
+
+			build(start, mid, depth + 1);
+			const uint32_t second = build(mid, end, depth + 1);
+
+			scene_cache_node& node = nodes[index];
+			const scene_cache_node& left = nodes[index + 1];
+			const scene_cache_node& right = nodes[second];
+			for (int a = 0; a < 3; ++a)
+			{
+				node.min[a] = std::fmin(left.min[a], right.min[a]);
+				node.max[a] = std::fmax(left.max[a], right.max[a]);
+			}
+
+			const vec3_t<double> d = node.max - node.min;
+			node.axis = d.x() > d.y() && d.x() > d.z() ? 0 : (d.y() > d.z() ? 1 : 2);
+			node.offset = second;
+			node.count = 0;
+			return index;
+		}
+	};
+}
+
+bool scene_cache::compile(const scene_desc& desc, const file_stamp& source, const std::string& path)
+{
+	for (const scene_sphere& s : desc.spheres)
+	{
+		if (s.material >= desc.materials.size())
+		{
+			std::cerr << "Sphere uses material " << s.material << " of " << desc.materials.size() << '\n';
+			return false;
+		}
+	}
+	for (const scene_mesh& m : desc.meshes)
+	{
+		if (m.material >= desc.materials.size())
+		{
+			std::cerr << "Mesh uses material " << m.material << " of " << desc.materials.size() << '\n';
+			return false;
+		}
+	}
+
+	std::vector<scene_cache_build::primitive> prims(desc.spheres.size());
+	for (size_t k = 0; k < prims.size(); ++k)
+	{
+		const scene_sphere& s = desc.spheres[k];
+		const point3 center(s.center);
+		const real radius = static_cast<real>(s.radius);
+
+		prims[k].index = static_cast<uint32_t>(k);
+		prims[k].box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
+		prims[k].centroid = center;
+	}
+
+	scene_cache_build::builder b = { desc, prims, {}, {} };
+	b.nodes.reserve(prims.empty() ? 0 : 2 * prims.size() / SCENE_CACHE_LEAF_SIZE + 1);
+	b.order.reserve(prims.size());
+	if (!prims.empty())
+		b.build(0, prims.size(), 0);
+
+	scene_cache_header h = {};
+	std::memcpy(h.magic, "RTSCENE", 8);
+	h.version = SCENE_CACHE_VERSION;
+	h.n_materials = static_cast<uint32_t>(desc.materials.size());
+	h.n_nodes = b.nodes.size();
+	h.n_spheres = b.order.size();
+	h.n_meshes = desc.meshes.size();
+	h.source = source;
+	h.settings = desc.settings;
+	h.materials_offset = align(sizeof(h));
+	h.nodes_offset = align(h.materials_offset + h.n_materials * sizeof(material_desc));
+	h.spheres_offset = align(h.nodes_offset + h.n_nodes * sizeof(scene_cache_node));
+	h.meshes_offset = align(h.spheres_offset + h.n_spheres * sizeof(scene_sphere));
+
+	// Written next to path and renamed over it, like a checkpoint.
+	const std::string temp_path = path + ".tmp";
+	{
+		std::ofstream output(temp_path, std::ios::binary);
+		if (!output.is_open())
+		{
+			std::cerr << "Cannot write scene cache " << temp_path << '\n';
+			return false;
+		}
+
+		auto pad_to = [&](uint64_t offset) {
+			static const char zeros[64] = {};
+			output.write(zeros, static_cast<std::streamsize>(offset - static_cast<uint64_t>(output.tellp())));
+		};
+
+		output.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		pad_to(h.materials_offset);
+		output.write(reinterpret_cast<const char*>(desc.materials.data()), h.n_materials * sizeof(material_desc));
+		pad_to(h.nodes_offset);
+		output.write(reinterpret_cast<const char*>(b.nodes.data()), h.n_nodes * sizeof(scene_cache_node));
+		pad_to(h.spheres_offset);
+
+		// Spheres in leaf order, a chunk at a time.
+		std::vector<scene_sphere> chunk;
+		chunk.reserve(4096);
+		for (size_t k = 0; k < b.order.size(); k += chunk.size())
+		{
+			chunk.clear();
+			for (size_t c = k; c < b.order.size() && chunk.size() < 4096; ++c)
+				chunk.push_back(desc.spheres[b.order[c]]);
+			output.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(scene_sphere));
+		}
+
+		pad_to(h.meshes_offset);
+		output.write(reinterpret_cast<const char*>(desc.meshes.data()), h.n_meshes * sizeof(scene_mesh));
+
+		if (!output)
+		{
+			std::cerr << "Cannot write scene cache " << temp_path << '\n';
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());
+	if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+	{
+		std::cerr << "Cannot rename " << temp_path << " to " << path << '\n';
+		return false;
+	}
+
+	return true;
+}
+
+bool scene_cache::open(const std::string& path)
+{
+	header = nullptr;
+	material_list = material_table();
+
+	if (!file.open(path))
+		return false;
+
+	const unsigned char* data = file.data();
+	const scene_cache_header* h = reinterpret_cast<const scene_cache_header*>(data);
+
+	if (file.size() < sizeof(scene_cache_header) || std::memcmp(h->magic, "RTSCENE", 8) != 0
+		|| h->version != SCENE_CACHE_VERSION)
+	{
+		std::cerr << path << " is not a version " << SCENE_CACHE_VERSION << " scene cache\n";
+		file.close();
+		return false;
+	}
+
+	if (h->materials_offset + h->n_materials * sizeof(material_desc) > file.size()
+		|| h->nodes_offset + h->n_nodes * sizeof(scene_cache_node) > file.size()
+		|| h->spheres_offset + h->n_spheres * sizeof(scene_sphere) > file.size()
+		|| h->meshes_offset + h->n_meshes * sizeof(scene_mesh) > file.size())
+	{
+		std::cerr << path << " is truncated\n";
+		file.close();
+		return false;
+	}
+
+	header = h;
+	nodes = reinterpret_cast<const scene_cache_node*>(data + h->nodes_offset);
+	spheres = reinterpret_cast<const scene_sphere*>(data + h->spheres_offset);
+	meshes = reinterpret_cast<const scene_mesh*>(data + h->meshes_offset);
+
+	const material_desc* descs = reinterpret_cast<const material_desc*>(data + h->materials_offset);
+	for (uint32_t k = 0; k < h->n_materials; ++k)
+		material_list.add(make_material(descs[k]));
+
+	return true;
+}
+
+template <bool any_hit>
+const scene_sphere* scene_cache::find_hit(const ray& r, real t_min, real& t_max) const
+{
+	if (header == nullptr || header->n_nodes == 0)
+		return nullptr;
+
+	const point3 origin = r.origin();
+	const vec3 direction = r.direction();
+	const vec3 inv_d(1 / direction.x(), 1 / direction.y(), 1 / direction.z());
+	const real a = direction.length_squared();
+
+	uint32_t stack[SCENE_CACHE_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+
+	const scene_sphere* closest = nullptr;
+
+	while (top > 0)
+	{
+		const uint32_t index = stack[--top];
+		const scene_cache_node& node = nodes[index];
+		count_test(counted_prim::cache_node);
+
+		// Slab test, as in aabb::hit.
+		real t0 = t_min, t1 = t_max;
+		bool inside = true;
+		for (int k = 0; k < 3 && inside; ++k)
+		{
+			real near_t = (static_cast<real>(node.min[k]) - origin[k]) * inv_d[k];
+			real far_t = (static_cast<real>(node.max[k]) - origin[k]) * inv_d[k];
+			if (inv_d[k] < 0)
+				std::swap(near_t, far_t);
+
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+			inside = t1 > t0;
+		}
+		if (!inside)
+			continue;
+		count_hit(counted_prim::cache_node);
+
+		if (node.count > 0)
+		{
+			// Same quadratic as sphere::hit.
+			count_test(counted_prim::cache_sphere, node.count);
+			for (uint32_t k = 0; k < node.count; ++k)
+			{
+				const scene_sphere& s = spheres[node.offset + k];
+				const real radius = static_cast<real>(s.radius);
+				const vec3 oc = origin - point3(s.center);
+				const real half_b = dot(oc, direction);
+				const real c = oc.length_squared() - radius * radius;
+
+				const real discriminant = half_b * half_b - a * c;
+				if (discriminant < 0)
+					continue;
+				const real sqrtd = std::sqrt(discriminant);
+
+				real root = (-half_b - sqrtd) / a;
+				if (root < t_min || root > t_max)
+				{
+					root = (-half_b + sqrtd) / a;
+					if (root < t_min || root > t_max)
+						continue;
+				}
+
+				t_max = root;
+				closest = &s;
+				count_hit(counted_prim::cache_sphere);
+				if (any_hit)
+					return closest;
+			}
+			continue;
+		}
+
+		// Push the farther child first so the nearer one is visited first and shrinks t_max early.
+		if (direction[node.axis] < 0)
+		{
+			stack[top++] = index + 1;
+			stack[top++] = node.offset;
+		}
+		else
+		{
+			stack[top++] = node.offset;
+			stack[top++] = index + 1;
+		}
+	}
+
+	return closest;
+}
+
+bool scene_cache::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const scene_sphere* closest = find_hit<false>(r, t_min, t_max);
+	if (closest == nullptr)
+		return false;
+
+	rec.t = t_max;
+	rec.p = r.at(rec.t);
+	vec3 outward_normal = (rec.p - point3(closest->center)) / static_cast<real>(closest->radius);
+	rec.set_face_normal(r, outward_normal);
+	rec.mat = closest->material;
+
+	return true;
+}
+
+bool scene_cache::occluded(const ray& r, real t_min, real t_max) const
+{
+	return find_hit<true>(r, t_min, t_max) != nullptr;
+}
+
+bool scene_cache::bounding_box(aabb& output_box) const
+{
+	if (header == nullptr || header->n_nodes == 0)
+		return false;
+
+	output_box = aabb(point3(nodes[0].min), point3(nodes[0].max));
+	return true;
+}
+
+// Loads the scene file at path through its cache at path + ".cache": the cache is
+// used as is when it was compiled from the current file, and rebuilt otherwise.
+bool load_scene(const std::string& path, scene_cache& cache)
+{
+	const auto sta = std::chrono::steady_clock::now();
+	const std::string cache_path = path + ".cache";
+
+	file_stamp source;
+	if (!source.read(path))
+	{
+		std::cerr << "Cannot open scene " << path << '\n';
+		return false;
+	}
+
+	if (cache.open(cache_path) && cache.source() == source)
+	{
+		const std::chrono::duration<double> dur = std::chrono::steady_clock::now() - sta;
+		std::cerr << "scene cache: " << cache.size() << " spheres mapped from " << cache_path << " in " << dur.count() << " s\n";
+		return true;
+	}
+
+	scene_desc desc;
+	if (!load_scene_text(path, desc) || !scene_cache::compile(desc, source, cache_path) || !cache.open(cache_path))
+		return false;
+
+	const std::chrono::duration<double> dur = std::chrono::steady_clock::now() - sta;
+	std::cerr << "scene cache: " << cache.size() << " spheres compiled to " << cache_path << " in " << dur.count() << " s\n";
+	return true;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#define SIMD_H
+#ifdef SIMD_H
+
+// Runtime CPU feature detection for the hand-vectorized kernels.
+// Kernels are compiled for every instruction set up front and picked at run time,
+// so one binary uses AVX-512 where it exists and still runs on SSE-only machines.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RT_X86 0
+#endif
+
+// MSVC allows intrinsics of any instruction set in any function; GCC and Clang
+// need the target enabled on the function that uses them.
+#if RT_X86 && !defined(_MSC_VER)
+#define RT_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#define RT_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define RT_TARGET_SSE4
+#define RT_TARGET_AVX2
+#define RT_TARGET_AVX512
+#endif
+
+enum class simd_level
+{
+	scalar,
+	sse4,
+	avx2,
+	avx512
+};
+
+inline const char* simd_level_name(simd_level level)
+{
+	switch (level)
+	{
+	case simd_level::sse4: return "SSE4.1";
+	case simd_level::avx2: return "AVX2";
+	case simd_level::avx512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+inline simd_level detect_simd_level()
+{
+#if RT_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int max_leaf = info[0];
+
+	__cpuid(info, 1);
+	const bool sse41 = (info[2] & (1 << 19)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	// The OS must save the YMM (and for AVX-512 the ZMM/opmask) registers on context switch.
+	const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	const bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+	const bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+
+	bool avx2 = false;
+	bool avx512f = false;
+	if (max_leaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+		avx512f = (info[1] & (1 << 16)) != 0;
+	}
+
+	if (avx512f && zmm_enabled) return simd_level::avx512;
+	if (avx2 && ymm_enabled) return simd_level::avx2;
+	if (sse41) return simd_level::sse4;
+	return simd_level::scalar;
+#elif RT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+	if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+	if (__builtin_cpu_supports("sse4.1")) return simd_level::sse4;
+	return simd_level::scalar;
+#else
+	return simd_level::scalar;
+#endif
+}
+
+#endif
@@ -4,36 +4,43 @@
 #ifdef SPHERE_H
 
 #include "hittable.h"
+#include "instrument.h"
 #include "vec3.h"
 
 class sphere : public hittable
 {
 public:
 	sphere() {}
-	sphere(point3 cen, double r, shared_ptr<material> m)
-		: center(cen), radius(r), mat_ptr(m) {};
+	sphere(point3 cen, real r, uint32_t m)
+		: center(cen), radius(r), mat(m) {};
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
 private:
+	friend class sphere_set;
+
 	point3 center;
-	double radius;
-	shared_ptr<material> mat_ptr;
+	real radius;
+	uint32_t mat;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_test(counted_prim::sphere);
+
 	vec3 oc = r.origin() - center;
-	double a = r.direction().length_squared();
-	double half_b = dot(oc, r.direction());
-	double c = oc.length_squared() - radius * radius;
+	real a = r.direction().length_squared();
+	real half_b = dot(oc, r.direction());
+	real c = oc.length_squared() - radius * radius;
 
-	double discriminant = half_b * half_b - a * c;
+	real discriminant = half_b * half_b - a * c;
 	if (discriminant < 0) return false;
-	double sqrtd = std::sqrt(discriminant);
+	real sqrtd = std::sqrt(discriminant);
 
 	// Find the nearest root that lies in the acceptable range.
-	double root = (-half_b - sqrtd) / a;
+	real root = (-half_b - sqrtd) / a;
 	if (root < t_min || root > t_max)
 	{
 		root = (-half_b + sqrtd) / a;
@@ -45,8 +52,41 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 	rec.p = r.at(rec.t);
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
+	rec.mat = mat;
+
+	count_hit(counted_prim::sphere);
+	return true;
+}
+
+bool sphere::occluded(const ray& r, real t_min, real t_max) const
+{
+	count_test(counted_prim::sphere);
+
+	// The quadratic of hit, but either root in range will do and no normal is needed.
+	vec3 oc = r.origin() - center;
+	real a = r.direction().length_squared();
+	real half_b = dot(oc, r.direction());
+	real c = oc.length_squared() - radius * radius;
+
+	real discriminant = half_b * half_b - a * c;
+	if (discriminant < 0) return false;
+	real sqrtd = std::sqrt(discriminant);
 
+	real root = (-half_b - sqrtd) / a;
+	if (root < t_min || root > t_max)
+	{
+		root = (-half_b + sqrtd) / a;
+		if (root < t_min || root > t_max)
+			return false;
+	}
+
+	count_hit(counted_prim::sphere);
+	return true;
+}
+
+bool sphere::bounding_box(aabb& output_box) const
+{
+	output_box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
 	return true;
 }
 
@@ -0,0 +1,577 @@
+#pragma once
+
+#define SPHERE_SET_H
+#ifdef SPHERE_SET_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+struct sphere_soa
+{
+	const double* cx;
+	const double* cy;
+	const double* cz;
+	const double* radius;
+	size_t n;
+};
+
+// Closest-hit search over all spheres of a sphere_soa.
+// Returns the index of the nearest sphere hit in [t_min, t_max] and lowers t_max to its t, or -1.
+using sphere_kernel = long long (*)(const sphere_soa& s, const ray_t<double>& r, double t_min, double& t_max);
+
+inline long long sphere_hit_scalar(const sphere_soa& s, size_t begin, const ray_t<double>& r, double t_min, double& t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+	const double a = d.length_squared();
+
+	long long best = -1;
+	for (size_t i = begin; i < s.n; ++i)
+	{
+		double ocx = o.x() - s.cx[i];
+		double ocy = o.y() - s.cy[i];
+		double ocz = o.z() - s.cz[i];
+		double half_b = ocx * d.x() + ocy * d.y() + ocz * d.z();
+		double c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius[i] * s.radius[i];
+
+		double discriminant = half_b * half_b - a * c;
+		if (discriminant < 0) continue;
+		double sqrtd = std::sqrt(discriminant);
+
+		double root = (-half_b - sqrtd) / a;
+		if (root < t_min || root > t_max)
+		{
+			root = (-half_b + sqrtd) / a;
+			if (root < t_min || root > t_max)
+				continue;
+		}
+
+		t_max = root;
+		best = static_cast<long long>(i);
+	}
+
+	return best;
+}
+
+inline long long sphere_kernel_scalar(const sphere_soa& s, const ray_t<double>& r, double t_min, double& t_max)
+{
+	return sphere_hit_scalar(s, 0, r, t_min, t_max);
+}
+
+// Any-hit search for shadow rays: returns the index of the first sphere found with a hit
+// in [t_min, t_max], or -1. The SIMD kernels stop at the first block with a hitting lane.
+using sphere_any_kernel = long long (*)(const sphere_soa& s, const ray_t<double>& r, double t_min, double t_max);
+
+inline long long sphere_any_hit_scalar(const sphere_soa& s, size_t begin, const ray_t<double>& r, double t_min, double t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+	const double a = d.length_squared();
+
+	for (size_t i = begin; i < s.n; ++i)
+	{
+		double ocx = o.x() - s.cx[i];
+		double ocy = o.y() - s.cy[i];
+		double ocz = o.z() - s.cz[i];
+		double half_b = ocx * d.x() + ocy * d.y() + ocz * d.z();
+		double c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius[i] * s.radius[i];
+
+		double discriminant = half_b * half_b - a * c;
+		if (discriminant < 0) continue;
+		double sqrtd = std::sqrt(discriminant);
+
+		double root = (-half_b - sqrtd) / a;
+		if (root < t_min || root > t_max)
+		{
+			root = (-half_b + sqrtd) / a;
+			if (root < t_min || root > t_max)
+				continue;
+		}
+
+		return static_cast<long long>(i);
+	}
+
+	return -1;
+}
+
+inline long long sphere_any_kernel_scalar(const sphere_soa& s, const ray_t<double>& r, double t_min, double t_max)
+{
+	return sphere_any_hit_scalar(s, 0, r, t_min, t_max);
+}
+
+// Lowest set lane of a non-zero movemask.
+inline int first_lane(unsigned mask)
+{
+	int k = 0;
+	while ((mask & 1) == 0)
+	{
+		mask >>= 1;
+		++k;
+	}
+	return k;
+}
+
+#if RT_X86
+
+// Every SIMD kernel runs the same per-lane math as the scalar loop, keeps the best t and
+// index per lane, reduces the lanes at the end and finishes the tail with the scalar loop.
+
+RT_TARGET_SSE4 inline long long sphere_kernel_sse4(const sphere_soa& s, const ray_t<double>& r, double t_min, double& t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+	const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+	const __m128d a = _mm_set1_pd(d.length_squared());
+	const __m128d tmin = _mm_set1_pd(t_min);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d inf = _mm_set1_pd(infinity);
+
+	__m128d best_t = _mm_set1_pd(t_max);
+	__m128d best_i = _mm_set1_pd(-1.0);
+	__m128d index = _mm_set_pd(1.0, 0.0);
+	const __m128d step = _mm_set1_pd(2.0);
+
+	size_t i = 0;
+	for (; i + 2 <= s.n; i += 2, index = _mm_add_pd(index, step))
+	{
+		__m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(s.cx + i));
+		__m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(s.cy + i));
+		__m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(s.cz + i));
+		__m128d rad = _mm_loadu_pd(s.radius + i);
+
+		__m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+		__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(rad, rad));
+		__m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+
+		__m128d has_root = _mm_cmpge_pd(disc, zero);
+		if (_mm_movemask_pd(has_root) == 0)
+			continue;
+
+		__m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(disc, zero));
+		__m128d near_t = _mm_div_pd(_mm_sub_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+		__m128d far_t = _mm_div_pd(_mm_add_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+
+		__m128d near_ok = _mm_and_pd(_mm_cmpge_pd(near_t, tmin), _mm_cmple_pd(near_t, best_t));
+		__m128d far_ok = _mm_and_pd(_mm_cmpge_pd(far_t, tmin), _mm_cmple_pd(far_t, best_t));
+		__m128d root = _mm_blendv_pd(_mm_blendv_pd(inf, far_t, far_ok), near_t, near_ok);
+		__m128d closer = _mm_and_pd(has_root, _mm_and_pd(_mm_or_pd(near_ok, far_ok), _mm_cmple_pd(root, best_t)));
+
+		best_t = _mm_blendv_pd(best_t, root, closer);
+		best_i = _mm_blendv_pd(best_i, index, closer);
+	}
+
+	alignas(16) double lane_t[2], lane_i[2];
+	_mm_store_pd(lane_t, best_t);
+	_mm_store_pd(lane_i, best_i);
+
+	long long best = -1;
+	for (int k = 0; k < 2; ++k)
+		if (lane_i[k] >= 0 && lane_t[k] <= t_max)
+		{
+			t_max = lane_t[k];
+			best = static_cast<long long>(lane_i[k]);
+		}
+
+	long long tail = sphere_hit_scalar(s, i, r, t_min, t_max);
+	return tail >= 0 ? tail : best;
+}
+
+RT_TARGET_AVX2 inline long long sphere_kernel_avx2(const sphere_soa& s, const ray_t<double>& r, double t_min, double& t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+	const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+	const __m256d a = _mm256_set1_pd(d.length_squared());
+	const __m256d tmin = _mm256_set1_pd(t_min);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d inf = _mm256_set1_pd(infinity);
+
+	__m256d best_t = _mm256_set1_pd(t_max);
+	__m256d best_i = _mm256_set1_pd(-1.0);
+	__m256d index = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+	const __m256d step = _mm256_set1_pd(4.0);
+
+	size_t i = 0;
+	for (; i + 4 <= s.n; i += 4, index = _mm256_add_pd(index, step))
+	{
+		__m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(s.cx + i));
+		__m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(s.cy + i));
+		__m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(s.cz + i));
+		__m256d rad = _mm256_loadu_pd(s.radius + i);
+
+		__m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_mul_pd(rad, rad));
+		__m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+
+		__m256d has_root = _mm256_cmp_pd(disc, zero, _CMP_GE_OQ);
+		if (_mm256_movemask_pd(has_root) == 0)
+			continue;
+
+		__m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+		__m256d near_t = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+		__m256d far_t = _mm256_div_pd(_mm256_add_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+
+		__m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(near_t, best_t, _CMP_LE_OQ));
+		__m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(far_t, best_t, _CMP_LE_OQ));
+		__m256d root = _mm256_blendv_pd(_mm256_blendv_pd(inf, far_t, far_ok), near_t, near_ok);
+		__m256d closer = _mm256_and_pd(has_root, _mm256_and_pd(_mm256_or_pd(near_ok, far_ok), _mm256_cmp_pd(root, best_t, _CMP_LE_OQ)));
+
+		best_t = _mm256_blendv_pd(best_t, root, closer);
+		best_i = _mm256_blendv_pd(best_i, index, closer);
+	}
+
+	alignas(32) double lane_t[4], lane_i[4];
+	_mm256_store_pd(lane_t, best_t);
+	_mm256_store_pd(lane_i, best_i);
+
+	long long best = -1;
+	for (int k = 0; k < 4; ++k)
+		if (lane_i[k] >= 0 && lane_t[k] <= t_max)
+		{
+			t_max = lane_t[k];
+			best = static_cast<long long>(lane_i[k]);
+		}
+
+	long long tail = sphere_hit_scalar(s, i, r, t_min, t_max);
+	return tail >= 0 ? tail : best;
+}
+
+RT_TARGET_AVX512 inline long long sphere_kernel_avx512(const sphere_soa& s, const ray_t<double>& r, double t_min, double& t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m512d ox = _mm512_set1_pd(o.x()), oy = _mm512_set1_pd(o.y()), oz = _mm512_set1_pd(o.z());
+	const __m512d dx = _mm512_set1_pd(d.x()), dy = _mm512_set1_pd(d.y()), dz = _mm512_set1_pd(d.z());
+	const __m512d a = _mm512_set1_pd(d.length_squared());
+	const __m512d tmin = _mm512_set1_pd(t_min);
+	const __m512d zero = _mm512_setzero_pd();
+
+	__m512d best_t = _mm512_set1_pd(t_max);
+	__m512d best_i = _mm512_set1_pd(-1.0);
+	__m512d index = _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0);
+	const __m512d step = _mm512_set1_pd(8.0);
+
+	size_t i = 0;
+	for (; i + 8 <= s.n; i += 8, index = _mm512_add_pd(index, step))
+	{
+		__m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(s.cx + i));
+		__m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(s.cy + i));
+		__m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(s.cz + i));
+		__m512d rad = _mm512_loadu_pd(s.radius + i);
+
+		__m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, dx), _mm512_mul_pd(ocy, dy)), _mm512_mul_pd(ocz, dz));
+		__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_mul_pd(rad, rad));
+		__m512d disc = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(a, c));
+
+		__mmask8 has_root = _mm512_cmp_pd_mask(disc, zero, _CMP_GE_OQ);
+		if (has_root == 0)
+			continue;
+
+		__m512d sqrtd = _mm512_maskz_sqrt_pd(has_root, disc);
+		__m512d near_t = _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+		__m512d far_t = _mm512_div_pd(_mm512_add_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+
+		__mmask8 near_ok = _mm512_cmp_pd_mask(near_t, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(near_t, best_t, _CMP_LE_OQ);
+		__mmask8 far_ok = _mm512_cmp_pd_mask(far_t, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(far_t, best_t, _CMP_LE_OQ);
+		__mmask8 closer = has_root & (near_ok | far_ok);
+
+		__m512d root = _mm512_mask_blend_pd(near_ok, far_t, near_t);
+		best_t = _mm512_mask_blend_pd(closer, best_t, root);
+		best_i = _mm512_mask_blend_pd(closer, best_i, index);
+	}
+
+	alignas(64) double lane_t[8], lane_i[8];
+	_mm512_store_pd(lane_t, best_t);
+	_mm512_store_pd(lane_i, best_i);
+
+	long long best = -1;
+	for (int k = 0; k < 8; ++k)
+		if (lane_i[k] >= 0 && lane_t[k] <= t_max)
+		{
+			t_max = lane_t[k];
+			best = static_cast<long long>(lane_i[k]);
+		}
+
+	long long tail = sphere_hit_scalar(s, i, r, t_min, t_max);
+	return tail >= 0 ? tail : best;
+}
+
+// The any-hit kernels share the closest-hit per-lane math, with t_max fixed.
+
+RT_TARGET_SSE4 inline long long sphere_any_kernel_sse4(const sphere_soa& s, const ray_t<double>& r, double t_min, double t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+	const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+	const __m128d a = _mm_set1_pd(d.length_squared());
+	const __m128d tmin = _mm_set1_pd(t_min), tmax = _mm_set1_pd(t_max);
+	const __m128d zero = _mm_setzero_pd();
+
+	size_t i = 0;
+	for (; i + 2 <= s.n; i += 2)
+	{
+		__m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(s.cx + i));
+		__m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(s.cy + i));
+		__m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(s.cz + i));
+		__m128d rad = _mm_loadu_pd(s.radius + i);
+
+		__m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+		__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(rad, rad));
+		__m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+
+		__m128d has_root = _mm_cmpge_pd(disc, zero);
+		if (_mm_movemask_pd(has_root) == 0)
+			continue;
+
+		__m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(disc, zero));
+		__m128d near_t = _mm_div_pd(_mm_sub_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+		__m128d far_t = _mm_div_pd(_mm_add_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+
+		__m128d near_ok = _mm_and_pd(_mm_cmpge_pd(near_t, tmin), _mm_cmple_pd(near_t, tmax));
+		__m128d far_ok = _mm_and_pd(_mm_cmpge_pd(far_t, tmin), _mm_cmple_pd(far_t, tmax));
+		const int hits = _mm_movemask_pd(_mm_and_pd(has_root, _mm_or_pd(near_ok, far_ok)));
+		if (hits != 0)
+			return static_cast<long long>(i) + first_lane(hits);
+	}
+
+	return sphere_any_hit_scalar(s, i, r, t_min, t_max);
+}
+
+RT_TARGET_AVX2 inline long long sphere_any_kernel_avx2(const sphere_soa& s, const ray_t<double>& r, double t_min, double t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+	const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+	const __m256d a = _mm256_set1_pd(d.length_squared());
+	const __m256d tmin = _mm256_set1_pd(t_min), tmax = _mm256_set1_pd(t_max);
+	const __m256d zero = _mm256_setzero_pd();
+
+	size_t i = 0;
+	for (; i + 4 <= s.n; i += 4)
+	{
+		__m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(s.cx + i));
+		__m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(s.cy + i));
+		__m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(s.cz + i));
+		__m256d rad = _mm256_loadu_pd(s.radius + i);
+
+		__m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_mul_pd(rad, rad));
+		__m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+
+		__m256d has_root = _mm256_cmp_pd(disc, zero, _CMP_GE_OQ);
+		if (_mm256_movemask_pd(has_root) == 0)
+			continue;
+
+		__m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+		__m256d near_t = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+		__m256d far_t = _mm256_div_pd(_mm256_add_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+
+		__m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(near_t, tmax, _CMP_LE_OQ));
+		__m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(far_t, tmax, _CMP_LE_OQ));
+		const int hits = _mm256_movemask_pd(_mm256_and_pd(has_root, _mm256_or_pd(near_ok, far_ok)));
+		if (hits != 0)
+			return static_cast<long long>(i) + first_lane(hits);
+	}
+
+	return sphere_any_hit_scalar(s, i, r, t_min, t_max);
+}
+
+RT_TARGET_AVX512 inline long long sphere_any_kernel_avx512(const sphere_soa& s, const ray_t<double>& r, double t_min, double t_max)
+{
+	const vec3_t<double> o = r.origin();
+	const vec3_t<double> d = r.direction();
+
+	const __m512d ox = _mm512_set1_pd(o.x()), oy = _mm512_set1_pd(o.y()), oz = _mm512_set1_pd(o.z());
+	const __m512d dx = _mm512_set1_pd(d.x()), dy = _mm512_set1_pd(d.y()), dz = _mm512_set1_pd(d.z());
+	const __m512d a = _mm512_set1_pd(d.length_squared());
+	const __m512d tmin = _mm512_set1_pd(t_min), tmax = _mm512_set1_pd(t_max);
+	const __m512d zero = _mm512_setzero_pd();
+
+	size_t i = 0;
+	for (; i + 8 <= s.n; i += 8)
+	{
+		__m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(s.cx + i));
+		__m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(s.cy + i));
+		__m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(s.cz + i));
+		__m512d rad = _mm512_loadu_pd(s.radius + i);
+
+		__m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, dx), _mm512_mul_pd(ocy, dy)), _mm512_mul_pd(ocz, dz));
+		__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_mul_pd(rad, rad));
+		__m512d disc = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(a, c));
+
+		__mmask8 has_root = _mm512_cmp_pd_mask(disc, zero, _CMP_GE_OQ);
+		if (has_root == 0)
+			continue;
+
+		__m512d sqrtd = _mm512_maskz_sqrt_pd(has_root, disc);
+		__m512d near_t = _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+		__m512d far_t = _mm512_div_pd(_mm512_add_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+
+		__mmask8 near_ok = _mm512_cmp_pd_mask(near_t, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(near_t, tmax, _CMP_LE_OQ);
+		__mmask8 far_ok = _mm512_cmp_pd_mask(far_t, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(far_t, tmax, _CMP_LE_OQ);
+		const __mmask8 hits = has_root & (near_ok | far_ok);
+		if (hits != 0)
+			return static_cast<long long>(i) + first_lane(hits);
+	}
+
+	return sphere_any_hit_scalar(s, i, r, t_min, t_max);
+}
+
+#endif
+
+inline sphere_kernel select_sphere_kernel(simd_level level)
+{
+#if RT_X86
+	switch (level)
+	{
+	case simd_level::avx512: return sphere_kernel_avx512;
+	case simd_level::avx2: return sphere_kernel_avx2;
+	case simd_level::sse4: return sphere_kernel_sse4;
+	default: break;
+	}
+#endif
+	return sphere_kernel_scalar;
+}
+
+inline sphere_any_kernel select_sphere_any_kernel(simd_level level)
+{
+#if RT_X86
+	switch (level)
+	{
+	case simd_level::avx512: return sphere_any_kernel_avx512;
+	case simd_level::avx2: return sphere_any_kernel_avx2;
+	case simd_level::sse4: return sphere_any_kernel_sse4;
+	default: break;
+	}
+#endif
+	return sphere_any_kernel_scalar;
+}
+
+// Many spheres in one hittable, stored as structure-of-arrays so the closest-hit
+// search streams through flat arrays and tests 2/4/8 spheres per instruction.
+class sphere_set : public hittable
+{
+public:
+	sphere_set(simd_level level = detect_simd_level()) { set_simd_level(level); }
+	sphere_set(const hittable_list& list, simd_level level = detect_simd_level());
+
+	void add(const point3& center, double radius, uint32_t material);
+	size_t size() const { return cx.size(); }
+
+	void set_simd_level(simd_level level)
+	{
+		simd = level;
+		kernel = select_sphere_kernel(level);
+		any_kernel = select_sphere_any_kernel(level);
+	}
+	simd_level get_simd_level() const { return simd; }
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(aabb& output_box) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+private:
+	std::vector<double> cx, cy, cz, radius;
+	std::vector<uint32_t> mat_index;
+	aabb box;
+
+	simd_level simd;
+	sphere_kernel kernel;
+	sphere_any_kernel any_kernel;
+};
+
+sphere_set::sphere_set(const hittable_list& list, simd_level level)
+{
+	set_simd_level(level);
+
+	for (const shared_ptr<hittable>& object : list.objects)
+	{
+		const sphere* s = dynamic_cast<const sphere*>(object.get());
+		if (s == nullptr)
+		{
+			std::cerr << "Only spheres can be added to a sphere_set.\n";
+			continue;
+		}
+
+		add(s->center, s->radius, s->mat);
+	}
+}
+
+void sphere_set::add(const point3& center, double r, uint32_t material)
+{
+	const vec3 extent(r, r, r);
+	const aabb sphere_box(center - extent, center + extent);
+	box = cx.empty() ? sphere_box : surrounding_box(box, sphere_box);
+
+	cx.push_back(center.x());
+	cy.push_back(center.y());
+	cz.push_back(center.z());
+	radius.push_back(r);
+	mat_index.push_back(material);
+}
+
+bool sphere_set::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	const sphere_soa soa = { cx.data(), cy.data(), cz.data(), radius.data(), cx.size() };
+
+	// The kernels work in double; a float build widens the ray once per query.
+	const ray_t<double> rd(vec3_t<double>(r.origin()), vec3_t<double>(r.direction()));
+	double t_hit = t_max;
+	const long long i = kernel(soa, rd, t_min, t_hit);
+	count_test(counted_prim::sphere_set, soa.n);
+	if (i < 0)
+		return false;
+	count_hit(counted_prim::sphere_set);
+
+	const point3 center(static_cast<real>(cx[i]), static_cast<real>(cy[i]), static_cast<real>(cz[i]));
+	rec.t = real(t_hit);
+	rec.p = r.at(rec.t);
+	vec3 outward_normal = (rec.p - center) / real(radius[i]);
+	rec.set_face_normal(r, outward_normal);
+	rec.mat = mat_index[i];
+
+	return true;
+}
+
+// Any blocker will do, so the search ends at the first sphere hit instead of the closest one.
+bool sphere_set::occluded(const ray& r, real t_min, real t_max) const
+{
+	const sphere_soa soa = { cx.data(), cy.data(), cz.data(), radius.data(), cx.size() };
+
+	const ray_t<double> rd(vec3_t<double>(r.origin()), vec3_t<double>(r.direction()));
+	const long long i = any_kernel(soa, rd, t_min, t_max);
+	if (i < 0)
+	{
+		count_test(counted_prim::sphere_set, soa.n);
+		return false;
+	}
+	count_test(counted_prim::sphere_set, static_cast<size_t>(i) + 1);
+	count_hit(counted_prim::sphere_set);
+
+	return true;
+}
+
+bool sphere_set::bounding_box(aabb& output_box) const
+{
+	output_box = box;
+	return !cx.empty();
+}
+
+#endif
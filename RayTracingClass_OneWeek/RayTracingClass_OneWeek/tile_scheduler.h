@@ -0,0 +1,364 @@
+#pragma once
+
+#define TILE_SCHEDULER_H
+#ifdef TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A rectangular block of pixels, [x0, x1) x [y0, y1).
+struct tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+// Order in which tiles, and the pixels inside a tile, are visited. Along the Morton
+// (Z-order) and Hilbert curves, consecutive tiles and pixels are neighbours in 2D, so
+// rays traced close together in time see the same part of the scene and reuse the
+// BVH nodes and geometry already in cache; Hilbert never jumps, Morton jumps at
+// every power-of-two boundary but is cheaper to compute.
+enum class tile_order { scanline, morton, hilbert };
+
+inline const char* tile_order_name(tile_order order)
+{
+	switch (order)
+	{
+	case tile_order::morton: return "morton";
+	case tile_order::hilbert: return "hilbert";
+	default: return "scanline";
+	}
+}
+
+inline bool parse_tile_order(const std::string& name, tile_order& order)
+{
+	for (tile_order o : { tile_order::scanline, tile_order::morton, tile_order::hilbert })
+	{
+		if (name == tile_order_name(o))
+		{
+			order = o;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Spreads the low 32 bits of v to the even bits of the result.
+inline uint64_t spread_bits(uint64_t v)
+{
+	v &= 0xffffffffu;
+	v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+	v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+	v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+	v = (v | (v << 2)) & 0x3333333333333333ull;
+	v = (v | (v << 1)) & 0x5555555555555555ull;
+	return v;
+}
+
+// Position of cell (x, y) along the curve through an n x n grid, n a power of two.
+inline uint64_t curve_index(tile_order order, uint32_t n, uint32_t x, uint32_t y)
+{
+	switch (order)
+	{
+	case tile_order::morton:
+		return spread_bits(x) | (spread_bits(y) << 1);
+
+	case tile_order::hilbert:
+	{
+		uint64_t d = 0;
+		for (uint32_t s = n / 2; s > 0; s /= 2)
+		{
+			const uint32_t rx = (x & s) > 0;
+			const uint32_t ry = (y & s) > 0;
+			d += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+			// Rotate the quadrant so the sub-curve starts and ends next to its neighbours.
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = n - 1 - x;
+					y = n - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return d;
+	}
+
+	default:
+		return uint64_t(y) * n + x;
+	}
+}
+
+// Smallest power of two >= the larger of w and h.
+inline uint32_t curve_size(int w, int h)
+{
+	uint32_t n = 1;
+	while (n < static_cast<uint32_t>(std::max(w, h)))
+		n *= 2;
+	return n;
+}
+
+// Covers t with tile_size x tile_size tiles, in the given order (scanline: row by row from the bottom).
+inline std::vector<tile> split_tile(const tile& t, int tile_size, tile_order order = tile_order::scanline)
+{
+	std::vector<tile> tiles;
+	std::vector<uint64_t> keys;
+
+	const int columns = (t.x1 - t.x0 + tile_size - 1) / tile_size;
+	const int rows = (t.y1 - t.y0 + tile_size - 1) / tile_size;
+	const uint32_t n = curve_size(columns, rows);
+
+	for (int y = t.y0; y < t.y1; y += tile_size)
+	{
+		for (int x = t.x0; x < t.x1; x += tile_size)
+		{
+			tiles.push_back({ x, y, std::min(x + tile_size, t.x1), std::min(y + tile_size, t.y1) });
+			keys.push_back(curve_index(order, n, (x - t.x0) / tile_size, (y - t.y0) / tile_size));
+		}
+	}
+
+	// Cells outside the image leave gaps in the keys, which sorting skips over.
+	std::vector<size_t> rank(tiles.size());
+	for (size_t k = 0; k < rank.size(); ++k)
+		rank[k] = k;
+	std::sort(rank.begin(), rank.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+	std::vector<tile> ordered;
+	ordered.reserve(tiles.size());
+	for (size_t k : rank)
+		ordered.push_back(tiles[k]);
+	return ordered;
+}
+
+// Covers the image with tile_size x tile_size tiles, in the given order.
+inline std::vector<tile> make_tiles(int image_width, int image_height, int tile_size, tile_order order = tile_order::scanline)
+{
+	return split_tile({ 0, 0, image_width, image_height }, tile_size, order);
+}
+
+// Offset of a pixel from the corner of its tile.
+struct tile_pixel
+{
+	int dx, dy;
+};
+
+// The pixels of a tile in visiting order, kept for the last tile size asked for;
+// all tiles but those at the image edge have the same size, so it rarely rebuilds.
+class tile_pixel_order
+{
+public:
+	explicit tile_pixel_order(tile_order order = tile_order::scanline) : order(order) {}
+
+	tile_order get_order() const { return order; }
+
+	const std::vector<tile_pixel>& get(const tile& t)
+	{
+		const int w = t.x1 - t.x0, h = t.y1 - t.y0;
+		if (w == width && h == height)
+			return pixels;
+
+		width = w;
+		height = h;
+		pixels.clear();
+		for (int dy = 0; dy < h; ++dy)
+			for (int dx = 0; dx < w; ++dx)
+				pixels.push_back({ dx, dy });
+
+		const uint32_t n = curve_size(w, h);
+		const tile_order o = order;
+		std::sort(pixels.begin(), pixels.end(), [n, o](const tile_pixel& a, const tile_pixel& b) {
+			return curve_index(o, n, a.dx, a.dy) < curve_index(o, n, b.dx, b.dy);
+		});
+		return pixels;
+	}
+
+private:
+	tile_order order;
+	int width = -1, height = -1;
+	std::vector<tile_pixel> pixels;
+};
+
+// Persistent thread pool that renders an image tile by tile.
+// Every worker owns a deque of tiles. It pops from the front of its own deque
+// and, once that runs dry, steals from the back of the other workers' deques.
+class tile_scheduler
+{
+public:
+	using tile_func = std::function<void(const tile& t, unsigned worker)>;
+
+	// n_threads == 0 means one worker per hardware thread.
+	tile_scheduler(unsigned n_threads = 0);
+	~tile_scheduler();
+
+	tile_scheduler(const tile_scheduler&) = delete;
+	tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+	unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+	// Splits the image into tile_size x tile_size tiles and blocks until func has run on all of them.
+	void run(int image_width, int image_height, int tile_size, const tile_func& func);
+
+	// Runs func on an explicit list of tiles, blocking until all of them are done.
+	void run(const std::vector<tile>& tiles, const tile_func& func);
+
+private:
+	struct tile_queue
+	{
+		std::mutex mtx;
+		std::deque<tile> tiles;
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<tile_queue>> queues;
+
+	std::mutex mtx;
+	std::condition_variable cv_work;
+	std::condition_variable cv_done;
+
+	const tile_func* job = nullptr;
+	unsigned generation = 0;
+	unsigned busy = 0;
+	bool stopping = false;
+	std::atomic<int> tiles_left{ 0 };
+
+	void worker_loop(unsigned index);
+	bool pop_or_steal(unsigned index, tile& t);
+};
+
+tile_scheduler::tile_scheduler(unsigned n_threads)
+{
+	if (n_threads == 0)
+		n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < n_threads; ++i)
+		queues.push_back(std::make_unique<tile_queue>());
+
+	for (unsigned i = 0; i < n_threads; ++i)
+		workers.emplace_back(&tile_scheduler::worker_loop, this, i);
+}
+
+tile_scheduler::~tile_scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopping = true;
+	}
+	cv_work.notify_all();
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+void tile_scheduler::run(int image_width, int image_height, int tile_size, const tile_func& func)
+{
+	run(make_tiles(image_width, image_height, tile_size), func);
+}
+
+void tile_scheduler::run(const std::vector<tile>& tiles, const tile_func& func)
+{
+	if (tiles.empty())
+		return;
+
+	std::unique_lock<std::mutex> lock(mtx);
+
+	// Hand each worker one contiguous run of tiles, so neighbouring tiles stay on
+	// the same core and thieves take work from the far end of a victim's run.
+	// With a Morton or Hilbert tile order every run is also a compact patch of the image.
+	const size_t n_workers = queues.size();
+	for (size_t w = 0; w < n_workers; ++w)
+	{
+		const size_t begin = tiles.size() * w / n_workers;
+		const size_t end = tiles.size() * (w + 1) / n_workers;
+
+		std::lock_guard<std::mutex> queue_lock(queues[w]->mtx);
+		queues[w]->tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+	}
+
+	job = &func;
+	tiles_left = static_cast<int>(tiles.size());
+	++generation;
+	cv_work.notify_all();
+
+	cv_done.wait(lock, [this] { return tiles_left == 0 && busy == 0; });
+	job = nullptr;
+}
+
+void tile_scheduler::worker_loop(unsigned index)
+{
+	unsigned seen = 0;
+
+	while (true)
+	{
+		const tile_func* func;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_work.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+
+			// A worker that wakes only after run() has finished its batch finds no job; it
+			// must not join the next batch, whose tiles it would run with a stale pointer.
+			seen = generation;
+			func = job;
+			if (func == nullptr)
+				continue;
+			++busy;
+		}
+
+		tile t;
+		while (tiles_left > 0 && pop_or_steal(index, t))
+		{
+			(*func)(t, index);
+			--tiles_left;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			--busy;
+		}
+		cv_done.notify_all();
+	}
+}
+
+bool tile_scheduler::pop_or_steal(unsigned index, tile& t)
+{
+	{
+		tile_queue& own = *queues[index];
+		std::lock_guard<std::mutex> lock(own.mtx);
+		if (!own.tiles.empty())
+		{
+			t = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+
+	const size_t n_workers = queues.size();
+	for (size_t k = 1; k < n_workers; ++k)
+	{
+		tile_queue& victim = *queues[(index + k) % n_workers];
+		std::lock_guard<std::mutex> lock(victim.mtx);
+		if (!victim.tiles.empty())
+		{
+			t = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#endif
@@ -9,21 +9,28 @@
 
 using std::sqrt;
 
-class vec3
+template <typename T>
+class vec3_t
 {
 public:
-	vec3() : e{ 0, 0, 0 } {}
-	vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+	using value_type = T;
 
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	vec3_t() : e{ 0, 0, 0 } {}
+	vec3_t(T e0, T e1, T e2) : e{ e0, e1, e2 } {}
 
-	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator [](int i) const { return e[i]; }
-	double& operator [] (int i) { return e[i]; }
+	// Explicit conversion between precisions, e.g. to hand a float ray to a double kernel.
+	template <typename U>
+	explicit vec3_t(const vec3_t<U>& v) : e{ T(v.x()), T(v.y()), T(v.z()) } {}
 
-	vec3& operator += (const vec3& v)
+	T x() const { return e[0]; }
+	T y() const { return e[1]; }
+	T z() const { return e[2]; }
+
+	vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+	T operator [](int i) const { return e[i]; }
+	T& operator [] (int i) { return e[i]; }
+
+	vec3_t& operator += (const vec3_t& v)
 	{
 		e[0] += v.e[0];
 		e[1] += v.e[1];
@@ -32,7 +39,7 @@ public:
 		return *this;
 	}
 
-	vec3& operator *=(const double t)
+	vec3_t& operator *=(const T t)
 	{
 		e[0] *= t;
 		e[1] *= t;
@@ -41,148 +48,187 @@ public:
 		return *this;
 	}
 
-	vec3& operator /=(const double t)
+	vec3_t& operator /=(const T t)
 	{
 		return *this *= 1 / t;
 	}
 
-	double length() const
+	T length() const
 	{
 		return sqrt(length_squared());
 	}
 
-	double length_squared() const
+	T length_squared() const
 	{
 		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
 	}
 
-	friend inline std::ostream& operator << (std::ostream& out, const vec3& v)
+	friend inline std::ostream& operator << (std::ostream& out, const vec3_t& v)
 	{
 		return out << "{ " << v.e[0] << ", " << v.e[1] << ", " << v.e[2] << " } ";
 	}
 
-	friend inline vec3 operator+ (const vec3& u, const vec3& v)
+	friend inline vec3_t operator+ (const vec3_t& u, const vec3_t& v)
 	{
-		return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+		return vec3_t(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 	}
 
-	friend inline vec3 operator- (const vec3& u, const vec3& v)
+	friend inline vec3_t operator- (const vec3_t& u, const vec3_t& v)
 	{
-		return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+		return vec3_t(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 	}
 
-	friend inline vec3 operator* (const vec3& u, const vec3& v)
+	friend inline vec3_t operator* (const vec3_t& u, const vec3_t& v)
 	{
-		return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+		return vec3_t(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 	}
 
-	friend inline vec3 operator* (double t, const vec3& v)
+	friend inline vec3_t operator* (T t, const vec3_t& v)
 	{
-		return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+		return vec3_t(t * v.e[0], t * v.e[1], t * v.e[2]);
 	}
 
-	friend inline vec3 operator* (const vec3& v, double t)
+	friend inline vec3_t operator* (const vec3_t& v, T t)
 	{
 		return t * v;
 	}
 
-	friend inline vec3 operator/ (const vec3& v, double t)
+	friend inline vec3_t operator/ (const vec3_t& v, T t)
 	{
 		return (1 / t) * v;
 	}
 
-	friend inline double dot(const vec3& u, const vec3& v)
+	friend inline T dot(const vec3_t& u, const vec3_t& v)
 	{
 		return u.e[0] * v.e[0]
 			+ u.e[1] * v.e[1]
 			+ u.e[2] * v.e[2];
 	}
 
-	friend inline vec3 cross(const vec3& u, const vec3& v)
+	friend inline vec3_t cross(const vec3_t& u, const vec3_t& v)
 	{
-		return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+		return vec3_t(u.e[1] * v.e[2] - u.e[2] * v.e[1],
 			u.e[2] * v.e[0] - u.e[0] * v.e[2],
 			u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 	}
 
-	friend inline vec3 unit_vector(vec3 v)
+	friend inline vec3_t unit_vector(vec3_t v)
 	{
 		return v / v.length();
 	}
 
-	inline static vec3 random()
+	inline static vec3_t random()
+	{
+		return vec3_t(T(random_double()), T(random_double()), T(random_double()));
+	}
+
+	inline static vec3_t random(double min, double max)
 	{
-		return vec3(random_double(), random_double(), random_double());
+		return vec3_t(T(random_double(min, max)), T(random_double(min, max)), T(random_double(min, max)));
 	}
 
-	inline static vec3 random(double min, double max)
+	inline static vec3_t random(sampler& smp)
 	{
-		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+		// Draw one component per statement; argument evaluation order is unspecified.
+		T x = T(smp.get_1d());
+		T y = T(smp.get_1d());
+		T z = T(smp.get_1d());
+		return vec3_t(x, y, z);
+	}
+
+	inline static vec3_t random(double min, double max, sampler& smp)
+	{
+		T x = T(smp.get_1d(min, max));
+		T y = T(smp.get_1d(min, max));
+		T z = T(smp.get_1d(min, max));
+		return vec3_t(x, y, z);
 	}
 
 	bool near_zero() const
 	{
 		// Return true if the vector is close to zero in all dimensions.
-		const double s = 1e-8;
-		return (fabs(e[0]) < s) && (fabs(e[1]) < s) && fabs(e[2] < s);
+		const T s = T(1e-8);
+		return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
 	}
 
 private:
-	double e[3];
+	T e[3];
 };
 
 // Type aliases for vec3
+using vec3 = vec3_t<real>;
 using point3 = vec3;		// 3D point
 using color = vec3;			// RGB color
 
-inline vec3 random_in_unit_sphere()
-{
-	while (true)
-	{
-		vec3 p = vec3::random(-1, 1);
-
-		if (p.length_squared() >= 1)
-			continue;
+// The mappings below turn a fixed number of sampler dimensions into one point instead of
+// rejecting samples, so stratified and low-discrepancy patterns keep their structure.
 
-		return p;
-	}
+template <typename T = real>
+vec3_t<T> random_unit_vector(sampler& smp)
+{
+	// Uniform on the sphere: z is uniform in [-1, 1] (Archimedes), phi uniform around it.
+	const sample2 u = smp.get_2d();
+	const double z = 1 - 2 * u.x;
+	const double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+	const double phi = 2 * pi * u.y;
+	return vec3_t<T>(T(r * std::cos(phi)), T(r * std::sin(phi)), T(z));
 }
 
-vec3 random_unit_vector()
+template <typename T = real>
+inline vec3_t<T> random_in_unit_sphere(sampler& smp)
 {
-	return unit_vector(random_in_unit_sphere());
+	// A direction scaled by the cube root of a uniform radius fills the ball evenly.
+	const vec3_t<T> d = random_unit_vector<T>(smp);
+	return T(std::cbrt(smp.get_1d())) * d;
 }
 
-vec3 random_in_hemisphere(const vec3& normal)
+template <typename T>
+vec3_t<T> random_in_hemisphere(const vec3_t<T>& normal, sampler& smp)
 {
-	vec3 in_unit_sphere = random_in_unit_sphere();
+	vec3_t<T> in_unit_sphere = random_in_unit_sphere<T>(smp);
 	if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere in normal
 		return in_unit_sphere;
 	else
 		return -in_unit_sphere;
 }
 
-vec3 reflect(const vec3& v, const vec3& n)
+template <typename T>
+vec3_t<T> reflect(const vec3_t<T>& v, const vec3_t<T>& n)
 {
 	return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+template <typename T>
+vec3_t<T> refract(const vec3_t<T>& uv, const vec3_t<T>& n, typename vec3_t<T>::value_type etai_over_etat)
 {
-	double cos_theta = std::fmin(dot(-uv, n), 1.0);
-	vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-	vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+	T cos_theta = std::fmin(dot(-uv, n), T(1));
+	vec3_t<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+	vec3_t<T> r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
 	return r_out_perp + r_out_parallel;
 }
 
-vec3 random_in_unit_disk()
+template <typename T = real>
+vec3_t<T> random_in_unit_disk(sampler& smp)
 {
-	while (true)
+	// Shirley-Chiu concentric mapping: squares around the centre go to rings of the disk.
+	const sample2 u = smp.get_2d();
+	const double a = 2 * u.x - 1;
+	const double b = 2 * u.y - 1;
+	if (a == 0 && b == 0)
+		return vec3_t<T>(0, 0, 0);
+
+	double r, theta;
+	if (std::fabs(a) > std::fabs(b))
+	{
+		r = a;
+		theta = (pi / 4) * (b / a);
+	}
+	else
 	{
-		vec3 p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-		if (p.length_squared() >= 1) continue;
-		return p;
+		r = b;
+		theta = pi / 2 - (pi / 4) * (a / b);
 	}
+	return vec3_t<T>(T(r * std::cos(theta)), T(r * std::sin(theta)), 0);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,226 @@
+#pragma once
+
+#define WAVEFRONT_H
+#ifdef WAVEFRONT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "lights.h"
+#include "material.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#define WAVEFRONT_PATHS 4096		// paths in flight per worker
+
+// Breadth-first ("wavefront") path tracer.
+// Keeps a pool of in-flight paths and advances all of them one bounce at a time:
+// one intersection pass over the whole pool, then the hits are split into one queue
+// per material type and every queue is shaded in its own loop. Paths that reach a light
+// add its emission and finish in the light's queue. Finished paths are
+// replaced with fresh camera samples from the same tile until the tile is exhausted.
+class wavefront_integrator
+{
+public:
+	wavefront_integrator(const hittable& world, const material_table& materials, const light_list& lights, const camera& cam,
+		int image_width, int image_height, int max_depth, int rr_min_depth, size_t max_paths = WAVEFRONT_PATHS)
+		: world(world), materials(materials), lights(lights), cam(cam), image_width(image_width), image_height(image_height),
+		max_depth(max_depth), rr_min_depth(rr_min_depth), max_paths(max_paths)
+	{}
+
+	// Traces samples [begin, end) of every pixel (i, j) of t, visited in the order of pixels
+	// (offsets from the tile's corner, see tile_pixel_order), where range(i, j, begin, end)
+	// fills in the interval, and hands each finished sample to sink(i, j, radiance, first_hit).
+	template <typename RangeFn, typename SinkFn>
+	void render(const tile& t, const std::vector<tile_pixel>& pixels, sampler& smp, path_stats& stats, RangeFn range, SinkFn sink);
+
+private:
+	struct path_state
+	{
+		ray r;
+		color throughput;
+		color radiance;
+		real bsdf_pdf;			// density of the bounce that produced r, see ray_color
+		first_hit feature;
+		bool recording;			// feature is not final yet
+		int i, j;
+		uint32_t sample;
+		int depth;				// scatter events so far, -1 once the path is finished
+	};
+
+	static const int n_material_types = 4;
+
+	const hittable& world;
+	const material_table& materials;
+	const light_list& lights;
+	const camera& cam;
+	int image_width;
+	int image_height;
+	int max_depth;
+	int rr_min_depth;
+	size_t max_paths;
+
+	std::vector<path_state> paths;
+	std::vector<hit_record> hits;
+	std::vector<uint32_t> queues[n_material_types];
+
+	uint64_t pixel_index(const path_state& p) const { return static_cast<uint64_t>(p.j) * image_width + p.i; }
+};
+
+template <typename RangeFn, typename SinkFn>
+void wavefront_integrator::render(const tile& t, const std::vector<tile_pixel>& pixels, sampler& smp, path_stats& stats, RangeFn range, SinkFn sink)
+{
+	// Cursor over the tile's (pixel, sample) pairs in the order of pixels, advanced by the regenerate step.
+	size_t cur_pixel = 0;
+	int cur_i = 0, cur_j = 0;
+	uint32_t cur_sample = 0, cur_end = 0;
+
+	auto next_sample = [&](path_state& p) {
+		while (cur_sample >= cur_end)
+		{
+			if (cur_pixel == pixels.size())
+				return false;
+
+			cur_i = t.x0 + pixels[cur_pixel].dx;
+			cur_j = t.y0 + pixels[cur_pixel].dy;
+			cur_pixel++;
+			range(cur_i, cur_j, cur_sample, cur_end);
+		}
+
+		p.i = cur_i;
+		p.j = cur_j;
+		p.sample = cur_sample++;
+		return true;
+	};
+
+	paths.clear();
+
+	while (true)
+	{
+		// Regenerate: top the pool up with new camera samples.
+		path_state p;
+		while (paths.size() < max_paths && next_sample(p))
+		{
+			p.depth = 0;
+			p.throughput = color(1, 1, 1);
+			p.radiance = color(0, 0, 0);
+			p.bsdf_pdf = 0;
+			p.feature = first_hit();
+			p.recording = true;
+
+			smp.start_sample(pixel_index(p), p.sample);
+			const sample2 jitter = smp.get_2d();
+			real u = real(p.i + jitter.x) / (image_width - 1);
+			real v = real(p.j + jitter.y) / (image_height - 1);
+			p.r = cam.get_ray(u, v, smp);
+
+			paths.push_back(p);
+		}
+
+		if (paths.empty())
+			break;
+
+		// Intersect: one pass over every live path, misses pick up the sky and finish.
+		hits.resize(paths.size());
+		for (std::vector<uint32_t>& queue : queues)
+			queue.clear();
+
+		for (size_t k = 0; k < paths.size(); ++k)
+		{
+			path_state& path = paths[k];
+
+			// If we've exceeded the ray bounce limit, no more light is gathered.
+			if (path.depth >= max_depth)
+			{
+				count_path(max_depth);
+				path.depth = -1;
+				continue;
+			}
+
+			stats.depth_rays[path.depth]++;
+
+			if (world.hit(path.r, 0.001, infinity, hits[k]))
+			{
+				if (path.recording)
+					path.recording = !record_first_hit(path.r, hits[k], materials, path.throughput, path.feature);
+				path.feature.materials.add(hits[k].mat);
+				queues[static_cast<int>(materials[hits[k].mat].type)].push_back(static_cast<uint32_t>(k));
+			}
+			else
+			{
+				path.radiance += path.throughput * lights.background(path.r);
+				if (path.recording)
+					record_miss(path.throughput, path.feature);
+				count_path(path.depth + 1);
+				path.depth = -1;
+			}
+		}
+
+		// Shade: each queue calls a single scatter implementation over and over,
+		// so the switch in scatter() takes the same branch for the whole queue.
+		for (const std::vector<uint32_t>& queue : queues)
+		{
+			for (uint32_t k : queue)
+			{
+				path_state& path = paths[k];
+				const hit_record& rec = hits[k];
+				const material& mat = materials[rec.mat];
+
+				if (mat.type == material_type::diffuse_light)
+				{
+					path.radiance += path.throughput * emitted(mat, rec) * emission_weight(lights, path.bsdf_pdf, path.r, rec);
+					count_scatter(static_cast<int>(mat.type), rec.mat, false);
+					count_path(path.depth + 1);
+					path.depth = -1;
+					continue;
+				}
+
+				ray scattered;
+				color attenuation;
+				smp.start_sample(pixel_index(path), path.sample, path.depth + 1);
+				const bool scattered_ok = scatter(mat, path.r, rec, attenuation, scattered, smp);
+				count_scatter(static_cast<int>(mat.type), rec.mat, scattered_ok);
+
+				if (mat.type == material_type::lambertian && !lights.empty())
+				{
+					path.radiance += path.throughput * sample_direct(world, lights, mat, rec, smp, stats);
+					path.feature.materials.add(material_lights);
+				}
+
+				if (scattered_ok)
+				{
+					path.r = scattered;
+					path.throughput = path.throughput * attenuation;
+					path.bsdf_pdf = lights.empty() ? 0 : scatter_pdf(mat, rec, scattered);
+					path.depth++;
+
+					if (path.depth >= rr_min_depth && !russian_roulette(path.throughput, smp, stats))
+					{
+						count_path(path.depth);
+						path.depth = -1;
+					}
+				}
+				else
+				{
+					count_path(path.depth + 1);
+					path.depth = -1;
+				}
+			}
+		}
+
+		// Compact: report finished paths and drop them so the next round regenerates into their slots.
+		for (const path_state& path : paths)
+			if (path.depth < 0)
+				sink(path.i, path.j, path.radiance, path.feature);
+
+		paths.erase(std::remove_if(paths.begin(), paths.end(),
+			[](const path_state& path) { return path.depth < 0; }), paths.end());
+	}
+}
+
+#endif